@@ -0,0 +1,23 @@
+#ifndef ANALYZER_H
+#define ANALYZER_H
+
+#include "def.h"
+
+// Compiles a fn* or let* form that is about to be evaluated in env into
+// a FnForm or LetForm. Forms nested inside it are compiled along with it
+// (see CompiledForm), with their local variable references resolved to
+// the frame slots they will live in. Quoted forms and macro calls are
+// left for EVAL. Returns NULL when the form itself is malformed.
+AST analyzeForm(AST form, EnvPtr env);
+
+// Compiles any form about to be evaluated in env the same way, for the
+// VM, which runs whole top-level forms as bytecode.
+AST analyzeTopLevel(AST form, EnvPtr env);
+
+// What (quasiquote form) expands to for evaluation: the same as EVAL's
+// expansion, except that parts without unquotes are quoted literals
+// instead of being rebuilt with cons. NULL when an unquote or
+// splice-unquote in it is malformed.
+AST expandQuasiquote(AST form);
+
+#endif // ANALYZER_H
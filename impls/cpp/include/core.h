@@ -13,11 +13,16 @@
  * < <= >= > -> treat first two params as numbers, and compare
  */
 
-#include "util.h"
+#include "utils.h"
 #include "def.h"
 #include "environment.h"
 #include "types.h"
+#include "simd.h"
+#include "native.h"
+#include "vm.h"
 
+#include <cctype>
+#include <cmath>
 #include <iterator>
 #include <fstream>
 #include <chrono>
@@ -75,6 +80,10 @@ private:
 #define CHECK_ARGS_AT_LEAST(min)        checkArgsAtLeast(name, min, std::distance(argsBegin, argsEnd));
 
 static std::string printValues(AST_iter begin, AST_iter end, const std::string& sep, bool readably);
+static void writeValues(std::ostream& out, AST_iter begin, AST_iter end, const std::string& sep);
+static AST sortedRange(const std::string& name, AST_iter argsBegin, AST_iter argsEnd, bool reverse);
+static AST lazyOf(AST coll);
+static AST realizeSeq(AST coll);
 static StaticList<BuiltIn*> handlers;
 
 #define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
@@ -103,33 +112,326 @@ static StaticList<BuiltIn*> handlers;
         return type::boolean(*argsBegin == type::constant()); \
     }
 
-#define BUILTIN_INTOP(op, checkDivByZero) \
+// Arithmetic folds all its arguments left to right in one pass. The
+// integer prefix is combined in int64 with overflow checks, and the
+// fold continues in double from the first float argument on.
+#define BUILTIN_NUMOP(op, intOp, identity) \
     BUILTIN(#op) { \
-        CHECK_ARGS_IS(2); \
-        ARG(Integer, lhs); \
-        ARG(Integer, rhs); \
-        if (checkDivByZero) { \
-            if (checkDivByZero && rhs->value() == 0) { \
-                throw LISP_ERROR("Division by zero"); \
+        if ( argsBegin == argsEnd ) { \
+            return type::integer(identity); \
+        } \
+        return foldNumbers(argsBegin, argsEnd, intOp, \
+            [](double lhs, double rhs) { return lhs op rhs; }); \
+    }
+
+// (< a b c) holds when every adjacent pair does
+#define BUILTIN_CMPOP(op) \
+    BUILTIN(#op) { \
+        CHECK_ARGS_AT_LEAST(1); \
+        const Expression* lhs = numberArg(*argsBegin++); \
+        for ( ; argsBegin != argsEnd; ++argsBegin ) { \
+            const Expression* rhs = numberArg(*argsBegin); \
+            const bool holds = isIntegerPair(lhs, rhs) \
+                ? intValue(lhs) op intValue(rhs) \
+                : floatValue(lhs) op floatValue(rhs); \
+            if ( !holds ) { \
+                return type::falseValue(); \
             } \
+            lhs = rhs; \
         } \
-        return type::integer(lhs->value() op rhs->value()); \
+        return type::trueValue(); \
+    }
+
+static const Expression* numberArg(const AST& arg)
+{
+    if ( arg->numberTag() == Expression::NOT_NUMBER ) {
+        throw LISP_ERROR(arg->toString(true), " != Number");
+    }
+    return arg.ptr();
+}
+
+static bool isIntegerPair(const Expression* lhs, const Expression* rhs)
+{
+    return lhs->numberTag() == Expression::INTEGER
+        && rhs->numberTag() == Expression::INTEGER;
+}
+
+static int64_t intValue(const Expression* number)
+{
+    return static_cast<const Integer*>(number)->value();
+}
+
+static double floatValue(const Expression* number)
+{
+    return number->numberTag() == Expression::INTEGER
+        ? static_cast<const Integer*>(number)->value()
+        : static_cast<const Float*>(number)->value();
+}
+
+static int64_t checkedAdd(int64_t lhs, int64_t rhs)
+{
+    int64_t result;
+    if ( __builtin_add_overflow(lhs, rhs, &result) ) {
+        throw LISP_ERROR("Integer overflow");
+    }
+    return result;
+}
+
+static int64_t checkedSub(int64_t lhs, int64_t rhs)
+{
+    int64_t result;
+    if ( __builtin_sub_overflow(lhs, rhs, &result) ) {
+        throw LISP_ERROR("Integer overflow");
+    }
+    return result;
+}
+
+static int64_t checkedMul(int64_t lhs, int64_t rhs)
+{
+    int64_t result;
+    if ( __builtin_mul_overflow(lhs, rhs, &result) ) {
+        throw LISP_ERROR("Integer overflow");
+    }
+    return result;
+}
+
+static int64_t checkedDiv(int64_t lhs, int64_t rhs)
+{
+    if ( rhs == 0 ) {
+        throw LISP_ERROR("Division by zero");
     }
+    if ( rhs == -1 ) {
+        return checkedSub(0, lhs);
+    }
+    return lhs / rhs;
+}
+
+template <class IntOp, class FloatOp>
+static AST foldNumbers(AST_iter argsBegin, AST_iter argsEnd, IntOp intOp, FloatOp floatOp)
+{
+    const Expression* number = numberArg(*argsBegin++);
+    double result;
+
+    if ( number->numberTag() == Expression::INTEGER ) {
+        int64_t intResult = intValue(number);
+        for ( ; argsBegin != argsEnd; ++argsBegin ) {
+            number = argsBegin->ptr();
+            if ( number->numberTag() != Expression::INTEGER ) {
+                break;
+            }
+            intResult = intOp(intResult, intValue(number));
+        }
+
+        if ( argsBegin == argsEnd ) {
+            return type::integer(intResult);
+        }
+        result = intResult;
+    }
+    else {
+        result = floatValue(number);
+    }
+
+    for ( ; argsBegin != argsEnd; ++argsBegin ) {
+        result = floatOp(result, floatValue(numberArg(*argsBegin)));
+    }
+    return type::floating(result);
+}
+
+static AST lazyTake(int64_t n, AST coll)
+{
+    return type::lazySeq([n, coll]() {
+        if ( n <= 0 ) {
+            return type::nilValue();
+        }
+
+        AST seq = lazyOf(coll);
+        const LazySeq* lazy = STATIC_CAST(LazySeq, seq);
+        if ( lazy->isEmpty() ) {
+            return type::nilValue();
+        }
+
+        return type::lazySeq(lazy->first(), lazyTake(n - 1, lazy->rest()));
+    });
+}
+
+static AST lazyDrop(int64_t n, AST coll)
+{
+    return type::lazySeq([n, coll]() {
+        AST seq = lazyOf(coll);
+        for ( int64_t i = 0; i < n; ++i ) {
+            const LazySeq* lazy = STATIC_CAST(LazySeq, seq);
+            if ( lazy->isEmpty() ) {
+                break;
+            }
+            seq = lazyOf(lazy->rest());
+        }
+
+        return seq;
+    });
+}
+
+static AST lazyTakeWhile(AST pred, AST coll)
+{
+    return type::lazySeq([pred, coll]() {
+        AST seq = lazyOf(coll);
+        const LazySeq* lazy = STATIC_CAST(LazySeq, seq);
+        if ( lazy->isEmpty() ) {
+            return type::nilValue();
+        }
+
+        AST_vec args(1, lazy->first());
+        if ( !APPLY(pred, args.begin(), args.end())->isTrue() ) {
+            return type::nilValue();
+        }
+
+        return type::lazySeq(args[0], lazyTakeWhile(pred, lazy->rest()));
+    });
+}
+
+static AST lazyIterate(AST op, AST value)
+{
+    return type::lazySeq(value, type::lazySeq([op, value]() {
+        AST_vec args(1, value);
+        return lazyIterate(op, APPLY(op, args.begin(), args.end()));
+    }));
+}
+
+static AST lazyRepeat(int64_t n, AST value)
+{
+    // a negative count repeats forever
+    return type::lazySeq([n, value]() {
+        if ( n == 0 ) {
+            return type::nilValue();
+        }
+
+        return type::lazySeq(value, lazyRepeat(n < 0 ? n : n - 1, value));
+    });
+}
+
+static AST lazyCycle(AST coll, AST current)
+{
+    return type::lazySeq([coll, current]() {
+        AST seq = lazyOf(current);
+        if ( STATIC_CAST(LazySeq, seq)->isEmpty() ) {
+            seq = lazyOf(coll);
+            if ( STATIC_CAST(LazySeq, seq)->isEmpty() ) {
+                return type::nilValue();
+            }
+        }
+
+        const LazySeq* lazy = STATIC_CAST(LazySeq, seq);
+        return type::lazySeq(lazy->first(), lazyCycle(coll, lazy->rest()));
+    });
+}
+
+static AST lazyMap(AST op, AST coll)
+{
+    return type::lazySeq([op, coll]() {
+        AST_vec buffer;
+        AST_iter it, end;
+        AST rest;
+        if ( !LazySeq::nextChunk(coll, it, end, buffer, rest) ) {
+            return type::nilValue();
+        }
+
+        ItemBufferPtr chunk(new ItemBuffer);
+        chunk->items.reserve(end - it);
+        for ( ; it != end; ++it ) {
+            chunk->items.push_back(APPLY(op, it, it + 1));
+        }
+
+        return AST(new LazySeq(chunk, 0, lazyMap(op, rest)));
+    });
+}
+
+static AST lazyFilter(AST pred, AST coll)
+{
+    return type::lazySeq([pred, coll]() {
+        AST_vec buffer;
+        AST_iter it, end;
+        AST cell = coll;
+        ItemBufferPtr chunk(new ItemBuffer);
+
+        // skip over blocks where nothing matches without nesting cells;
+        // cell holds the block being read
+        while ( chunk->items.empty() ) {
+            AST rest;
+            if ( !LazySeq::nextChunk(cell, it, end, buffer, rest) ) {
+                return type::nilValue();
+            }
+
+            for ( ; it != end; ++it ) {
+                if ( APPLY(pred, it, it + 1)->isTrue() ) {
+                    chunk->items.push_back(*it);
+                }
+            }
+            cell = rest;
+        }
+
+        return AST(new LazySeq(chunk, 0, lazyFilter(pred, cell)));
+    });
+}
+
+// the items of coll, then those of colls from index next on
+static AST lazyConcat(ItemBufferPtr colls, size_t next, AST coll)
+{
+    return type::lazySeq([colls, next, coll]() {
+        AST_vec items;
+        AST rest = coll;
+        size_t index = next;
+        ItemBufferPtr chunk(new ItemBuffer);
+        chunk->items.reserve(LazySeq::CHUNK_SIZE);
+
+        // fill a whole chunk even from sources made of single cells,
+        // moving on past collections that are used up
+        while ( chunk->items.size() < (size_t)LazySeq::CHUNK_SIZE ) {
+            if ( LazySeq::nextChunk(rest, items, rest) ) {
+                chunk->items.insert(chunk->items.end(), items.begin(), items.end());
+            }
+            else if ( index < colls->items.size() ) {
+                rest = colls->items[index++];
+            }
+            else {
+                break;
+            }
+        }
+
+        if ( chunk->items.empty() ) {
+            return type::nilValue();
+        }
+        return AST(new LazySeq(chunk, 0, lazyConcat(colls, index, rest)));
+    });
+}
 
 BUILTIN_ISA("atom?", Atom);
 BUILTIN_ISA("keyword?", Keyword);
 BUILTIN_ISA("list?", List);
-BUILTIN_ISA("map?", Hash);
-BUILTIN_ISA("number?", Integer);
-BUILTIN_ISA("sequential?", Sequence);
+BUILTIN_ISA("record?", Record);
+BUILTIN_ISA("queue?", Queue);
+BUILTIN_ISA("set?", Set);
+BUILTIN_ISA("sorted?", Sorted);
 BUILTIN_ISA("string?", String);
 BUILTIN_ISA("symbol?", Symbol);
 BUILTIN_ISA("vector?", Vector);
 
-BUILTIN_INTOP(+, false);
-BUILTIN_INTOP(/, true);
-BUILTIN_INTOP(*, false);
-BUILTIN_INTOP(%, true);
+BUILTIN("sequential?")
+{
+    CHECK_ARGS_IS(1);
+    AST arg = *argsBegin;
+    return type::boolean(DYNAMIC_CAST(Sequence, arg) || DYNAMIC_CAST(Range, arg)
+                         || DYNAMIC_CAST(LazySeq, arg));
+}
+
+BUILTIN_ISA("float?", Float);
+BUILTIN_ISA("integer?", Integer);
+
+BUILTIN_NUMOP(+, checkedAdd, 0);
+BUILTIN_NUMOP(*, checkedMul, 1);
+
+BUILTIN_CMPOP(<=);
+BUILTIN_CMPOP(>=);
+BUILTIN_CMPOP(<);
+BUILTIN_CMPOP(>);
 
 BUILTIN_IS("true?", trueValue);
 BUILTIN_IS("false?", falseValue);
@@ -137,186 +439,1195 @@ BUILTIN_IS("nil?", nilValue);
 
 BUILTIN("-")
 {
-    int argCount = CHECK_ARGS_BETWEEN(1, 2);
-    ARG(Integer, lhs);
+    int argCount = CHECK_ARGS_AT_LEAST(1);
+    if ( argCount == 1 ) {
+        const Expression* number = numberArg(*argsBegin);
+        return number->numberTag() == Expression::INTEGER
+            ? type::integer(checkedSub(0, intValue(number)))
+            : type::floating(-floatValue(number));
+    }
+
+    return foldNumbers(argsBegin, argsEnd, checkedSub,
+        [](double lhs, double rhs) { return lhs - rhs; });
+}
 
+BUILTIN("/")
+{
+    int argCount = CHECK_ARGS_AT_LEAST(1);
     if ( argCount == 1 ) {
-        return type::integer(-lhs->value());
+        const Expression* number = numberArg(*argsBegin);
+        return number->numberTag() == Expression::INTEGER
+            ? type::integer(checkedDiv(1, intValue(number)))
+            : type::floating(1 / floatValue(number));
+    }
+
+    return foldNumbers(argsBegin, argsEnd, checkedDiv,
+        [](double lhs, double rhs) { return lhs / rhs; });
+}
+
+BUILTIN("%")
+{
+    CHECK_ARGS_IS(2);
+    const Expression* lhs = numberArg(*argsBegin++);
+    const Expression* rhs = numberArg(*argsBegin++);
+
+    if ( isIntegerPair(lhs, rhs) ) {
+        if ( intValue(rhs) == 0 ) {
+            throw LISP_ERROR("Division by zero");
+        }
+        // INT64_MIN % -1 overflows in C++ even though the result is 0
+        return type::integer(intValue(rhs) == -1 ? 0 : intValue(lhs) % intValue(rhs));
+    }
+    return type::floating(std::fmod(floatValue(lhs), floatValue(rhs)));
+}
+
+BUILTIN("map?")
+{
+    CHECK_ARGS_IS(1);
+    return type::boolean(DYNAMIC_CAST(Hash, *argsBegin) || DYNAMIC_CAST(Record, *argsBegin));
+}
+
+BUILTIN("number?")
+{
+    CHECK_ARGS_IS(1);
+    return type::boolean((*argsBegin)->numberTag() != Expression::NOT_NUMBER);
+}
+
+BUILTIN("int")
+{
+    CHECK_ARGS_IS(1);
+    const Expression* number = numberArg(*argsBegin);
+    if ( number->numberTag() == Expression::INTEGER ) {
+        return *argsBegin;
+    }
+
+    const double value = floatValue(number);
+    if ( !(value > -9.3e18 && value < 9.3e18) ) {
+        throw LISP_ERROR(Float::format(value), " does not fit an integer");
     }
+    return type::integer((int64_t)value);
+}
 
-    ARG(Integer, rhs);
-    return type::integer(lhs->value() - rhs->value());
+BUILTIN("double")
+{
+    CHECK_ARGS_IS(1);
+    return type::floating(floatValue(numberArg(*argsBegin)));
 }
 
-BUILTIN("<=")
+BUILTIN("=")
 {
     CHECK_ARGS_IS(2);
-    ARG(Integer, lhs);
-    ARG(Integer, rhs);
+    const Expression* lhs = (*argsBegin++).ptr();
+    const Expression* rhs = (*argsBegin++).ptr();
+
+    return type::boolean(lhs->isEqualTo(rhs));
+}
+
+BUILTIN("list")
+{
+    return type::list(argsBegin, argsEnd);
+}
+
+BUILTIN("empty?")
+{
+    CHECK_ARGS_IS(1);
+    if ( const Set* set = DYNAMIC_CAST(Set, *argsBegin) ) {
+        return type::boolean(set->count() == 0);
+    }
+
+    if ( const Sorted* sorted = DYNAMIC_CAST(Sorted, *argsBegin) ) {
+        return type::boolean(sorted->count() == 0);
+    }
+
+    if ( const Queue* queue = DYNAMIC_CAST(Queue, *argsBegin) ) {
+        return type::boolean(queue->count() == 0);
+    }
+
+    if ( const LazySeq* lazy = DYNAMIC_CAST(LazySeq, *argsBegin) ) {
+        return type::boolean(lazy->isEmpty());
+    }
+
+    if ( const Range* range = DYNAMIC_CAST(Range, *argsBegin) ) {
+        return type::boolean(range->isEmpty());
+    }
+
+    if ( const Record* record = DYNAMIC_CAST(Record, *argsBegin) ) {
+        return type::boolean(record->count() == 0);
+    }
+
+    ARG(Sequence, seq);
+
+    return type::boolean(seq->isEmpty());
+}
+
+BUILTIN("count")
+{
+    CHECK_ARGS_IS(1);
+    if ( *argsBegin == type::nilValue() ) {
+        return type::integer(0);
+    }
+
+    if ( const Transient* transient = DYNAMIC_CAST(Transient, *argsBegin) ) {
+        return type::integer(transient->count());
+    }
+
+    if ( const Set* set = DYNAMIC_CAST(Set, *argsBegin) ) {
+        return type::integer(set->count());
+    }
+
+    if ( const Sorted* sorted = DYNAMIC_CAST(Sorted, *argsBegin) ) {
+        return type::integer(sorted->count());
+    }
+
+    if ( const Queue* queue = DYNAMIC_CAST(Queue, *argsBegin) ) {
+        return type::integer(queue->count());
+    }
+
+    if ( const Range* range = DYNAMIC_CAST(Range, *argsBegin) ) {
+        return type::integer(range->count());
+    }
+
+    if ( const Record* record = DYNAMIC_CAST(Record, *argsBegin) ) {
+        return type::integer(record->count());
+    }
+
+    if ( DYNAMIC_CAST(LazySeq, *argsBegin) ) {
+        int64_t count = 0;
+        AST_vec chunk;
+        for ( AST cell = *argsBegin; LazySeq::nextChunk(cell, chunk, cell); ) {
+            count += chunk.size();
+        }
+        return type::integer(count);
+    }
+
+    if ( const String* str = DYNAMIC_CAST(String, *argsBegin) ) {
+        return type::integer(str->length());
+    }
+
+    ARG(Sequence, seq);
+    return type::integer(seq->count());
+}
+
+BUILTIN("str")
+{
+    size_t length = 0;
+    for ( AST_iter it = argsBegin; it != argsEnd; ++it ) {
+        if ( const String* str = DYNAMIC_CAST(String, *it) ) {
+            length += str->length();
+        }
+    }
+    if ( length < String::ROPE_THRESHOLD ) {
+        return type::string(printValues(argsBegin, argsEnd, "", false));
+    }
+
+    // long results share the argument strings instead of copying them
+    AST result = type::string("");
+    for ( ; argsBegin != argsEnd; ++argsBegin ) {
+        AST piece = DYNAMIC_CAST(String, *argsBegin)
+                  ? *argsBegin : type::string((*argsBegin)->toString(false));
+        if ( STATIC_CAST(String, piece)->length() == 0 ) {
+            continue;
+        }
+        result = STATIC_CAST(String, result)->length() == 0
+               ? piece : type::rope(result, piece);
+    }
+    return result;
+}
+
+BUILTIN("pr-str")
+{
+    return type::string(printValues(argsBegin, argsEnd, " ", true));
+}
+
+BUILTIN("prn")
+{
+    std::cout << printValues(argsBegin, argsEnd, " ", true) << "\n";
+    return type::nilValue();
+}
+
+BUILTIN("println")
+{
+    writeValues(std::cout, argsBegin, argsEnd, " ");
+    std::cout << "\n";
+    return type::nilValue();
+}
+
+BUILTIN("apply")
+{
+    CHECK_ARGS_AT_LEAST(2);
+    AST op = *argsBegin++;
+
+    // Copy the first N-1 arguments in.
+    AST_vec args(argsBegin, argsEnd-1);
+
+    // Then append the argument as a list.
+    AST lastSeq = realizeSeq(*(argsEnd-1));
+    const Sequence* lastArg = VALUE_CAST(Sequence, lastSeq);
+    for ( size_t i = 0; i < lastArg->count(); i++ ) {
+        args.push_back(lastArg->item(i));
+    }
+
+    return APPLY(op, args.begin(), args.end());
+}
+
+BUILTIN("assoc")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    if ( const Sorted* sorted = DYNAMIC_CAST(Sorted, *argsBegin) ) {
+        return sorted->assoc(argsBegin + 1, argsEnd);
+    }
+
+    if ( const Record* record = DYNAMIC_CAST(Record, *argsBegin) ) {
+        return record->assoc(argsBegin + 1, argsEnd);
+    }
+
+    ARG(Hash, hash);
+    return hash->assoc(argsBegin, argsEnd);
+}
+
+BUILTIN("atom")
+{
+    CHECK_ARGS_IS(1);
+    return type::atom(*argsBegin);
+}
+
+BUILTIN("eval")
+{
+    CHECK_ARGS_IS(1);
+    return EVAL(*argsBegin, NULL);
+}
+
+// runs the module malc made from a file instead of the file, if one is
+// linked in, see native.h
+BUILTIN("load-native")
+{
+    CHECK_ARGS_IS(1);
+    ARG(String, filename);
+
+    return type::boolean(native::load(filename->value()));
+}
+
+// the bytecode of a function compiled by the VM engine, as text
+BUILTIN("disassemble")
+{
+    CHECK_ARGS_IS(1);
+    ARG(Lambda, lambda);
+
+    // without --engine=vm, the bytecode the VM would run the body as
+    AST body = lambda->getBody();
+    if ( !DYNAMIC_CAST(vm::Chunk, body) ) {
+        if ( !lambda->isAnalyzed() ) {
+            throw LISP_ERROR(lambda->toString(true), " was not analyzed, so has no bytecode");
+        }
+        body = vm::compile(body);
+    }
+    return type::string(STATIC_CAST(vm::Chunk, body)->disassemble());
+}
+
+BUILTIN("fn?")
+{
+    CHECK_ARGS_IS(1);
+    AST arg = *argsBegin++;
+
+    if ( const Lambda* lambda = dynamic_cast<Lambda*>(arg.ptr()) ) {
+        return type::boolean(!lambda->isMacro());
+    }
+
+    return type::boolean(dynamic_cast<BuiltIn*>(arg.ptr())
+                         || dynamic_cast<native::Function*>(arg.ptr()));
+}
+
+BUILTIN("vals")
+{
+    CHECK_ARGS_IS(1);
+    if ( const Sorted* sorted = DYNAMIC_CAST(Sorted, *argsBegin) ) {
+        return sorted->values();
+    }
+
+    if ( const Record* record = DYNAMIC_CAST(Record, *argsBegin) ) {
+        return record->values();
+    }
+
+    ARG(Hash, hash);
+    return hash->values();
+}
+
+BUILTIN("vec")
+{
+    CHECK_ARGS_IS(1);
+    AST source = realizeSeq(*argsBegin);
+    const Sequence* s = VALUE_CAST(Sequence, source);
+    return type::vector(s->begin(), s->end());
+}
+
+BUILTIN("vector")
+{
+    return type::vector(argsBegin, argsEnd);
+}
+
+BUILTIN("set")
+{
+    CHECK_ARGS_IS(1);
+    AST arg = *argsBegin;
+
+    if ( arg == type::nilValue() ) {
+        return type::set(argsEnd, argsEnd, true);
+    }
+
+    if ( DYNAMIC_CAST(Set, arg) ) {
+        return arg;
+    }
+
+    AST source = realizeSeq(arg);
+    const Sequence* seq = VALUE_CAST(Sequence, source);
+    return type::set(seq->begin(), seq->end(), true);
+}
+
+BUILTIN("disj")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    if ( const Sorted* sorted = DYNAMIC_CAST(Sorted, *argsBegin) ) {
+        return sorted->dissoc(argsBegin + 1, argsEnd);
+    }
+
+    ARG(Set, set);
+    return set->disj(argsBegin, argsEnd);
+}
+
+BUILTIN("union")
+{
+    if ( argsBegin == argsEnd ) {
+        return type::set(argsEnd, argsEnd, true);
+    }
+
+    AST result = *argsBegin;
+    VALUE_CAST(Set, result);
+    for ( ++argsBegin; argsBegin != argsEnd; ) {
+        ARG(Set, rhs);
+        result = STATIC_CAST(Set, result)->unite(rhs);
+    }
+
+    return result;
+}
+
+BUILTIN("intersection")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    AST result = *argsBegin;
+    VALUE_CAST(Set, result);
+    for ( ++argsBegin; argsBegin != argsEnd; ) {
+        ARG(Set, rhs);
+        result = STATIC_CAST(Set, result)->intersect(rhs);
+    }
+
+    return result;
+}
+
+BUILTIN("difference")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    AST result = *argsBegin;
+    VALUE_CAST(Set, result);
+    for ( ++argsBegin; argsBegin != argsEnd; ) {
+        ARG(Set, rhs);
+        result = STATIC_CAST(Set, result)->subtract(rhs);
+    }
+
+    return result;
+}
+
+BUILTIN("sorted-map")
+{
+    return type::sorted(NULL, true, argsBegin, argsEnd);
+}
+
+BUILTIN("sorted-map-by")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    AST comparator = *argsBegin++;
+    return type::sorted(comparator, true, argsBegin, argsEnd);
+}
+
+BUILTIN("sorted-set")
+{
+    return type::sorted(NULL, false, argsBegin, argsEnd);
+}
+
+BUILTIN("sorted-set-by")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    AST comparator = *argsBegin++;
+    return type::sorted(comparator, false, argsBegin, argsEnd);
+}
+
+BUILTIN("compare")
+{
+    CHECK_ARGS_IS(2);
+    return type::integer(Sorted::defaultCompare(*argsBegin, *(argsBegin + 1)));
+}
+
+BUILTIN("subseq")
+{
+    return sortedRange(name, argsBegin, argsEnd, false);
+}
+
+BUILTIN("rsubseq")
+{
+    return sortedRange(name, argsBegin, argsEnd, true);
+}
+
+BUILTIN("queue")
+{
+    return type::queue(argsBegin, argsEnd);
+}
+
+BUILTIN("peek")
+{
+    CHECK_ARGS_IS(1);
+    if ( *argsBegin == type::nilValue() ) {
+        return type::nilValue();
+    }
+    ARG(Queue, queue);
+    return queue->peek();
+}
+
+BUILTIN("pop")
+{
+    CHECK_ARGS_IS(1);
+    ARG(Queue, queue);
+    return queue->pop();
+}
+
+BUILTIN("lazy-seq*")
+{
+    CHECK_ARGS_IS(1);
+    AST op = *argsBegin;
+    return type::lazySeq([op]() {
+        AST_vec args;
+        return APPLY(op, args.begin(), args.end());
+    });
+}
+
+BUILTIN("filter")
+{
+    CHECK_ARGS_IS(2);
+    AST pred = *argsBegin++;
+    AST coll = *argsBegin;
+
+    // like map, filter is lazy only over lazy or infinite sources
+    const Range* range = DYNAMIC_CAST(Range, coll);
+    if ( DYNAMIC_CAST(LazySeq, coll) || (range && range->isInfinite()) ) {
+        return lazyFilter(pred, coll);
+    }
+    if ( !range ) {
+        coll = realizeSeq(coll);
+    }
+
+    AST_vec* items = new AST_vec();
+    AST_vec chunk;
+    while ( LazySeq::nextChunk(coll, chunk, coll) ) {
+        for ( auto it = chunk.begin(), end = chunk.end(); it != end; ++it ) {
+            if ( APPLY(pred, it, it + 1)->isTrue() ) {
+                items->push_back(*it);
+            }
+        }
+    }
+
+    return type::list(items);
+}
+
+BUILTIN("take")
+{
+    CHECK_ARGS_IS(2);
+    ARG(Integer, n);
+    if ( const Range* range = DYNAMIC_CAST(Range, *argsBegin) ) {
+        return range->take(n->value());
+    }
+
+    return lazyTake(n->value(), *argsBegin);
+}
+
+BUILTIN("drop")
+{
+    CHECK_ARGS_IS(2);
+    ARG(Integer, n);
+    AST coll = *argsBegin;
+
+    if ( const Range* range = DYNAMIC_CAST(Range, coll) ) {
+        return range->drop(n->value());
+    }
+
+    if ( DYNAMIC_CAST(Sequence, coll) ) {
+        return AST(new LazySeq(coll, std::max<int64_t>(n->value(), 0)));
+    }
+
+    return lazyDrop(n->value(), coll);
+}
+
+BUILTIN("take-while")
+{
+    CHECK_ARGS_IS(2);
+    AST pred = *argsBegin++;
+    return lazyTakeWhile(pred, *argsBegin);
+}
+
+BUILTIN("iterate")
+{
+    CHECK_ARGS_IS(2);
+    AST op = *argsBegin++;
+    return lazyIterate(op, *argsBegin);
+}
+
+BUILTIN("repeat")
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    if ( argCount == 1 ) {
+        return lazyRepeat(-1, *argsBegin);
+    }
+
+    ARG(Integer, n);
+    return lazyRepeat(std::max<int64_t>(n->value(), 0), *argsBegin);
+}
+
+BUILTIN("cycle")
+{
+    CHECK_ARGS_IS(1);
+    return lazyCycle(*argsBegin, *argsBegin);
+}
+
+BUILTIN("range")
+{
+    int argCount = CHECK_ARGS_BETWEEN(0, 3);
+    if ( argCount == 0 ) {
+        return AST(new Range(0, 0, 1, true));
+    }
+
+    if ( argCount == 1 ) {
+        ARG(Integer, end);
+        return type::range(0, end->value(), 1);
+    }
+
+    ARG(Integer, start);
+    ARG(Integer, end);
+    if ( argCount == 2 ) {
+        return type::range(start->value(), end->value(), 1);
+    }
+
+    ARG(Integer, step);
+    return type::range(start->value(), end->value(), step->value());
+}
+
+BUILTIN("reduce")
+{
+    int argCount = CHECK_ARGS_BETWEEN(2, 3);
+    AST op = *argsBegin++;
+    AST_vec args(2);
+    bool hasInit = argCount == 3;
+    if ( hasInit ) {
+        args[0] = *argsBegin++;
+    }
+    AST coll = *argsBegin;
+
+    if ( const Range* range = DYNAMIC_CAST(Range, coll) ) {
+        if ( range->isInfinite() ) {
+            throw LISP_ERROR("reduce not supported on infinite range");
+        }
+
+        int64_t i = 0;
+        const int64_t length = range->count();
+        if ( !hasInit ) {
+            if ( length == 0 ) {
+                return APPLY(op, args.end(), args.end());
+            }
+            args[0] = type::integer(range->at(i++));
+        }
+
+        for ( ; i < length; ++i ) {
+            args[1] = type::integer(range->at(i));
+            args[0] = APPLY(op, args.begin(), args.end());
+        }
+
+        return args[0];
+    }
+
+    if ( coll == type::nilValue() ) {
+        return hasInit ? args[0] : APPLY(op, args.end(), args.end());
+    }
+
+    if ( DYNAMIC_CAST(LazySeq, coll) ) {
+        AST_vec buffer;
+        AST_iter it, end;
+
+        // cell holds the block being read
+        for ( AST cell = coll; LazySeq::nextChunk(cell, it, end, buffer, coll); cell = coll ) {
+            if ( !hasInit ) {
+                args[0] = *it++;
+                hasInit = true;
+            }
+
+            for ( ; it != end; ++it ) {
+                args[1] = *it;
+                args[0] = APPLY(op, args.begin(), args.end());
+            }
+        }
+
+        return hasInit ? args[0] : APPLY(op, args.end(), args.end());
+    }
+
+    coll = realizeSeq(coll);
+    const Sequence* seq = VALUE_CAST(Sequence, coll);
+    auto it = seq->begin(), end = seq->end();
+    if ( !hasInit ) {
+        if ( it == end ) {
+            return APPLY(op, args.end(), args.end());
+        }
+        args[0] = *it++;
+    }
+
+    for ( ; it != end; ++it ) {
+        args[1] = *it;
+        args[0] = APPLY(op, args.begin(), args.end());
+    }
+
+    return args[0];
+}
+
+// (int-array n), (int-array n init) or (int-array coll), same for doubles
+static AST numArrayOf(NumArray::Kind kind, const std::string& name,
+    AST_iter argsBegin, AST_iter argsEnd)
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    AST arg = *argsBegin++;
+
+    if ( const Integer* size = DYNAMIC_CAST(Integer, arg) ) {
+        if ( size->value() < 0 ) {
+            throw LISP_ERROR("Negative array size");
+        }
+
+        AST result = type::numArray(kind, size->value());
+        if ( argCount == 2 ) {
+            NumArray* array = STATIC_CAST(NumArray, result);
+            for ( size_t i = 0; i < array->count(); ++i ) {
+                array->setItem(i, *argsBegin);
+            }
+        }
+        return result;
+    }
+
+    checkArgsIs(name, 1, argCount);
+    AST result = type::numArray(kind, 0);
+    NumArray* array = STATIC_CAST(NumArray, result);
+    AST_vec chunk;
+    while ( LazySeq::nextChunk(arg, chunk, arg) ) {
+        const size_t offset = array->count();
+        array->resize(offset + chunk.size());
+        for ( size_t i = 0; i < chunk.size(); ++i ) {
+            array->setItem(offset + i, chunk[i]);
+        }
+    }
+
+    return result;
+}
+
+static void checkSameShape(const std::string& name, const NumArray* a, const NumArray* b)
+{
+    if ( a->kind() != b->kind() || a->count() != b->count() ) {
+        throw LISP_ERROR("\"", name, "\" expects arrays of the same type and length");
+    }
+}
+
+BUILTIN_ISA("array?", NumArray);
+
+BUILTIN("int-array")
+{
+    return numArrayOf(NumArray::INT, name, argsBegin, argsEnd);
+}
+
+BUILTIN("double-array")
+{
+    return numArrayOf(NumArray::DOUBLE, name, argsBegin, argsEnd);
+}
+
+BUILTIN("alength")
+{
+    CHECK_ARGS_IS(1);
+    ARG(NumArray, array);
+    return type::integer(array->count());
+}
+
+BUILTIN("aget")
+{
+    CHECK_ARGS_IS(2);
+    ARG(NumArray, array);
+    ARG(Integer, index);
+    if ( index->value() < 0 ) {
+        throw LISP_ERROR("Index out of range");
+    }
+
+    return array->item(index->value());
+}
+
+BUILTIN("aset!")
+{
+    CHECK_ARGS_IS(3);
+    ARG(NumArray, array);
+    ARG(Integer, index);
+    if ( index->value() < 0 ) {
+        throw LISP_ERROR("Index out of range");
+    }
+
+    array->setItem(index->value(), *argsBegin);
+    return *argsBegin;
+}
+
+BUILTIN("asum")
+{
+    CHECK_ARGS_IS(1);
+    ARG(NumArray, array);
+    if ( array->kind() == NumArray::INT ) {
+        int64_t result;
+        if ( !simd::sum(array->ints(), array->count(), result) ) {
+            throw LISP_ERROR("Integer overflow");
+        }
+        return type::integer(result);
+    }
+    return type::floating(simd::sum(array->doubles(), array->count()));
+}
+
+BUILTIN("amin")
+{
+    CHECK_ARGS_IS(1);
+    ARG(NumArray, array);
+    if ( array->count() == 0 ) {
+        throw LISP_ERROR("amin of an empty array");
+    }
+
+    if ( array->kind() == NumArray::INT ) {
+        return type::integer(simd::min(array->ints(), array->count()));
+    }
+    return type::floating(simd::min(array->doubles(), array->count()));
+}
+
+BUILTIN("amax")
+{
+    CHECK_ARGS_IS(1);
+    ARG(NumArray, array);
+    if ( array->count() == 0 ) {
+        throw LISP_ERROR("amax of an empty array");
+    }
+
+    if ( array->kind() == NumArray::INT ) {
+        return type::integer(simd::max(array->ints(), array->count()));
+    }
+    return type::floating(simd::max(array->doubles(), array->count()));
+}
+
+BUILTIN("adot")
+{
+    CHECK_ARGS_IS(2);
+    ARG(NumArray, a);
+    ARG(NumArray, b);
+    checkSameShape(name, a, b);
+
+    if ( a->kind() == NumArray::INT ) {
+        int64_t result;
+        if ( !simd::dot(a->ints(), b->ints(), a->count(), result) ) {
+            throw LISP_ERROR("Integer overflow");
+        }
+        return type::integer(result);
+    }
+    return type::floating(simd::dot(a->doubles(), b->doubles(), a->count()));
+}
+
+BUILTIN("a+")
+{
+    CHECK_ARGS_IS(2);
+    ARG(NumArray, a);
+    ARG(NumArray, b);
+    checkSameShape(name, a, b);
+
+    AST result = type::numArray(a->kind(), a->count());
+    NumArray* out = STATIC_CAST(NumArray, result);
+    if ( a->kind() == NumArray::INT ) {
+        if ( !simd::add(a->ints(), b->ints(), out->ints(), a->count()) ) {
+            throw LISP_ERROR("Integer overflow");
+        }
+    }
+    else {
+        simd::add(a->doubles(), b->doubles(), out->doubles(), a->count());
+    }
+    return result;
+}
+
+BUILTIN("a*")
+{
+    CHECK_ARGS_IS(2);
+    ARG(NumArray, a);
+    ARG(NumArray, b);
+    checkSameShape(name, a, b);
+
+    AST result = type::numArray(a->kind(), a->count());
+    NumArray* out = STATIC_CAST(NumArray, result);
+    if ( a->kind() == NumArray::INT ) {
+        if ( !simd::mul(a->ints(), b->ints(), out->ints(), a->count()) ) {
+            throw LISP_ERROR("Integer overflow");
+        }
+    }
+    else {
+        simd::mul(a->doubles(), b->doubles(), out->doubles(), a->count());
+    }
+    return result;
+}
+
+BUILTIN("afilter-gt")
+{
+    CHECK_ARGS_IS(2);
+    ARG(NumArray, array);
+    const Expression* limit = numberArg(*argsBegin);
+
+    AST result = type::numArray(array->kind(), array->count());
+    NumArray* out = STATIC_CAST(NumArray, result);
+    if ( array->kind() == NumArray::DOUBLE ) {
+        out->resize(simd::filterGreater(array->doubles(), array->count(),
+            floatValue(limit), out->doubles()));
+        return result;
+    }
+
+    // an integer is greater than x exactly when it is greater than floor(x)
+    int64_t bound;
+    if ( limit->numberTag() == Expression::INTEGER ) {
+        bound = intValue(limit);
+    }
+    else {
+        // floor(x) fits in an int64 from -2^63 up to just below 2^63; past
+        // either end no item, or every item, is greater
+        const double floor = std::floor(floatValue(limit));
+        if ( std::isnan(floor) || floor >= 0x1p63 ) {
+            out->resize(0);
+            return result;
+        }
+        if ( floor < -0x1p63 ) {
+            std::copy(array->ints(), array->ints() + array->count(), out->ints());
+            return result;
+        }
+        bound = (int64_t)floor;
+    }
+
+    out->resize(simd::filterGreater(array->ints(), array->count(), bound, out->ints()));
+    return result;
+}
+
+BUILTIN("record-type*")
+{
+    CHECK_ARGS_IS(2);
+    ARG(String, recordName);
+    ARG(Sequence, fields);
+    return AST(new RecordType(recordName->value(), fields->begin(), fields->end()));
+}
+
+BUILTIN("map->record*")
+{
+    CHECK_ARGS_IS(2);
+    ARG(RecordType, recordType);
+    return recordType->fromMap(*argsBegin);
+}
+
+// The string builtins work on byte offsets, like count and seq do, and
+// copy each result out of the argument text in one piece.
+
+static size_t stringIndex(AST arg, size_t length)
+{
+    const Integer* index = VALUE_CAST(Integer, arg);
+    if ( index->value() < 0 || (uint64_t)index->value() > length ) {
+        throw LISP_ERROR("Index out of range");
+    }
+
+    return index->value();
+}
+
+static AST changeCase(const String* str, int (*convert)(int))
+{
+    std::string text = str->value();
+    for ( char& c : text ) {
+        c = convert((unsigned char)c);
+    }
+    return type::string(std::move(text));
+}
+
+BUILTIN("subs")
+{
+    int argCount = CHECK_ARGS_BETWEEN(2, 3);
+    ARG(String, str);
+    const std::string& text = str->value();
+
+    size_t start = stringIndex(*argsBegin++, text.size());
+    size_t end = argCount == 3 ? stringIndex(*argsBegin, text.size()) : text.size();
+    if ( end < start ) {
+        throw LISP_ERROR("Index out of range");
+    }
 
-    return type::boolean(lhs->value() <= rhs->value());
+    return type::string(text.substr(start, end - start));
 }
 
-BUILTIN(">=")
+BUILTIN("join")
 {
-    CHECK_ARGS_IS(2);
-    ARG(Integer, lhs);
-    ARG(Integer, rhs);
+    static const std::string noSeparator;
 
-    return type::boolean(lhs->value() >= rhs->value());
-}
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    const std::string* separator = &noSeparator;
+    if ( argCount == 2 ) {
+        ARG(String, sep);
+        separator = &sep->value();
+    }
 
-BUILTIN("<")
-{
-    CHECK_ARGS_IS(2);
-    ARG(Integer, lhs);
-    ARG(Integer, rhs);
+    if ( *argsBegin == type::nilValue() ) {
+        return type::string("");
+    }
 
-    return type::boolean(lhs->value() < rhs->value());
+    AST items = realizeSeq(*argsBegin);
+    const Sequence* seq = VALUE_CAST(Sequence, items);
+    return type::string(printValues(seq->begin(), seq->end(), *separator, false));
 }
 
-BUILTIN(">")
+BUILTIN("split")
 {
     CHECK_ARGS_IS(2);
-    ARG(Integer, lhs);
-    ARG(Integer, rhs);
+    ARG(String, str);
+    ARG(String, sep);
+    const std::string& text = str->value();
+    const std::string& separator = sep->value();
+
+    AST_vec* parts = new AST_vec;
+    if ( separator.empty() ) {
+        for ( char c : text ) {
+            parts->push_back(type::character(c));
+        }
+        return type::vector(parts);
+    }
 
-    return type::boolean(lhs->value() > rhs->value());
+    size_t start = 0;
+    for ( size_t found; (found = text.find(separator, start)) != std::string::npos; ) {
+        parts->push_back(type::string(text.substr(start, found - start)));
+        start = found + separator.size();
+    }
+    parts->push_back(type::string(text.substr(start)));
+
+    return type::vector(parts);
 }
 
-BUILTIN("=")
+BUILTIN("index-of")
 {
-    CHECK_ARGS_IS(2);
-    const Expression* lhs = (*argsBegin++).ptr();
-    const Expression* rhs = (*argsBegin++).ptr();
+    int argCount = CHECK_ARGS_BETWEEN(2, 3);
+    ARG(String, str);
+    ARG(String, value);
+    const std::string& text = str->value();
 
-    return type::boolean(lhs->isEqualTo(rhs));
+    size_t from = argCount == 3 ? stringIndex(*argsBegin, text.size()) : 0;
+    size_t found = text.find(value->value(), from);
+    return found == std::string::npos ? type::nilValue() : type::integer(found);
 }
 
-BUILTIN("list")
+BUILTIN("upper-case")
 {
-    return type::list(argsBegin, argsEnd);
+    CHECK_ARGS_IS(1);
+    ARG(String, str);
+    return changeCase(str, ::toupper);
 }
 
-BUILTIN("empty?")
+BUILTIN("lower-case")
 {
     CHECK_ARGS_IS(1);
-    ARG(Sequence, seq);
-
-    return type::boolean(seq->isEmpty());
+    ARG(String, str);
+    return changeCase(str, ::tolower);
 }
 
-BUILTIN("count")
+BUILTIN("trim")
 {
     CHECK_ARGS_IS(1);
-    if ( *argsBegin == type::nilValue() ) {
-        return type::integer(0);
+    ARG(String, str);
+    const std::string& text = str->value();
+
+    static const char* whitespace = " \t\n\r\f\v";
+    size_t start = text.find_first_not_of(whitespace);
+    if ( start == std::string::npos ) {
+        return type::string("");
     }
 
-    ARG(Sequence, seq);
-    return type::integer(seq->count());
+    size_t end = text.find_last_not_of(whitespace) + 1;
+    return type::string(text.substr(start, end - start));
 }
 
-BUILTIN("str")
+BUILTIN("starts-with?")
 {
-    return type::string(printValues(argsBegin, argsEnd, "", false));
+    CHECK_ARGS_IS(2);
+    ARG(String, str);
+    ARG(String, prefix);
+    const std::string& text = str->value();
+    const std::string& start = prefix->value();
+
+    return type::boolean(text.size() >= start.size()
+        && text.compare(0, start.size(), start) == 0);
 }
 
-BUILTIN("pr-str")
+BUILTIN("replace")
 {
-    return type::string(printValues(argsBegin, argsEnd, " ", true));
+    CHECK_ARGS_IS(3);
+    ARG(String, str);
+    ARG(String, match);
+    ARG(String, replacement);
+    const std::string& text = str->value();
+    const std::string& pattern = match->value();
+    if ( pattern.empty() ) {
+        throw LISP_ERROR("Cannot replace an empty string");
+    }
+
+    std::string out;
+    out.reserve(text.size());
+    size_t start = 0;
+    for ( size_t found; (found = text.find(pattern, start)) != std::string::npos; ) {
+        out.append(text, start, found - start);
+        out += replacement->value();
+        start = found + pattern.size();
+    }
+    out.append(text, start, std::string::npos);
+
+    return type::string(std::move(out));
 }
 
-BUILTIN("prn")
+BUILTIN("transient")
 {
-    std::cout << printValues(argsBegin, argsEnd, " ", true) << "\n";
-    return type::nilValue();
+    CHECK_ARGS_IS(1);
+    return type::transient(*argsBegin);
 }
 
-BUILTIN("println")
+BUILTIN("conj!")
 {
-    std::cout << printValues(argsBegin, argsEnd, " ", false) << "\n";
-    return type::nilValue();
+    CHECK_ARGS_AT_LEAST(1);
+    AST result = *argsBegin;
+    ARG(Transient, transient);
+
+    for ( ; argsBegin != argsEnd; ++argsBegin ) {
+        transient->conj(*argsBegin);
+    }
+
+    return result;
 }
 
-BUILTIN("apply")
+BUILTIN("assoc!")
 {
-    CHECK_ARGS_AT_LEAST(2);
-    AST op = *argsBegin++;
-
-    // Copy the first N-1 arguments in.
-    AST_vec args(argsBegin, argsEnd-1);
+    int argCount = CHECK_ARGS_AT_LEAST(1);
+    checkArgsEven(name, argCount - 1);
+    AST result = *argsBegin;
+    ARG(Transient, transient);
 
-    // Then append the argument as a list.
-    const Sequence* lastArg = VALUE_CAST(Sequence, *(argsEnd-1));
-    for ( int i = 0; i < lastArg->count(); i++ ) {
-        args.push_back(lastArg->item(i));
+    for ( ; argsBegin != argsEnd; argsBegin += 2 ) {
+        transient->assoc(*argsBegin, *(argsBegin + 1));
     }
 
-    return APPLY(op, args.begin(), args.end());
+    return result;
 }
 
-BUILTIN("assoc")
+BUILTIN("dissoc!")
 {
     CHECK_ARGS_AT_LEAST(1);
-    ARG(Hash, hash);
-    return hash->assoc(argsBegin, argsEnd);
-}
+    AST result = *argsBegin;
+    ARG(Transient, transient);
 
-BUILTIN("atom")
-{
-    CHECK_ARGS_IS(1);
-    return type::atom(*argsBegin);
+    for ( ; argsBegin != argsEnd; ++argsBegin ) {
+        transient->dissoc(*argsBegin);
+    }
+
+    return result;
 }
 
-BUILTIN("eval")
+BUILTIN("persistent!")
 {
     CHECK_ARGS_IS(1);
-    return EVAL(*argsBegin, NULL);
+    ARG(Transient, transient);
+    return transient->persistent();
 }
 
-BUILTIN("fn?")
+BUILTIN("into")
 {
-    CHECK_ARGS_IS(1);
-    AST arg = *argsBegin++;
+    CHECK_ARGS_IS(2);
+    AST to = *argsBegin++;
+    AST from = *argsBegin++;
 
-    if ( const Lambda* lambda = dynamic_cast<Lambda*>(arg.ptr()) ) {
-        return type::boolean(!lambda->isMacro());
+    if ( from == type::nilValue() ) {
+        return to;
     }
 
-    return type::boolean(dynamic_cast<BuiltIn*>(arg.ptr()));
-}
+    if ( to == type::nilValue() ) {
+        to = type::list(new AST_vec(0));
+    }
 
-BUILTIN("vals")
-{
-    CHECK_ARGS_IS(1);
-    ARG(Hash, hash);
-    return hash->values();
-}
+    if ( DYNAMIC_CAST(Hash, from) ) {
+        Transient transient(to);
+        transient.conj(from);
+        return transient.persistent();
+    }
 
-BUILTIN("vec")
-{
-    CHECK_ARGS_IS(1);
-    ARG(Sequence, s);
-    return type::vector(s->begin(), s->end());
-}
+    from = realizeSeq(from);
+    const Sequence* source = VALUE_CAST(Sequence, from);
+    if ( const List* list = DYNAMIC_CAST(List, to) ) {
+        return list->conj(source->begin(), source->end());
+    }
 
-BUILTIN("vector")
-{
-    return type::vector(argsBegin, argsEnd);
+    // sets, sorted sets and queues have no transient form, so they take
+    // the items through their persistent conj
+    if ( const Set* set = DYNAMIC_CAST(Set, to) ) {
+        return set->conj(source->begin(), source->end());
+    }
+
+    if ( const Queue* queue = DYNAMIC_CAST(Queue, to) ) {
+        return queue->conj(source->begin(), source->end());
+    }
+
+    if ( const Sorted* sorted = DYNAMIC_CAST(Sorted, to) ) {
+        if ( sorted->isMap() ) {
+            throw LISP_ERROR("into on a sorted-map is not supported, use assoc");
+        }
+        return sorted->assoc(source->begin(), source->end());
+    }
+
+    Transient transient(to);
+    for ( auto it = source->begin(), end = source->end(); it != end; ++it ) {
+        transient.conj(*it);
+    }
+
+    return transient.persistent();
 }
 
 BUILTIN("concat")
 {
-    int count = 0;
+    // like filter, concat is lazy only over lazy or infinite sources,
+    // which it then goes through a chunk at a time
     for ( auto it = argsBegin; it != argsEnd; ++it ) {
+        const Range* range = DYNAMIC_CAST(Range, *it);
+        if ( DYNAMIC_CAST(LazySeq, *it) || (range && range->isInfinite()) ) {
+            ItemBufferPtr colls(new ItemBuffer);
+            for ( auto arg = argsBegin; arg != argsEnd; ++arg ) {
+                AST coll = DYNAMIC_CAST(NumArray, *arg) ? realizeSeq(*arg) : *arg;
+                if ( !DYNAMIC_CAST(LazySeq, coll) && !DYNAMIC_CAST(Range, coll) ) {
+                    VALUE_CAST(Sequence, coll);
+                }
+                colls->items.push_back(coll);
+            }
+            return lazyConcat(colls, 0, type::nilValue());
+        }
+    }
+
+    AST_vec seqs(argsBegin, argsEnd);
+    int count = 0;
+    for ( auto it = seqs.begin(); it != seqs.end(); ++it ) {
+        *it = realizeSeq(*it);
         const Sequence* seq = VALUE_CAST(Sequence, *it);
         count += seq->count();
     }
 
     AST_vec* items = new AST_vec(count);
     int offset = 0;
-    for ( auto it = argsBegin; it != argsEnd; ++it ) {
+    for ( auto it = seqs.begin(); it != seqs.end(); ++it ) {
         const Sequence* seq = STATIC_CAST(Sequence, *it);
         std::copy(seq->begin(), seq->end(), items->begin() + offset);
         offset += seq->count();
@@ -328,16 +1639,49 @@ BUILTIN("concat")
 BUILTIN("conj")
 {
     CHECK_ARGS_AT_LEAST(1);
-    ARG(Sequence, seq);
+    if ( const Set* set = DYNAMIC_CAST(Set, *argsBegin) ) {
+        return set->conj(argsBegin + 1, argsEnd);
+    }
+
+    if ( const Queue* queue = DYNAMIC_CAST(Queue, *argsBegin) ) {
+        return queue->conj(argsBegin + 1, argsEnd);
+    }
+
+    if ( const Sorted* sorted = DYNAMIC_CAST(Sorted, *argsBegin) ) {
+        if ( sorted->isMap() ) {
+            throw LISP_ERROR("conj on a sorted-map is not supported, use assoc");
+        }
+        return sorted->assoc(argsBegin + 1, argsEnd);
+    }
+
+    // items go on the front, as for a list, leaving a lazy or infinite
+    // rest unrealized; like map, conj realizes a finite range
+    const Range* range = DYNAMIC_CAST(Range, *argsBegin);
+    if ( DYNAMIC_CAST(LazySeq, *argsBegin) || (range && range->isInfinite()) ) {
+        AST seq = *argsBegin;
+        for ( auto it = argsBegin + 1; it != argsEnd; ++it ) {
+            seq = type::lazySeq(*it, seq);
+        }
+        return seq;
+    }
 
-    return seq->conj(argsBegin, argsEnd);
+    AST coll = range ? range->toList() : *argsBegin;
+    const Sequence* seq = VALUE_CAST(Sequence, coll);
+
+    return seq->conj(argsBegin + 1, argsEnd);
 }
 
 BUILTIN("cons")
 {
     CHECK_ARGS_IS(2);
     AST first = *argsBegin++;
-    ARG(Sequence, rest);
+    const Range* range = DYNAMIC_CAST(Range, *argsBegin);
+    if ( DYNAMIC_CAST(LazySeq, *argsBegin) || (range && range->isInfinite()) ) {
+        return type::lazySeq(first, *argsBegin);
+    }
+
+    AST coll = range ? range->toList() : *argsBegin;
+    const Sequence* rest = VALUE_CAST(Sequence, coll);
 
     AST_vec* items = new AST_vec(1 + rest->count());
     items->at(0) = first;
@@ -352,6 +1696,15 @@ BUILTIN("contains?")
     if ( *argsBegin == type::nilValue() ) {
         return *argsBegin;
     }
+    if ( const Set* set = DYNAMIC_CAST(Set, *argsBegin) ) {
+        return type::boolean(set->contains(*(argsBegin + 1)));
+    }
+    if ( const Sorted* sorted = DYNAMIC_CAST(Sorted, *argsBegin) ) {
+        return type::boolean(sorted->contains(*(argsBegin + 1)));
+    }
+    if ( const Record* record = DYNAMIC_CAST(Record, *argsBegin) ) {
+        return type::boolean(record->contains(*(argsBegin + 1)));
+    }
     ARG(Hash, hash);
     return type::boolean(hash->contains(*argsBegin));
 }
@@ -367,6 +1720,14 @@ BUILTIN("deref")
 BUILTIN("dissoc")
 {
     CHECK_ARGS_AT_LEAST(1);
+    if ( const Sorted* sorted = DYNAMIC_CAST(Sorted, *argsBegin) ) {
+        return sorted->dissoc(argsBegin + 1, argsEnd);
+    }
+
+    if ( const Record* record = DYNAMIC_CAST(Record, *argsBegin) ) {
+        return record->dissoc(argsBegin + 1, argsEnd);
+    }
+
     ARG(Hash, hash);
 
     return hash->dissoc(argsBegin, argsEnd);
@@ -378,16 +1739,61 @@ BUILTIN("first")
     if ( *argsBegin == type::nilValue() ) {
         return type::nilValue();
     }
+    if ( const Set* set = DYNAMIC_CAST(Set, *argsBegin) ) {
+        return set->first();
+    }
+    if ( const Sorted* sorted = DYNAMIC_CAST(Sorted, *argsBegin) ) {
+        return sorted->first();
+    }
+    if ( const Queue* queue = DYNAMIC_CAST(Queue, *argsBegin) ) {
+        return queue->peek();
+    }
+    if ( const LazySeq* lazy = DYNAMIC_CAST(LazySeq, *argsBegin) ) {
+        return lazy->first();
+    }
+    if ( const Range* range = DYNAMIC_CAST(Range, *argsBegin) ) {
+        return range->first();
+    }
     ARG(Sequence, seq);
     return seq->first();
 }
 
+BUILTIN("last")
+{
+    CHECK_ARGS_IS(1);
+    if ( *argsBegin == type::nilValue() ) {
+        return type::nilValue();
+    }
+    if ( const Sorted* sorted = DYNAMIC_CAST(Sorted, *argsBegin) ) {
+        return sorted->last();
+    }
+    if ( const Range* range = DYNAMIC_CAST(Range, *argsBegin) ) {
+        return range->isEmpty() ? type::nilValue() : range->nth(range->count() - 1);
+    }
+    AST items = realizeSeq(*argsBegin);
+    const Sequence* seq = VALUE_CAST(Sequence, items);
+    return seq->isEmpty() ? type::nilValue() : seq->item(seq->count() - 1);
+}
+
 BUILTIN("get")
 {
     CHECK_ARGS_IS(2);
     if ( *argsBegin == type::nilValue() ) {
         return *argsBegin;
     }
+    if ( const Set* set = DYNAMIC_CAST(Set, *argsBegin) ) {
+        return set->get(*(argsBegin + 1));
+    }
+    if ( const Sorted* sorted = DYNAMIC_CAST(Sorted, *argsBegin) ) {
+        AST key = *(argsBegin + 1);
+        if ( sorted->isMap() ) {
+            return sorted->get(key);
+        }
+        return sorted->contains(key) ? key : type::nilValue();
+    }
+    if ( const Record* record = DYNAMIC_CAST(Record, *argsBegin) ) {
+        return record->get(*(argsBegin + 1));
+    }
     ARG(Hash, hash);
     return hash->get(*argsBegin);
 }
@@ -400,6 +1806,14 @@ BUILTIN("hash-map")
 BUILTIN("keys")
 {
     CHECK_ARGS_IS(1);
+    if ( const Sorted* sorted = DYNAMIC_CAST(Sorted, *argsBegin) ) {
+        return sorted->keys();
+    }
+
+    if ( const Record* record = DYNAMIC_CAST(Record, *argsBegin) ) {
+        return record->keys();
+    }
+
     ARG(Hash, hash);
     return hash->keys();
 }
@@ -433,7 +1847,31 @@ BUILTIN("map")
 {
     CHECK_ARGS_IS(2);
     AST op = *argsBegin++; // this gets checked in APPLY
-    ARG(Sequence, source);
+
+    // mapping over a lazy sequence stays lazy, mapping over a list or
+    // vector is eager so errors surface where map is called
+    if ( DYNAMIC_CAST(LazySeq, *argsBegin) ) {
+        return lazyMap(op, *argsBegin);
+    }
+
+    if ( const Range* range = DYNAMIC_CAST(Range, *argsBegin) ) {
+        if ( range->isInfinite() ) {
+            return lazyMap(op, *argsBegin);
+        }
+
+        const int64_t length = range->count();
+        AST_vec* items = new AST_vec(length);
+        AST_vec args(1);
+        for ( int64_t i = 0; i < length; i++ ) {
+            args[0] = type::integer(range->at(i));
+            (*items)[i] = APPLY(op, args.begin(), args.end());
+        }
+
+        return type::list(items);
+    }
+
+    AST coll = realizeSeq(*argsBegin);
+    const Sequence* source = VALUE_CAST(Sequence, coll);
 
     const int length = source->count();
     AST_vec* items = new AST_vec(length);
@@ -456,11 +1894,32 @@ BUILTIN("meta")
 BUILTIN("nth")
 {
     CHECK_ARGS_IS(2);
+    if ( const Range* range = DYNAMIC_CAST(Range, *argsBegin) ) {
+        ++argsBegin;
+        ARG(Integer, index);
+        return range->nth(index->value());
+    }
+
+    if ( DYNAMIC_CAST(LazySeq, *argsBegin) ) {
+        AST cell = *argsBegin++;
+        ARG(Integer, index);
+        int64_t i = index->value();
+        AST_vec chunk;
+        while ( i >= 0 && LazySeq::nextChunk(cell, chunk, cell) ) {
+            if ( i < (int64_t)chunk.size() ) {
+                return chunk[i];
+            }
+            i -= chunk.size();
+        }
+
+        throw LISP_ERROR("Index out of range");
+    }
+
     ARG(Sequence, seq);
     ARG(Integer, index);
 
-    int i = index->value();
-    if ( i < 0 || i >= seq->count() ) {
+    const int64_t i = index->value();
+    if ( i < 0 || (size_t)i >= seq->count() ) {
         throw LISP_ERROR("Index out of range");
     }
 
@@ -474,6 +1933,31 @@ BUILTIN("rest")
         return type::list(new AST_vec(0));
     }
 
+    if ( const Queue* queue = DYNAMIC_CAST(Queue, *argsBegin) ) {
+        return queue->pop();
+    }
+
+    // the items after the one first returns, in the order seq lists
+    if ( const Set* set = DYNAMIC_CAST(Set, *argsBegin) ) {
+        return STATIC_CAST(List, set->items())->rest();
+    }
+
+    if ( const Sorted* sorted = DYNAMIC_CAST(Sorted, *argsBegin) ) {
+        AST items = sorted->items();
+        if ( items == type::nilValue() ) {
+            return type::list(new AST_vec(0));
+        }
+        return STATIC_CAST(List, items)->rest();
+    }
+
+    if ( const LazySeq* lazy = DYNAMIC_CAST(LazySeq, *argsBegin) ) {
+        return lazy->rest();
+    }
+
+    if ( const Range* range = DYNAMIC_CAST(Range, *argsBegin) ) {
+        return range->rest();
+    }
+
     ARG(Sequence, seq);
     return seq->rest();
 }
@@ -570,8 +2054,28 @@ BUILTIN("seq")
             : type::list(seq->begin(), seq->end());
     }
 
+    if ( const Set* set = DYNAMIC_CAST(Set, arg) ) {
+        return set->count() == 0 ? type::nilValue() : set->items();
+    }
+
+    if ( const Sorted* sorted = DYNAMIC_CAST(Sorted, arg) ) {
+        return sorted->items();
+    }
+
+    if ( const Queue* queue = DYNAMIC_CAST(Queue, arg) ) {
+        return queue->count() == 0 ? type::nilValue() : queue->items();
+    }
+
+    if ( const LazySeq* lazy = DYNAMIC_CAST(LazySeq, arg) ) {
+        return lazy->isEmpty() ? type::nilValue() : arg;
+    }
+
+    if ( const Range* range = DYNAMIC_CAST(Range, arg) ) {
+        return range->isEmpty() ? type::nilValue() : arg;
+    }
+
     if ( const String* strVal = DYNAMIC_CAST(String, arg) ) {
-        const std::string str = strVal->value();
+        const std::string& str = strVal->value();
         int length = str.length();
         if ( length == 0 ) {
             return type::nilValue();
@@ -579,7 +2083,7 @@ BUILTIN("seq")
 
         AST_vec* items = new AST_vec(length);
         for ( int i = 0; i < length; i++ ) {
-            (*items)[i] = type::string(str.substr(i, 1));
+            (*items)[i] = type::character(str[i]);
         }
 
         return type::list(items);
@@ -607,7 +2111,21 @@ BUILTIN("slurp")
     data.append(std::istreambuf_iterator<char>(file.rdbuf()),
                 std::istreambuf_iterator<char>());
 
-    return type::string(data);
+    return type::string(std::move(data));
+}
+
+BUILTIN("spit")
+{
+    CHECK_ARGS_IS(2);
+    ARG(String, filename);
+
+    std::ofstream file(filename->value(), std::ios::out | std::ios::binary);
+    if ( file.fail() ) {
+        throw LISP_ERROR("Cannot open ", filename->value());
+    }
+
+    writeValues(file, argsBegin, argsEnd, "");
+    return type::nilValue();
 }
 
 void installCore(EnvPtr env)
@@ -616,6 +2134,20 @@ void installCore(EnvPtr env)
         BuiltIn* handler = *it;
         env->set(handler->name(), handler);
     }
+    native::setRootEnv(env);
+}
+
+static void appendValue(std::string& out, AST value, bool readably)
+{
+    // append the text itself instead of a copy, except where a string
+    // has to be printed escaped
+    const StringBase* str = DYNAMIC_CAST(StringBase, value);
+    if ( str && !(readably && DYNAMIC_CAST(String, value)) ) {
+        out += str->value();
+    }
+    else {
+        out += value->toString(readably);
+    }
 }
 
 static std::string printValues(AST_iter begin, AST_iter end,
@@ -624,14 +2156,112 @@ static std::string printValues(AST_iter begin, AST_iter end,
     std::string out;
 
     if ( begin != end ) {
-        out += (*begin)->toString(readably);
+        appendValue(out, *begin, readably);
         ++begin;
     }
 
     for ( ; begin != end; ++begin ) {
         out += sep;
-        out += (*begin)->toString(readably);
+        appendValue(out, *begin, readably);
     }
 
     return out;
+}
+
+// println and spit write string ropes piece by piece, without flattening
+static void writeValues(std::ostream& out, AST_iter begin, AST_iter end,
+                        const std::string& sep)
+{
+    for ( AST_iter it = begin; it != end; ++it ) {
+        if ( it != begin ) {
+            out << sep;
+        }
+        if ( const String* str = DYNAMIC_CAST(String, *it) ) {
+            str->write(out);
+        }
+        else {
+            out << (*it)->toString(false);
+        }
+    }
+}
+
+static AST sortedRange(const std::string& name, AST_iter argsBegin, AST_iter argsEnd,
+                       bool reverse)
+{
+    int argCount = CHECK_ARGS_AT_LEAST(3);
+    if ( argCount != 3 && argCount != 5 ) {
+        throw LISP_ERROR("\"", name, "\" expects 3 or 5 args, ",
+            std::to_string(argCount), " supplied");
+    }
+
+    ARG(Sorted, sorted);
+    AST low, high;
+    bool lowInclusive = true, highInclusive = true;
+
+    // the tests are the comparison builtins, e.g. (subseq sc >= 10 < 20)
+    while ( argsBegin != argsEnd ) {
+        ARG(BuiltIn, test);
+        AST key = *argsBegin++;
+        const std::string op = test->name();
+
+        if ( op == ">" || op == ">=" ) {
+            low = key;
+            lowInclusive = (op == ">=");
+        }
+        else if ( op == "<" || op == "<=" ) {
+            high = key;
+            highInclusive = (op == "<=");
+        }
+        else {
+            throw LISP_ERROR("\"", name, "\" expects <, <=, > or >= as test, got ", op);
+        }
+    }
+
+    return sorted->range(low, lowInclusive, high, highInclusive, reverse);
+}
+
+static AST lazyOf(AST coll)
+{
+    if ( DYNAMIC_CAST(LazySeq, coll) ) {
+        return coll;
+    }
+
+    if ( coll == type::nilValue() ) {
+        return AST(new LazySeq(type::list(new AST_vec(0)), 0));
+    }
+
+    if ( DYNAMIC_CAST(Range, coll) ) {
+        return type::lazySeq([coll]() { return coll; });
+    }
+
+    VALUE_CAST(Sequence, coll);
+    return AST(new LazySeq(coll, 0));
+}
+
+static AST realizeSeq(AST coll)
+{
+    if ( const Range* range = DYNAMIC_CAST(Range, coll) ) {
+        return range->toList();
+    }
+
+    // sets, sorted collections and queues walk in the order seq lists
+    if ( const Set* set = DYNAMIC_CAST(Set, coll) ) {
+        return set->items();
+    }
+
+    if ( const Sorted* sorted = DYNAMIC_CAST(Sorted, coll) ) {
+        AST items = sorted->items();
+        return items == type::nilValue() ? type::list(new AST_vec(0)) : items;
+    }
+
+    if ( const Queue* queue = DYNAMIC_CAST(Queue, coll) ) {
+        return queue->items();
+    }
+
+    if ( const NumArray* array = DYNAMIC_CAST(NumArray, coll) ) {
+        return array->toList();
+    }
+
+    const LazySeq* lazy = DYNAMIC_CAST(LazySeq, coll);
+    return lazy ? lazy->toList() : coll;
 }
\ No newline at end of file
@@ -3,6 +3,8 @@
 
 #include "type_base.h"
 
+#include <vector>
+
 class Expression;
 typedef RefCountedPtr<Expression>   AST;
 typedef std::vector<AST>            AST_vec;
@@ -11,6 +13,11 @@ typedef AST_vec::iterator           AST_iter;
 class Env;
 typedef RefCountedPtr<Env>          EnvPtr;
 
+class Scope;
+typedef RefCountedPtr<Scope>        ScopePtr;
+
+class Name;
+
 // step*.cpp
 extern AST READ(std::string& input);
 extern AST EVAL(AST tokens, EnvPtr env);
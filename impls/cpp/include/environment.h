@@ -5,27 +5,119 @@
 #include "type_base.h"
 #include "types.h"
 
-#include <map>
+#include <memory>
 #include <string>
 
+// The names of the locals an analyzed fn*, let* or catch* keeps in the
+// slots of its frame, in slot order.
+class Scope : public ReferenceCounter {
+public:
+    Scope(std::vector<const Name*> names) : m_names(std::move(names)) { }
+
+    int size() const { return m_names.size(); }
+    const Name* name(int slot) const { return m_names[slot]; }
+
+    // the last slot with that name, as a repeated fn* parameter binds
+    // the last argument; -1 when there is none
+    int slotOf(const Name* name) const
+    {
+        for ( int slot = size() - 1; slot >= 0; --slot ) {
+            if ( m_names[slot] == name ) {
+                return slot;
+            }
+        }
+        return -1;
+    }
+
+private:
+    const std::vector<const Name*> m_names;
+};
+
+// An open-addressing table from Names to values, for frames with many
+// names such as the root environment. Slots are probed linearly from the
+// name's precomputed hash and the table doubles before it is half full.
+// Names are never removed.
+class NameTable {
+public:
+    NameTable() : m_entries(16), m_count(0) { }
+
+    const AST* find(const Name* name) const;
+
+    // the value bound to name, nil-initialized when it is new
+    AST& operator[](const Name* name);
+
+private:
+    struct Entry {
+        const Name* name;
+        AST value;
+    };
+
+    std::vector<Entry> m_entries;
+    size_t m_count;
+};
+
 class Env : public ReferenceCounter {
 public:
-    Env(EnvPtr outer = NULL) : m_outer_env(outer) { }
+    Env(EnvPtr outer = NULL);
     Env(EnvPtr outer,
-           const std::vector<std::string>& bindings,
+           const std::vector<const Name*>& bindings,
            AST_iter argsBegin, AST_iter argsEnd);
+    // a frame for an analyzed scope, its slots start out unbound
+    Env(EnvPtr outer, ScopePtr scope);
+
+    ~Env();
 
-    ~Env() { }
+    AST get(const Name* symbol);
+    EnvPtr find(const Name* symbol);
+    AST set(const Name* symbol, AST value);
 
     AST get(const std::string& symbol);
     EnvPtr find(const std::string& symbol);
     AST set(const std::string& symbol, AST value);
+
     EnvPtr getRoot();
 
+    // the local the analyzer resolved symbol to, see LocalSymbol
+    AST get(int depth, int slot, const Name* symbol);
+
+    // where symbol is bound in this frame itself, NULL if it is not
+    const AST* lookup(const Name* symbol) const;
+
+    // where symbol is bound in this frame or an outer one, NULL if in none
+    const AST* findValue(const Name* symbol) const;
+
+    // whether a frame below the root binds symbol by name, as a def!
+    // inside a function does, hiding its global binding
+    bool shadowsGlobal(const Name* symbol) const;
+
+    // Changed by every binding made by name, which is what def! does.
+    // A cached pointer to a binding is good while this is unchanged.
+    static uint64_t version() { return s_version; }
+    void bind(int slot, AST value) { m_slots[slot] = value; }
+
+    EnvPtr outer() const { return m_outer_env; }
+    const Scope* scope() const { return m_scope.ptr(); }
+
 private:
-    typedef std::map<std::string, AST> Map;
-    Map m_map;
+    const AST* lookupBound(const Name* symbol) const;
+
+    static uint64_t s_version;
+
     EnvPtr m_outer_env;
+
+    // Names bound by name: by def!, or by a lambda that was not
+    // analyzed. Most frames have a handful, kept inline and searched
+    // linearly; a frame that outgrows them moves to a NameTable.
+    static const int INLINE_COUNT = 4;
+    int m_boundCount; // the inline ones, left non-zero once m_map is used
+    const Name* m_boundNames[INLINE_COUNT];
+    AST m_boundValues[INLINE_COUNT];
+    std::unique_ptr<NameTable> m_map;
+
+    // def! still adds names the analyzer did not see by name
+    ScopePtr m_scope;
+    AST* m_slots;
+    AST m_inlineSlots[INLINE_COUNT];
 };
 
-#endif // ENVIRONMENT_H
\ No newline at end of file
+#endif // ENVIRONMENT_H
@@ -0,0 +1,24 @@
+#ifndef MALC_H
+#define MALC_H
+
+#include "def.h"
+
+#include <string>
+
+// malc translates a .mal file to the C++ source of a native module (see
+// native.h): each fn* becomes a C++ function, its parameters and let*
+// variables become C++ variables, and the core arithmetic is done inline.
+//
+// The file's top-level forms are handled in order, the way load-file runs
+// them. Each is macroexpanded in env, translated, and then evaluated in
+// env, so the forms after it can use the macros and functions it defines.
+// Compiling a file therefore also loads it. A form that uses what the
+// translation does not cover, such as defmacro!, or def! inside a
+// function, is kept as data and left to EVAL when the module loads.
+namespace malc {
+
+    std::string translate(const std::string& path, EnvPtr env);
+
+} // namespace malc
+
+#endif // MALC_H
@@ -0,0 +1,102 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include "types.h"
+
+#include <initializer_list>
+#include <string>
+
+// The runtime of the C++ modules malc translates .mal files to (see
+// malc.h). A module registers itself under the path of the file it was
+// made from, and load-file runs it instead of reading that file, as long
+// as the file has not changed since. The generated code keeps locals in
+// C++ variables and calls the helpers here for everything else.
+namespace native {
+
+    typedef void (LoadFunc)(EnvPtr env);
+
+    // A module linked into the interpreter, registered by a static
+    // object in its generated code.
+    class Module {
+    public:
+        Module(const char* path, size_t sourceHash, LoadFunc* load);
+    };
+
+    // the environment modules are loaded into, set up by installCore
+    void setRootEnv(EnvPtr env);
+
+    // runs the module made from the file at path, if one is linked in
+    // and the file is unchanged; returns whether it did
+    bool load(const std::string& path);
+
+    // what a module records of its source file, to be matched on load
+    std::string canonicalPath(const std::string& path);
+    size_t sourceHash(const std::string& text);
+
+    // A compiled fn*. Its code gets the function itself, to read the
+    // values it captured when it was made and to recognise calls to
+    // itself in tail position, which it turns into a loop. A call to
+    // another compiled function in tail position is left to apply, see
+    // tailCall.
+    class Function : public Applicable {
+    public:
+        typedef AST (Code)(const Function* self, AST_iter argsBegin, AST_iter argsEnd);
+
+        Function(Code* code, std::initializer_list<AST> captured);
+        Function(const Function& that, AST meta);
+
+        virtual AST apply(AST_iter argsBegin, AST_iter argsEnd) const;
+
+        AST captured(int index) const { return m_captured[index]; }
+
+        virtual const std::string toString(bool readably) const;
+        virtual bool operator==(const Expression* rhs) const { return this == rhs; }
+
+        WITH_META(Function);
+
+    private:
+        Code* const m_code;
+        const AST_vec m_captured;
+    };
+
+    AST closure(Function::Code* code, std::initializer_list<AST> captured);
+
+    // throws the errors a Lambda does for the wrong number of arguments
+    void checkArgs(AST_iter argsBegin, AST_iter argsEnd, int paramCount, bool isVariadic);
+
+    // a constant, read back from the text it printed as
+    AST constant(const char* text);
+
+    // a GlobalSymbol, which caches the binding it is evaluated to
+    AST global(const char* name);
+
+    // evaluates a form the module leaves to EVAL
+    AST eval(AST form);
+
+    // calls items[0] with the rest of items as arguments
+    AST call(std::initializer_list<AST> items);
+
+    // The same for a call in tail position. A call to a compiled function
+    // is not made here but handed back to the Function::apply running the
+    // caller, so that functions calling each other in tail position run
+    // in constant stack, as they do in EVAL.
+    AST tailCall(std::initializer_list<AST> items);
+
+    // The same for the core arithmetic and comparisons with two
+    // arguments, done inline for two integers as long as the operator
+    // is still bound to the builtin.
+    enum Op { ADD, SUB, MUL, LT, LE, GT, GE, EQ, OP_COUNT };
+    AST call(Op op, std::initializer_list<AST> items);
+
+    AST vector(std::initializer_list<AST> items);
+    AST hash(std::initializer_list<AST> keysAndValues);
+
+    // A let* variable that a closure refers to before it is bound is
+    // kept in a box the closure shares.
+    AST box();
+    void setBox(const AST& box, AST value);
+    AST unbox(const AST& box, const char* name);
+
+} // namespace native
+
+#endif // NATIVE_H
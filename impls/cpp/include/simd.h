@@ -0,0 +1,39 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Kernels over packed numeric arrays. Most use AVX2 when the compiler
+// targets it (the makefile builds with -march=native) and a plain loop
+// otherwise; the integer sum, dot and mul are plain loops written for the
+// compiler to vectorize. Those and the integer add return false when a
+// result does not fit in an int64, which the builtins report as the + and
+// * builtins do. min/max expect count > 0.
+namespace simd {
+
+    bool sum(const int64_t* a, size_t count, int64_t& result);
+    double sum(const double* a, size_t count);
+
+    int64_t min(const int64_t* a, size_t count);
+    double min(const double* a, size_t count);
+
+    int64_t max(const int64_t* a, size_t count);
+    double max(const double* a, size_t count);
+
+    bool dot(const int64_t* a, const int64_t* b, size_t count, int64_t& result);
+    double dot(const double* a, const double* b, size_t count);
+
+    bool add(const int64_t* a, const int64_t* b, int64_t* out, size_t count);
+    void add(const double* a, const double* b, double* out, size_t count);
+
+    bool mul(const int64_t* a, const int64_t* b, int64_t* out, size_t count);
+    void mul(const double* a, const double* b, double* out, size_t count);
+
+    // copies the items greater than limit to out, returns how many
+    size_t filterGreater(const int64_t* a, size_t count, int64_t limit, int64_t* out);
+    size_t filterGreater(const double* a, size_t count, double limit, double* out);
+
+} // namespace simd
+
+#endif // SIMD_H
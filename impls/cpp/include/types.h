@@ -9,19 +9,28 @@
 
 #include <vector>
 #include <iostream>
+#include <functional>
 #include <map>
+#include <thread>
+#include <unordered_map>
 
 class EmptyInputException : public std::exception { };
 
 class Expression : public ReferenceCounter {
 public:
-    Expression() { /* add logging */ }
-    Expression(AST ptr) : m_meta(ptr) { /* add logging */ }
+    // Set by the numeric types so arithmetic can dispatch on a plain
+    // field instead of a dynamic_cast per operand.
+    enum NumberTag : char { NOT_NUMBER, INTEGER, FLOAT };
+
+    Expression() : m_numberTag(NOT_NUMBER) { /* add logging */ }
+    Expression(AST ptr) : m_meta(ptr), m_numberTag(NOT_NUMBER) { /* add logging */ }
     virtual ~Expression() { /* add logging */ }
 
     bool isEqualTo(const Expression* rhs) const;
     bool isTrue() const;
 
+    NumberTag numberTag() const { return m_numberTag; }
+
     virtual AST eval(EnvPtr env);
 
     AST meta() const;
@@ -35,8 +44,14 @@ public:
     }
 
 protected:
+    Expression(NumberTag tag) : m_numberTag(tag) { }
+    Expression(AST meta, NumberTag tag) : m_meta(meta), m_numberTag(tag) { }
+
     virtual bool operator==(const Expression* rhs) const = 0;
     AST m_meta;
+
+private:
+    const NumberTag m_numberTag;
 };
 
 template<class T>
@@ -75,9 +90,9 @@ private:
 
 class Integer : public Expression {
 public:
-    Integer(int64_t value) : m_val(value) { }
+    Integer(int64_t value) : Expression(INTEGER), m_val(value) { }
     Integer(const Integer& that, AST meta)
-        : Expression(meta), m_val(that.m_val)
+        : Expression(meta, INTEGER), m_val(that.m_val)
     { }
 
     int64_t value() const { return m_val; }
@@ -91,6 +106,26 @@ private:
     const int64_t m_val;
 };
 
+class Float : public Expression {
+public:
+    Float(double value) : Expression(FLOAT), m_val(value) { }
+    Float(const Float& that, AST meta)
+        : Expression(meta, FLOAT), m_val(that.m_val)
+    { }
+
+    double value() const { return m_val; }
+
+    static std::string format(double value);
+
+    virtual const std::string toString(bool readably) const;
+    virtual bool operator==(const Expression* rhs) const;
+
+    WITH_META(Float);
+
+private:
+    const double m_val;
+};
+
 class Atom : public Expression {
 public:
     Atom(AST value) : m_atom(value) { }
@@ -111,48 +146,155 @@ private:
 
 class StringBase : public Expression {
 public:
-    StringBase(const std::string& token) : m_string(token) { }
+    StringBase(std::string token) : m_string(std::move(token)), m_rope(NULL) { }
     StringBase(const StringBase& that, AST meta)
-        : Expression(meta), m_string(that.value())
+        : Expression(meta), m_string(that.value()), m_rope(NULL)
     { }
+    virtual ~StringBase();
 
-    virtual const std::string toString(bool readably) const { return m_string; }
-    std::string value() const { return m_string; }
-private:
-    const std::string m_string;
+    virtual const std::string toString(bool readably) const { return value(); }
+    const std::string& value() const
+    {
+        if ( m_rope ) {
+            flatten();
+        }
+        return m_string;
+    }
+
+protected:
+    // the two halves of a String built by concatenation, see String
+    struct Rope {
+        AST left;
+        AST right;
+        size_t length;
+    };
+
+    StringBase(Rope* rope) : m_rope(rope) { }
+
+    void flatten() const;
+    static void release(Rope* rope);
+
+    mutable std::string m_string;
+    mutable Rope* m_rope;
 };
 
+// A String is either flat text or, when str joins long strings, a rope
+// of two halves that is only flattened once its text is needed. Length
+// and output (println, spit) work on the rope directly.
 class String : public StringBase {
 public:
-    String(const std::string& token) : StringBase(token) { }
+    // str builds a rope instead of copying once the result gets this long
+    static const size_t ROPE_THRESHOLD = 256;
+
+    String(std::string token) : StringBase(std::move(token)) { }
+    String(AST left, AST right);
     String(const String& that, AST meta) : StringBase(that, meta) { }
 
+    size_t length() const { return m_rope ? m_rope->length : m_string.size(); }
+    bool isRope() const { return m_rope != NULL; }
+    void write(std::ostream& out) const;
+
     virtual const std::string toString(bool readably) const;
     virtual bool operator==(const Expression* rhs) const;
 
     std::string escapedValue() const;
 
     WITH_META(String);
+private:
+    static Rope* join(AST left, AST right);
 };
 
 class Keyword : public StringBase {
 public:
-    Keyword(const std::string& token) : StringBase(token) { }
-    Keyword(const Keyword& that, AST meta) : StringBase(that, meta) { }
+    Keyword(std::string token) : StringBase(std::move(token)), m_cachedSlot(0) { }
+    Keyword(const Keyword& that, AST meta) : StringBase(that, meta), m_cachedSlot(0) { }
+
+    // (:key coll) and (:key coll notFound)
+    AST lookup(AST coll, AST notFound) const;
 
     virtual bool operator==(const Expression* rhs) const;
 
     WITH_META(Keyword);
+private:
+    // Every keyword read from source is its own object, so a keyword in
+    // call position remembers the record type it last looked up and the
+    // slot its field lives in for that call site.
+    mutable AST m_cachedType;
+    mutable int m_cachedSlot;
+};
+// Symbol names are interned: every distinct name has a single Name, so
+// symbols, scopes and environments can compare names by pointer.
+class Name {
+public:
+    // The special form a name introduces, set when it is interned so EVAL
+    // can switch on it instead of comparing strings. catch* is only
+    // special inside try*.
+    enum Special : char {
+        NOT_SPECIAL, DEF, DEFMACRO, DO, FN, IF, LET, MACROEXPAND,
+        QUASIQUOTE, QUASIQUOTEEXPAND, QUOTE, TRY, CATCH,
+    };
+
+    static const Name* intern(const std::string& text);
+
+    const std::string& text() const { return m_text; }
+    size_t hash() const { return m_hash; }
+    Special special() const { return m_special; }
+
+private:
+    Name(const std::string& text);
+
+    const std::string m_text;
+    const size_t m_hash;
+    const Special m_special;
 };
+
 class Symbol : public StringBase {
 public:
-    Symbol(const std::string& token) : StringBase(token) { }
-    Symbol(const Symbol& that, AST meta) : StringBase(that, meta) { }
+    Symbol(std::string token)
+        : StringBase(std::move(token)), m_name(Name::intern(value())) { }
+    Symbol(const Name* name) : StringBase(name->text()), m_name(name) { }
+    Symbol(const Symbol& that, AST meta)
+        : StringBase(that, meta), m_name(that.m_name) { }
+
+    const Name* name() const { return m_name; }
 
     virtual AST eval(EnvPtr env);
 
     bool operator==(const Expression* rhs) const;
     WITH_META(Symbol);
+
+private:
+    const Name* const m_name;
+};
+
+// A local variable reference the analyzer resolved to the slot it lives
+// in, depth frames out from the frame it is evaluated in.
+class LocalSymbol : public Symbol {
+public:
+    LocalSymbol(const Name* name, int depth, int slot)
+        : Symbol(name), m_depth(depth), m_slot(slot) { }
+
+    virtual AST eval(EnvPtr env);
+
+    int depth() const { return m_depth; }
+    int slot() const { return m_slot; }
+
+private:
+    const int m_depth;
+    const int m_slot;
+};
+
+// A reference the analyzer found no local for. It caches the root binding
+// it last resolved to, which stays valid until the next def! anywhere.
+class GlobalSymbol : public Symbol {
+public:
+    GlobalSymbol(const Name* name) : Symbol(name), m_cell(NULL), m_version(0) { }
+
+    virtual AST eval(EnvPtr env);
+
+private:
+    const AST* m_cell;
+    uint64_t m_version;
 };
 
 class Sequence : public Expression {
@@ -217,13 +359,13 @@ class Hash : public Expression {
 public:
     typedef std::map<std::string, AST> Map;
 
-    Hash(const Hash::Map& map) : m_map(map), m_isEval(true) { }
-    Hash(AST_iter begin, AST_iter end, bool isEvaluated)
-        : m_map(createMap(begin, end)), m_isEval(isEvaluated)
-    { }
-    Hash(const Hash& that, AST meta)
-        : Expression(meta), m_map(that.m_map), m_isEval(that.m_isEval)
-    { }
+    // Maps with at most this many keys are stored inline as a flat
+    // key/value array and searched linearly, larger ones use m_map.
+    static const int SMALL_LIMIT = 8;
+
+    Hash(const Hash::Map& map) : m_map(map), m_count(0), m_isEval(true) { }
+    Hash(AST_iter begin, AST_iter end, bool isEvaluated);
+    Hash(const Hash& that, AST meta);
 
     AST assoc(AST_iter argsBegin, AST_iter argsEnd) const;
     AST dissoc(AST_iter argsBegin, AST_iter argsEnd) const;
@@ -233,6 +375,7 @@ public:
     AST get(AST key) const;
     AST keys() const;
     AST values() const;
+    bool isEvaluated() const { return m_isEval; }
 
     static std::string makeHashKey(AST key);
     static Hash::Map addToMap(Hash::Map& map, AST_iter begin, AST_iter end);
@@ -242,8 +385,332 @@ public:
     bool operator==(const Expression* rhs) const;
     WITH_META(Hash);
 private:
-    const Map m_map;
-    const bool m_isEval;
+    friend class Transient;
+    Hash(const Hash& that, bool isEvaluated);
+
+    bool isSmall() const { return m_map.empty(); }
+    int size() const { return isSmall() ? m_count : m_map.size(); }
+
+    const AST* lookup(AST key) const;
+    void insert(AST key, AST value);
+    void erase(AST key);
+    void promote();
+
+    Map m_map;
+    AST m_slots[2 * SMALL_LIMIT];
+    int m_count;
+    bool m_isEval;
+};
+
+class Set : public Expression {
+public:
+    // items hashed with hashItem; equal hashes are told apart with
+    // isEqualTo, the same as the inline items are compared
+    typedef std::unordered_multimap<size_t, AST> Map;
+
+    Set(AST_iter begin, AST_iter end, bool isEvaluated);
+    Set(const Set& that, AST meta);
+
+    AST conj(AST_iter argsBegin, AST_iter argsEnd) const;
+    AST disj(AST_iter argsBegin, AST_iter argsEnd) const;
+    bool contains(AST item) const;
+    AST get(AST item) const;
+    AST first() const;
+    AST items() const;
+    int count() const { return isSmall() ? m_count : m_map.size(); }
+
+    AST unite(const Set* rhs) const;
+    AST intersect(const Set* rhs) const;
+    AST subtract(const Set* rhs) const;
+
+    AST eval(EnvPtr env);
+
+    // a hash that agrees with isEqualTo: equal items hash the same
+    static size_t hashItem(AST item);
+
+    const std::string toString(bool readably) const;
+    bool operator==(const Expression* rhs) const;
+    WITH_META(Set);
+private:
+    Set(const Set& that, bool isEvaluated);
+
+    bool isSmall() const { return m_map.empty(); }
+
+    template<class Func>
+    void forEach(Func func) const
+    {
+        for ( int i = 0; i < m_count; ++i ) {
+            func(m_slots[i]);
+        }
+
+        for ( auto it = m_map.begin(), end = m_map.end(); it != end; ++it ) {
+            func(it->second);
+        }
+    }
+
+    const AST* lookup(AST item) const;
+    void insert(AST item);
+    void erase(AST item);
+    void promote();
+
+    Map m_map;
+    AST m_slots[Hash::SMALL_LIMIT];
+    int m_count;
+    bool m_isEval;
+};
+
+class SortedNode;
+typedef RefCountedPtr<SortedNode> SortedNodePtr;
+
+class SortedNode : public ReferenceCounter {
+public:
+    SortedNode(AST key, AST value, SortedNodePtr left, SortedNodePtr right);
+
+    const AST key;
+    const AST value;
+    const SortedNodePtr left;
+    const SortedNodePtr right;
+    const int height;
+};
+
+// Persistent AVL tree ordered by a comparator function, backing both
+// sorted-map (key/value nodes) and sorted-set (value is unused).
+class Sorted : public Expression {
+public:
+    Sorted(AST comparator, bool isMap);
+    Sorted(const Sorted& that, AST meta);
+
+    AST assoc(AST_iter argsBegin, AST_iter argsEnd) const;
+    AST dissoc(AST_iter argsBegin, AST_iter argsEnd) const;
+    bool contains(AST key) const;
+    AST get(AST key) const;
+
+    AST first() const;
+    AST last() const;
+    AST items() const;
+    AST keys() const;
+    AST values() const;
+    AST range(AST low, bool lowInclusive, AST high, bool highInclusive,
+              bool reverse) const;
+
+    int count() const { return m_count; }
+    bool isMap() const { return m_isMap; }
+
+    int compare(AST lhs, AST rhs) const;
+    static int defaultCompare(AST lhs, AST rhs);
+
+    const std::string toString(bool readably) const;
+    bool operator==(const Expression* rhs) const;
+    WITH_META(Sorted);
+private:
+    Sorted(const Sorted& that, SortedNodePtr root, int count);
+
+    AST entry(const SortedNode* node) const;
+
+    SortedNodePtr insert(SortedNodePtr node, AST key, AST value, bool& added) const;
+    SortedNodePtr remove(SortedNodePtr node, AST key, bool& removed) const;
+
+    const AST m_comparator;
+    const SortedNodePtr m_root;
+    const int m_count;
+    const bool m_isMap;
+};
+
+class ItemBuffer : public ReferenceCounter {
+public:
+    AST_vec items;
+};
+typedef RefCountedPtr<ItemBuffer> ItemBufferPtr;
+
+// Persistent FIFO queue. The front and the rear are slices of shared
+// buffers: pop advances the front slice, and conj appends to the rear
+// buffer in place when no other queue has appended to it already.
+class Queue : public Expression {
+public:
+    Queue() : m_frontBegin(0), m_frontEnd(0), m_rearEnd(0) { }
+    Queue(const Queue& that, AST meta);
+
+    AST conj(AST_iter argsBegin, AST_iter argsEnd) const;
+    AST peek() const;
+    AST pop() const;
+    AST items() const;
+
+    int count() const { return (m_frontEnd - m_frontBegin) + m_rearEnd; }
+
+    const std::string toString(bool readably) const;
+    bool operator==(const Expression* rhs) const;
+    WITH_META(Queue);
+private:
+    template<class Func>
+    void forEach(Func func) const
+    {
+        for ( size_t i = m_frontBegin; i < m_frontEnd; ++i ) {
+            func(m_front->items[i]);
+        }
+
+        for ( size_t i = 0; i < m_rearEnd; ++i ) {
+            func(m_rear->items[i]);
+        }
+    }
+
+    ItemBufferPtr m_front;
+    size_t m_frontBegin;
+    size_t m_frontEnd;
+    ItemBufferPtr m_rear;
+    size_t m_rearEnd;
+};
+
+// A sequence whose cells are produced on demand and memoized. A cell is
+// either pending (a thunk, or a slice of an existing Sequence) or
+// realized (empty, or a first item and the rest of the sequence).
+// Realized cells may share a chunk of up to CHUNK_SIZE items, so that
+// map/filter/reduce can process a whole block per step.
+class LazySeq : public Expression {
+public:
+    typedef std::function<AST()> Thunk;
+
+    static const int CHUNK_SIZE = 32;
+
+    LazySeq(Thunk thunk);
+    LazySeq(AST first, AST rest);
+    LazySeq(AST source, int offset);
+    LazySeq(ItemBufferPtr chunk, int offset, AST rest);
+    LazySeq(const LazySeq& that, AST meta);
+    virtual ~LazySeq();
+
+    bool isEmpty() const;
+    AST first() const;
+    AST rest() const;
+    AST toList() const;
+
+    static bool nextChunk(AST coll, AST_vec& items, AST& rest);
+
+    // The same, but pointing begin and end straight at the items of a
+    // list, vector or chunk where it can, and copying into buffer only
+    // where it cannot. The items are only valid while coll is held.
+    static bool nextChunk(AST coll, AST_iter& begin, AST_iter& end,
+                          AST_vec& buffer, AST& rest);
+
+    const std::string toString(bool readably) const;
+    bool operator==(const Expression* rhs) const;
+    WITH_META(LazySeq);
+private:
+    void realize() const;
+    void assign(const LazySeq* that) const;
+    AST restCell() const;
+
+    mutable Thunk m_thunk;
+    mutable AST m_source;
+    mutable int m_offset;
+    mutable bool m_isRealized;
+    mutable bool m_isEmpty;
+    mutable AST m_first;
+    mutable AST m_rest;
+    mutable ItemBufferPtr m_chunk;
+    mutable AST m_chunkRest;
+};
+
+// The integers from start towards end (exclusive) in increments of
+// step, computed on demand instead of being stored. end is kept in 128
+// bits, as the end of items taken from an infinite range may lie just
+// past the int64 limits.
+class Range : public Expression {
+public:
+    Range(int64_t start, __int128 end, int64_t step, bool isInfinite = false);
+    Range(const Range& that, AST meta);
+
+    int64_t start() const { return m_start; }
+    int64_t step() const { return m_step; }
+    // the item at index, which an infinite range can run past the
+    // largest integer to reach
+    int64_t at(int64_t index) const
+    {
+        const __int128 value = (__int128)m_start + (__int128)index * m_step;
+        if ( value > INT64_MAX || value < INT64_MIN ) {
+            throw LISP_ERROR("Integer overflow");
+        }
+        return (int64_t)value;
+    }
+
+    int64_t count() const;
+    bool isEmpty() const;
+    bool isInfinite() const { return m_isInfinite; }
+
+    AST first() const;
+    AST rest() const;
+    AST nth(int64_t index) const;
+    AST take(int64_t n) const;
+    AST drop(int64_t n) const;
+    AST toList() const;
+
+    const std::string toString(bool readably) const;
+    bool operator==(const Expression* rhs) const;
+    WITH_META(Range);
+private:
+    // the number of items of a finite range, which count throws for
+    // when it does not fit in an int64
+    __int128 length() const;
+
+    const int64_t m_start;
+    const __int128 m_end;
+    const int64_t m_step;
+    const bool m_isInfinite;
+};
+
+// A fixed-size array of unboxed int64 or double values, so numeric
+// kernels (see simd.h) can run over it without a pointer chase per
+// item. Unlike the other collections it is mutable through aset!.
+class NumArray : public Expression {
+public:
+    enum Kind { INT, DOUBLE };
+
+    NumArray(Kind kind, size_t count);
+    NumArray(const NumArray& that, AST meta);
+
+    Kind kind() const { return m_kind; }
+    size_t count() const { return m_kind == INT ? m_ints.size() : m_doubles.size(); }
+
+    int64_t* ints() { return m_ints.data(); }
+    const int64_t* ints() const { return m_ints.data(); }
+    double* doubles() { return m_doubles.data(); }
+    const double* doubles() const { return m_doubles.data(); }
+
+    AST item(size_t index) const;
+    void setItem(size_t index, AST value);
+    void resize(size_t count);
+    AST toList() const;
+
+    const std::string toString(bool readably) const;
+    bool operator==(const Expression* rhs) const;
+    WITH_META(NumArray);
+private:
+    const Kind m_kind;
+    std::vector<int64_t> m_ints;
+    std::vector<double> m_doubles;
+};
+
+class Transient : public Expression {
+public:
+    Transient(AST coll);
+    virtual ~Transient() { delete m_items; }
+
+    void conj(AST item);
+    void assoc(AST key, AST value);
+    void dissoc(AST key);
+    AST persistent();
+
+    int count() const;
+
+    virtual AST doWithMeta(AST meta) const;
+    const std::string toString(bool readably) const;
+    bool operator==(const Expression* rhs) const { return this == rhs; }
+
+private:
+    void ensureEditable() const;
+
+    AST_vec* m_items;
+    AST m_hash;
+    const std::thread::id m_owner;
 };
 
 class Applicable : public Expression {
@@ -289,6 +756,7 @@ private:
 class Lambda : public Applicable {
 public:
     Lambda(const std::vector<std::string>& bindings, AST body, EnvPtr env);
+    Lambda(ScopePtr scope, bool isVariadic, AST body, EnvPtr env);
     Lambda(const Lambda& that, AST meta);
     Lambda(const Lambda& that, bool isMacro);
 
@@ -300,34 +768,299 @@ public:
 
     AST getBody() const { return m_body; }
     bool isMacro() const { return m_isMacro; }
+    bool isAnalyzed() const { return m_scope; }
 
     virtual AST doWithMeta(AST meta) const;
 
 private:
-    const std::vector<std::string> m_bindings;
+    const std::vector<const Name*> m_bindings;
     const AST m_body;
     const EnvPtr m_env;
     const bool m_isMacro;
+
+    // set for an analyzed body, whose arguments are bound by slot
+    const ScopePtr m_scope;
+    const bool m_isVariadic;
+};
+
+// A form the analyzer has compiled: its special form, the shape of its
+// call and the slots of its variables are worked out once, so running
+// it skips EVAL's dispatch. It keeps the source items, so it still reads
+// as the list it was made from.
+//
+// run evaluates the form in env. A form in tail position may instead set
+// env and tail to what should be evaluated next and return NULL; EVAL
+// loops on that, which keeps tail calls from growing the stack.
+class CompiledForm : public List {
+public:
+    CompiledForm(const List& source) : List(source.begin(), source.end()) { }
+
+    virtual AST run(EnvPtr& env, AST& tail) const = 0;
+
+    // runs the form and then its tail, if it left one
+    virtual AST eval(EnvPtr env);
+};
+
+// A fn* form after analysis, with the body resolved against scope.
+class FnForm : public CompiledForm {
+public:
+    FnForm(const List& source, ScopePtr scope, bool isVariadic, AST body);
+
+    virtual AST run(EnvPtr& env, AST& tail) const;
+
+    // with the VM engine on, the closure's body is the bytecode for body
+    AST makeClosure(EnvPtr env) const;
+
+    AST body() const { return m_body; }
+
+private:
+    const ScopePtr m_scope;
+    const bool m_isVariadic;
+    const AST m_body;
+    mutable AST m_code;
+};
+
+// A let* form after analysis: each value is evaluated into its slot in a
+// frame laid out by scope, then the body runs in that frame.
+class LetForm : public CompiledForm {
+public:
+    struct Binding {
+        int slot;
+        AST value;
+    };
+
+    LetForm(const List& source, ScopePtr scope, std::vector<Binding>&& bindings, AST body);
+
+    virtual AST run(EnvPtr& env, AST& tail) const;
+
+    ScopePtr scope() const { return m_scope; }
+    const std::vector<Binding>& bindings() const { return m_bindings; }
+    AST body() const { return m_body; }
+
+private:
+    const ScopePtr m_scope;
+    const std::vector<Binding> m_bindings;
+    const AST m_body;
+};
+
+// if, with a NULL otherwise when there is no else branch
+class IfForm : public CompiledForm {
+public:
+    IfForm(const List& source, AST test, AST then, AST otherwise);
+
+    virtual AST run(EnvPtr& env, AST& tail) const;
+
+    AST test() const { return m_test; }
+    AST then() const { return m_then; }
+    AST otherwise() const { return m_otherwise; }
+
+private:
+    const AST m_test;
+    const AST m_then;
+    const AST m_otherwise;
+};
+
+class DoForm : public CompiledForm {
+public:
+    DoForm(const List& source, AST_vec&& body);
+
+    virtual AST run(EnvPtr& env, AST& tail) const;
+
+    const AST_vec& body() const { return m_body; }
+
+private:
+    const AST_vec m_body;
+};
+
+class DefForm : public CompiledForm {
+public:
+    DefForm(const List& source, const Name* name, AST value);
+
+    virtual AST run(EnvPtr& env, AST& tail) const;
+
+    const Name* name() const { return m_name; }
+    AST value() const { return m_value; }
+
+private:
+    const Name* const m_name;
+    const AST m_value;
+};
+
+class QuoteForm : public CompiledForm {
+public:
+    QuoteForm(const List& source) : CompiledForm(source) { }
+
+    virtual AST run(EnvPtr& env, AST& tail) const;
+};
+
+// try*, with a NULL handler when there is no catch*. The handler runs in
+// a frame laid out by scope, which holds just the exception.
+class TryForm : public CompiledForm {
+public:
+    TryForm(const List& source, AST body, ScopePtr scope, AST handler);
+
+    virtual AST run(EnvPtr& env, AST& tail) const;
+
+    AST body() const { return m_body; }
+    ScopePtr scope() const { return m_scope; }
+    AST handler() const { return m_handler; }
+
+private:
+    const AST m_body;
+    const ScopePtr m_scope;
+    const AST m_handler;
+};
+
+// The argument vector of a call, taken from a free list instead of being
+// allocated each time, and cleared and put back when the call is done.
+class ArgBuffer {
+public:
+    ArgBuffer()
+    {
+        if ( s_spare.empty() ) {
+            m_items = new AST_vec;
+        }
+        else {
+            m_items = s_spare.back();
+            s_spare.pop_back();
+        }
+    }
+
+    ~ArgBuffer()
+    {
+        m_items->clear();
+        s_spare.push_back(m_items);
+    }
+
+    AST_vec& items() { return *m_items; }
+
+private:
+    AST_vec* m_items;
+
+    static std::vector<AST_vec*> s_spare;
+};
+
+// The expansion of a macro call site, analyzed in the env of the call.
+// It is kept for as long as the head of the call evaluates to the macro
+// it was expanded with, so redefining the macro expands it again.
+class MacroExpansion {
+public:
+    AST expand(const List& call, AST macro, EnvPtr env);
+
+private:
+    AST m_macro;
+    AST m_expansion;
+};
+
+// A call of a function or builtin. If the head turns out to be a macro,
+// defined after this was compiled, the call is expanded instead.
+class CallForm : public CompiledForm {
+public:
+    CallForm(const List& source, AST op, AST_vec&& args);
+
+    virtual AST run(EnvPtr& env, AST& tail) const;
+
+    AST op() const { return m_op; }
+    const AST_vec& args() const { return m_args; }
+
+private:
+    const AST m_op;
+    const AST_vec m_args;
+    mutable MacroExpansion m_expansion;
+};
+
+// A form the analyzer leaves to EVAL as it is: a macro call, a quasiquote
+// and the like, or one too malformed to compile, so that EVAL reports it.
+// A macro call is expanded here instead, once per MacroExpansion.
+class EvalForm : public CompiledForm {
+public:
+    EvalForm(const List& source, AST form);
+
+    virtual AST run(EnvPtr& env, AST& tail) const;
+
+    AST form() const { return m_form; }
+
+private:
+    const AST m_form;
+    AST m_head; // a GlobalSymbol for the head of a macro call
+    mutable MacroExpansion m_expansion;
+};
+
+// The field layout of a defrecord type. Applying it builds a record
+// from positional field values, which is what ->Name is bound to.
+class RecordType : public Applicable {
+public:
+    RecordType(const std::string& name, AST_iter fieldsBegin, AST_iter fieldsEnd);
+    RecordType(const RecordType& that, AST meta);
+
+    const std::string& name() const { return m_name; }
+    int fieldCount() const { return m_fields.size(); }
+    AST field(int index) const { return m_fields[index]; }
+    int slotOf(AST key) const;
+
+    virtual AST apply(AST_iter argsBegin, AST_iter argsEnd) const;
+    AST fromMap(AST map) const;
+
+    const std::string toString(bool readably) const;
+    bool operator==(const Expression* rhs) const { return this == rhs; }
+    WITH_META(RecordType);
+private:
+    const std::string m_name;
+    const AST_vec m_fields;
+};
+
+// A map whose declared fields live in a flat slot array in the order
+// of its RecordType. Keys outside the declared fields go to m_extra.
+class Record : public Expression {
+public:
+    Record(AST recordType, AST_vec&& slots, AST extra);
+    Record(const Record& that, AST meta);
+
+    AST recordType() const { return m_type; }
+    AST slot(int index) const { return m_slots[index]; }
+
+    AST get(AST key) const;
+    bool contains(AST key) const;
+    AST assoc(AST_iter argsBegin, AST_iter argsEnd) const;
+    AST dissoc(AST_iter argsBegin, AST_iter argsEnd) const;
+    AST keys() const;
+    AST values() const;
+    int count() const;
+
+    const std::string toString(bool readably) const;
+    bool operator==(const Expression* rhs) const;
+    WITH_META(Record);
+private:
+    const RecordType* layout() const;
+
+    const AST m_type;
+    const AST_vec m_slots;
+    const AST m_extra;
 };
 
 namespace type {
 
     AST builtin(const std::string& name, BuiltIn::ApplyFunc handler);
     AST lambda(const std::vector<std::string>& bindings, AST body, EnvPtr env);
+    AST lambda(ScopePtr scope, bool isVariadic, AST body, EnvPtr env);
     AST macro(const Lambda& lambda);
     AST atom(AST value);
 
-    AST symbol(const std::string& token);
-    AST keyword(const std::string& token);
+    AST symbol(std::string token);
+    AST keyword(std::string token);
 
     AST falseValue();
     AST nilValue();
     AST trueValue();
 
     AST boolean(bool value);
-    AST string(const std::string& token);
+    AST string(std::string token);
+    AST character(unsigned char c);
+    AST rope(AST left, AST right);
     AST integer(const std::string& token);
     AST integer(int64_t value);
+    AST floating(const std::string& token);
+    AST floating(double value);
 
     AST hash(AST_iter argsBegin, AST_iter argsEnd, bool isEvaluated);
     AST hash(const Hash::Map& map);
@@ -341,6 +1074,22 @@ namespace type {
 
     AST vector(AST_vec* items);
     AST vector(AST_iter begin, AST_iter end);
+
+    AST set(AST_iter begin, AST_iter end, bool isEvaluated);
+    AST set(AST_vec* items, bool isEvaluated);
+
+    AST sorted(AST comparator, bool isMap, AST_iter begin, AST_iter end);
+
+    AST queue(AST_iter begin, AST_iter end);
+
+    AST lazySeq(LazySeq::Thunk thunk);
+    AST lazySeq(AST first, AST rest);
+
+    AST range(int64_t start, int64_t end, int64_t step);
+
+    AST numArray(NumArray::Kind kind, size_t count);
+
+    AST transient(AST coll);
 } // namespace type
 
 #endif // TYPES_H
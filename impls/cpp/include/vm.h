@@ -0,0 +1,79 @@
+#ifndef VM_H
+#define VM_H
+
+#include "types.h"
+
+#include <string>
+#include <vector>
+
+// The bytecode engine, used instead of running CompiledForms when the
+// interpreter is started with --engine=vm. It compiles the forms the
+// analyzer produced to bytecode and runs them on a value stack, keeping
+// calls between compiled functions on a frame stack of its own instead
+// of recursing through EVAL. Macro calls, quasiquote and forms passed to
+// eval are still left to EVAL.
+namespace vm {
+
+    bool isEnabled();
+    void setEnabled(bool isEnabled);
+
+    enum Op : int {
+        CONST,          // k            push constant k
+        LOCAL,          // depth slot n push a local, named names[n]
+        GLOBAL,         // k            push the global constant k refers to
+        DEF,            // n            bind names[n] in the current frame to the top value
+        POP,            //              drop the top value
+        JUMP,           // to           carry on at to
+        JUMP_IF_FALSE,  // to           pop a value, jump if it is false or nil
+        CHECK_MACRO,    // k to         if the top value is a macro, pop it, push the
+                        //              CallForm constant k evaluated by EVAL and jump to to
+        CALL,           // argc k       call the value under argc args, k is the CallForm
+        TAIL_CALL,      // argc k       the same, replacing the running function
+        RETURN,         //              return the top value
+        CLOSURE,        // k            push a closure of the FnForm constant k
+        ENTER,          // s            enter a frame laid out by scopes[s]
+        BIND,           // slot         pop a value into slot of the current frame
+        LEAVE,          //              go back to the frame enclosing the current one
+        TRY,            // k s to       run chunk k; push its value and jump to to, or, if
+                        //              it throws, enter a frame scopes[s] holding the exception
+        EVAL_FORM,      // k            push constant k evaluated by EVAL
+        OP_COUNT
+    };
+
+    // The bytecode for a function body or a top-level form.
+    class Chunk : public Expression {
+    public:
+        Chunk() { }
+        Chunk(const Chunk& that, AST meta);
+
+        // runs the bytecode in env
+        virtual AST eval(EnvPtr env);
+
+        std::string disassemble() const;
+
+        virtual const std::string toString(bool readably) const;
+        virtual bool operator==(const Expression* rhs) const { return this == rhs; }
+
+        WITH_META(Chunk);
+
+    private:
+        friend class Compiler;
+        friend AST execute(const Chunk* chunk, EnvPtr env);
+
+        std::vector<int> m_code;
+        AST_vec m_constants;
+        std::vector<const Name*> m_names;
+        std::vector<ScopePtr> m_scopes;
+    };
+
+    // compiles a form the analyzer produced to a Chunk
+    AST compile(AST form);
+
+    AST execute(const Chunk* chunk, EnvPtr env);
+
+    // analyzes, compiles and runs a top-level form
+    AST run(AST form, EnvPtr env);
+
+} // namespace vm
+
+#endif // VM_H
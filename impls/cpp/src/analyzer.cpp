@@ -0,0 +1,444 @@
+#include "analyzer.h"
+#include "environment.h"
+#include "types.h"
+
+#include <algorithm>
+
+namespace {
+
+// x for a form (name x), where name is one of the quasiquote markers;
+// NULL for anything else. A marker with the wrong number of arguments
+// sets isMalformed, and is left for EVAL to report.
+AST markedArg(AST form, const char* name, bool& isMalformed)
+{
+    const List* list = DYNAMIC_CAST(List, form);
+    const Symbol* head = list && !list->isEmpty() ? DYNAMIC_CAST(Symbol, list->item(0)) : NULL;
+    if ( !head || head->value() != name ) {
+        return NULL;
+    }
+    if ( list->count() != 2 ) {
+        isMalformed = true;
+        return NULL;
+    }
+    return list->item(1);
+}
+
+// whether a quasiquoted form has no unquotes, at the levels quasiquote
+// looks into: lists and vectors, but not maps
+bool isConstantTemplate(AST form, bool& isMalformed)
+{
+    if ( markedArg(form, "unquote", isMalformed) || isMalformed ) {
+        return false;
+    }
+
+    const Sequence* seq = DYNAMIC_CAST(Sequence, form);
+    if ( !seq ) {
+        return true;
+    }
+    for ( auto it = seq->begin(); it != seq->end(); ++it ) {
+        if ( markedArg(*it, "splice-unquote", isMalformed) || isMalformed
+             || !isConstantTemplate(*it, isMalformed) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+AST quoted(AST form)
+{
+    return type::list(type::symbol("quote"), form);
+}
+
+AST expandQuasiquote(AST form, bool& isMalformed)
+{
+    if ( isConstantTemplate(form, isMalformed) ) {
+        const bool isLiteral = !DYNAMIC_CAST(Symbol, form) && !DYNAMIC_CAST(Hash, form)
+                            && !DYNAMIC_CAST(Sequence, form);
+        return isLiteral ? form : quoted(form);
+    }
+    if ( isMalformed ) {
+        return NULL;
+    }
+
+    if ( AST arg = markedArg(form, "unquote", isMalformed) ) {
+        return arg;
+    }
+
+    // the items after the last one with an unquote make one literal list,
+    // the ones before it are consed or concatenated onto it
+    const Sequence* seq = STATIC_CAST(Sequence, form);
+    int split = seq->count();
+    while ( split > 0 && !markedArg(seq->item(split - 1), "splice-unquote", isMalformed)
+            && isConstantTemplate(seq->item(split - 1), isMalformed) ) {
+        --split;
+    }
+
+    AST result = quoted(type::list(seq->begin() + split, seq->end()));
+    for ( int i = split - 1; i >= 0; --i ) {
+        AST item = seq->item(i);
+        if ( AST spliced = markedArg(item, "splice-unquote", isMalformed) ) {
+            result = type::list(type::symbol("concat"), spliced, result);
+            continue;
+        }
+
+        AST expanded = isMalformed ? AST() : expandQuasiquote(item, isMalformed);
+        if ( !expanded ) {
+            return NULL;
+        }
+        result = type::list(type::symbol("cons"), expanded, result);
+    }
+
+    if ( DYNAMIC_CAST(Vector, form) ) {
+        result = type::list(type::symbol("vec"), result);
+    }
+    return result;
+}
+
+class Analyzer {
+public:
+    Analyzer(EnvPtr env);
+
+    AST analyze(AST form);
+    AST analyzeFn(AST form, const List* list);
+    AST analyzeLet(AST form, const List* list);
+
+private:
+    AST analyzeList(AST form, const List* list);
+    AST analyzeTry(AST form, const List* list);
+    AST leaveToEval(AST form, const List* source);
+    AST_vec analyzeItems(AST_iter begin, AST_iter end);
+    AST analyzeHash(AST form, const Hash* hash);
+    AST resolve(AST form, const Symbol* symbol);
+    bool isLocal(const Name* name) const;
+    bool isMacroCall(const Symbol* head) const;
+
+    EnvPtr m_env;
+
+    // the scopes of the frames around the code being analyzed, innermost
+    // last; frames without slots, such as the root, are NULL
+    std::vector<const Scope*> m_scopes;
+};
+
+Analyzer::Analyzer(EnvPtr env)
+    : m_env(env)
+{
+    for ( EnvPtr frame = env; frame; frame = frame->outer() ) {
+        m_scopes.push_back(frame->scope());
+    }
+    std::reverse(m_scopes.begin(), m_scopes.end());
+}
+
+AST Analyzer::analyze(AST form)
+{
+    if ( const Symbol* symbol = DYNAMIC_CAST(Symbol, form) ) {
+        return resolve(form, symbol);
+    }
+
+    if ( const List* list = DYNAMIC_CAST(List, form) ) {
+        return analyzeList(form, list);
+    }
+
+    // a form built with cons or concat runs as the list it realizes to
+    if ( const LazySeq* lazy = DYNAMIC_CAST(LazySeq, form) ) {
+        return analyze(lazy->toList());
+    }
+
+    if ( const Vector* vector = DYNAMIC_CAST(Vector, form) ) {
+        AST_vec* items = new AST_vec;
+        items->reserve(vector->count());
+        for ( auto it = vector->begin(); it != vector->end(); ++it ) {
+            items->push_back(analyze(*it));
+        }
+        return type::vector(items);
+    }
+
+    if ( const Hash* hash = DYNAMIC_CAST(Hash, form) ) {
+        return analyzeHash(form, hash);
+    }
+
+    return form;
+}
+
+AST Analyzer::resolve(AST form, const Symbol* symbol)
+{
+    const Name* name = symbol->name();
+
+    int depth = 0;
+    for ( auto it = m_scopes.rbegin(); it != m_scopes.rend(); ++it, ++depth ) {
+        int slot = *it ? (*it)->slotOf(name) : -1;
+        if ( slot >= 0 ) {
+            return AST(new LocalSymbol(name, depth, slot));
+        }
+    }
+
+    return AST(new GlobalSymbol(name));
+}
+
+bool Analyzer::isLocal(const Name* name) const
+{
+    for ( const Scope* scope : m_scopes ) {
+        if ( scope && scope->slotOf(name) >= 0 ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool Analyzer::isMacroCall(const Symbol* head) const
+{
+    if ( isLocal(head->name()) ) {
+        return false;
+    }
+
+    const AST* value = m_env->findValue(head->name());
+    const Lambda* lambda = value ? DYNAMIC_CAST(Lambda, *value) : NULL;
+    return lambda && lambda->isMacro();
+}
+
+AST Analyzer::analyzeList(AST form, const List* list)
+{
+    if ( list->isEmpty() ) {
+        return form;
+    }
+
+    // special forms are recognized by name, as EVAL does, even where a
+    // local shadows the name
+    if ( const Symbol* head = DYNAMIC_CAST(Symbol, list->item(0)) ) {
+        const int argCount = list->count() - 1;
+
+        switch ( head->name()->special() ) {
+            case Name::FN: {
+                AST analyzed = analyzeFn(form, list);
+                return analyzed ? analyzed : leaveToEval(form, list);
+            }
+
+            case Name::LET: {
+                AST analyzed = analyzeLet(form, list);
+                return analyzed ? analyzed : leaveToEval(form, list);
+            }
+
+            case Name::TRY: {
+                return analyzeTry(form, list);
+            }
+
+            case Name::DEF: {
+                const Symbol* id = argCount == 2 ? DYNAMIC_CAST(Symbol, list->item(1)) : NULL;
+                if ( !id ) {
+                    return leaveToEval(form, list);
+                }
+                return AST(new DefForm(*list, id->name(), analyze(list->item(2))));
+            }
+
+            case Name::DEFMACRO: {
+                if ( argCount != 2 ) {
+                    return leaveToEval(form, list);
+                }
+                AST analyzed = type::list(list->item(0), list->item(1), analyze(list->item(2)));
+                return leaveToEval(analyzed, list);
+            }
+
+            case Name::DO: {
+                if ( argCount < 1 ) {
+                    return leaveToEval(form, list);
+                }
+                return AST(new DoForm(*list, analyzeItems(list->begin() + 1, list->end())));
+            }
+
+            case Name::IF: {
+                if ( argCount < 2 || argCount > 3 ) {
+                    return leaveToEval(form, list);
+                }
+                AST otherwise = argCount == 3 ? analyze(list->item(3)) : AST();
+                return AST(new IfForm(*list, analyze(list->item(1)),
+                                      analyze(list->item(2)), otherwise));
+            }
+
+            case Name::QUOTE: {
+                if ( argCount != 1 ) {
+                    return leaveToEval(form, list);
+                }
+                return AST(new QuoteForm(*list));
+            }
+
+            case Name::QUASIQUOTE: {
+                // expanded once here instead of each time the form runs
+                AST expanded = argCount == 1 ? expandQuasiquote(list->item(1)) : AST();
+                return expanded ? analyze(expanded) : leaveToEval(form, list);
+            }
+
+            case Name::QUASIQUOTEEXPAND:
+            case Name::MACROEXPAND: {
+                return leaveToEval(form, list);
+            }
+
+            default:
+                if ( isMacroCall(head) ) {
+                    return leaveToEval(form, list);
+                }
+                break;
+        }
+    }
+
+    return AST(new CallForm(*list, analyze(list->item(0)),
+                            analyzeItems(list->begin() + 1, list->end())));
+}
+
+AST Analyzer::leaveToEval(AST form, const List* source)
+{
+    return AST(new EvalForm(*source, form));
+}
+
+AST_vec Analyzer::analyzeItems(AST_iter begin, AST_iter end)
+{
+    AST_vec items;
+    items.reserve(std::distance(begin, end));
+    for ( auto it = begin; it != end; ++it ) {
+        items.push_back(analyze(*it));
+    }
+
+    return items;
+}
+
+AST Analyzer::analyzeHash(AST form, const Hash* hash)
+{
+    if ( hash->isEvaluated() ) {
+        return form;
+    }
+
+    AST keys = hash->keys();
+    AST values = hash->values();
+    const Sequence* keySeq = STATIC_CAST(Sequence, keys);
+    const Sequence* valueSeq = STATIC_CAST(Sequence, values);
+
+    AST_vec* items = new AST_vec;
+    items->reserve(2 * keySeq->count());
+    for ( size_t i = 0; i < keySeq->count(); ++i ) {
+        items->push_back(keySeq->item(i));
+        items->push_back(analyze(valueSeq->item(i)));
+    }
+
+    return type::hash(items, false);
+}
+
+AST Analyzer::analyzeTry(AST form, const List* list)
+{
+    if ( list->count() == 2 ) {
+        return AST(new TryForm(*list, analyze(list->item(1)), NULL, NULL));
+    }
+
+    const List* catchBlock = list->count() == 3 ? DYNAMIC_CAST(List, list->item(2)) : NULL;
+    if ( !catchBlock || catchBlock->count() != 3 ) {
+        return leaveToEval(form, list);
+    }
+
+    const Symbol* catchSym = DYNAMIC_CAST(Symbol, catchBlock->item(0));
+    const Symbol* excSym = DYNAMIC_CAST(Symbol, catchBlock->item(1));
+    if ( !catchSym || catchSym->name()->special() != Name::CATCH || !excSym ) {
+        return leaveToEval(form, list);
+    }
+
+    // the handler runs in a frame of its own holding the exception
+    ScopePtr scope(new Scope({ excSym->name() }));
+    m_scopes.push_back(scope.ptr());
+    AST handler = analyze(catchBlock->item(2));
+    m_scopes.pop_back();
+
+    return AST(new TryForm(*list, analyze(list->item(1)), scope, handler));
+}
+
+AST Analyzer::analyzeFn(AST form, const List* list)
+{
+    const Sequence* params = list->count() == 3 ? DYNAMIC_CAST(Sequence, list->item(1)) : NULL;
+    if ( !params ) {
+        return NULL;
+    }
+
+    std::vector<const Name*> names;
+    bool isVariadic = false;
+    for ( size_t i = 0; i < params->count(); ++i ) {
+        const Symbol* param = DYNAMIC_CAST(Symbol, params->item(i));
+        if ( !param ) {
+            return NULL;
+        }
+        if ( param->value() == "&" ) {
+            if ( i != params->count() - 2 ) {
+                return NULL;
+            }
+            isVariadic = true;
+            continue;
+        }
+        names.push_back(param->name());
+    }
+
+    ScopePtr scope(new Scope(std::move(names)));
+    m_scopes.push_back(scope.ptr());
+    AST body = analyze(list->item(2));
+    m_scopes.pop_back();
+
+    return AST(new FnForm(*list, scope, isVariadic, body));
+}
+
+AST Analyzer::analyzeLet(AST form, const List* list)
+{
+    const Sequence* bindings = list->count() == 3 ? DYNAMIC_CAST(Sequence, list->item(1)) : NULL;
+    if ( !bindings || bindings->count() % 2 != 0 ) {
+        return NULL;
+    }
+
+    // A name bound twice keeps one slot, which the second binding
+    // overwrites. Every name is in scope from the start: a value that
+    // refers to a name not bound yet finds its slot empty and looks
+    // further out, the same as it did before analysis.
+    std::vector<const Name*> names;
+    std::vector<int> slots;
+    for ( size_t i = 0; i < bindings->count(); i += 2 ) {
+        const Symbol* var = DYNAMIC_CAST(Symbol, bindings->item(i));
+        if ( !var ) {
+            return NULL;
+        }
+        auto it = std::find(names.begin(), names.end(), var->name());
+        slots.push_back(it - names.begin());
+        if ( it == names.end() ) {
+            names.push_back(var->name());
+        }
+    }
+
+    ScopePtr scope(new Scope(std::move(names)));
+    m_scopes.push_back(scope.ptr());
+
+    std::vector<LetForm::Binding> values;
+    values.reserve(slots.size());
+    for ( size_t i = 0; i < slots.size(); ++i ) {
+        values.push_back({ slots[i], analyze(bindings->item(2 * i + 1)) });
+    }
+    AST body = analyze(list->item(2));
+
+    m_scopes.pop_back();
+
+    return AST(new LetForm(*list, scope, std::move(values), body));
+}
+
+} // namespace
+
+AST analyzeForm(AST form, EnvPtr env)
+{
+    const List* list = VALUE_CAST(List, form);
+    const Symbol* head = VALUE_CAST(Symbol, list->item(0));
+
+    Analyzer analyzer(env);
+    return head->name()->special() == Name::FN ? analyzer.analyzeFn(form, list)
+                                               : analyzer.analyzeLet(form, list);
+}
+
+AST analyzeTopLevel(AST form, EnvPtr env)
+{
+    Analyzer analyzer(env);
+    return analyzer.analyze(form);
+}
+
+AST expandQuasiquote(AST form)
+{
+    bool isMalformed = false;
+    return expandQuasiquote(form, isMalformed);
+}
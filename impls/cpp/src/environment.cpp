@@ -1,15 +1,61 @@
 #include "environment.h"
 #include <cassert>
 
+const AST* NameTable::find(const Name* name) const
+{
+    const size_t mask = m_entries.size() - 1;
+    for ( size_t i = name->hash() & mask; m_entries[i].name; i = (i + 1) & mask ) {
+        if ( m_entries[i].name == name ) {
+            return &m_entries[i].value;
+        }
+    }
+
+    return NULL;
+}
+
+AST& NameTable::operator[](const Name* name)
+{
+    if ( 2 * (m_count + 1) > m_entries.size() ) {
+        std::vector<Entry> old(2 * m_entries.size());
+        old.swap(m_entries);
+        m_count = 0;
+        for ( Entry& entry : old ) {
+            if ( entry.name ) {
+                (*this)[entry.name] = entry.value;
+            }
+        }
+    }
+
+    const size_t mask = m_entries.size() - 1;
+    size_t i = name->hash() & mask;
+    for ( ; m_entries[i].name; i = (i + 1) & mask ) {
+        if ( m_entries[i].name == name ) {
+            return m_entries[i].value;
+        }
+    }
+
+    ++m_count;
+    m_entries[i].name = name;
+    return m_entries[i].value;
+}
+
+uint64_t Env::s_version = 0;
+
+Env::Env(EnvPtr outer)
+    : m_outer_env(outer), m_boundCount(0), m_slots(NULL)
+{ }
+
 Env::Env(EnvPtr outer,
-       const std::vector<std::string>& bindings,
+       const std::vector<const Name*>& bindings,
        AST_iter argsBegin, AST_iter argsEnd)
-    : m_outer_env(outer)
+    : m_outer_env(outer), m_boundCount(0), m_slots(NULL)
 {
+    static const Name* rest = Name::intern("&");
+
     const int n = bindings.size();
     auto it = argsBegin;
     for ( int i = 0; i < n; ++i ) {
-        if ( bindings[i] == "&" ) {
+        if ( bindings[i] == rest ) {
             assert(i == n - 2 && "There must be one parameter after the &");
             set(bindings[n-1], type::list(it, argsEnd));
             return;
@@ -23,22 +69,105 @@ Env::Env(EnvPtr outer,
     assert(it == argsEnd && "Too many parameters");
 }
 
-AST Env::get(const std::string& symbol)
+Env::Env(EnvPtr outer, ScopePtr scope)
+    : m_outer_env(outer), m_boundCount(0), m_scope(scope)
 {
-    for ( EnvPtr env = this; env; env = env->m_outer_env ) {
-        auto it = env->m_map.find(symbol);
-        if ( it != env->m_map.end() ) {
-            return it->second;
+    const int size = scope->size();
+    m_slots = size <= INLINE_COUNT ? m_inlineSlots : new AST[size];
+}
+
+Env::~Env()
+{
+    if ( m_slots != m_inlineSlots ) {
+        delete[] m_slots;
+    }
+}
+
+const AST* Env::lookupBound(const Name* symbol) const
+{
+    if ( m_map ) {
+        return m_map->find(symbol);
+    }
+
+    for ( int i = 0; i < m_boundCount; ++i ) {
+        if ( m_boundNames[i] == symbol ) {
+            return &m_boundValues[i];
         }
     }
 
-    throw LISP_ERROR("\'", symbol, "\'", " not found");
+    return NULL;
 }
 
-EnvPtr Env::find(const std::string& symbol)
+const AST* Env::lookup(const Name* symbol) const
 {
-    for ( EnvPtr env = this; env; env = env->m_outer_env ) {
-        if ( env->m_map.find(symbol) != env->m_map.end() ) {
+    if ( m_scope ) {
+        int slot = m_scope->slotOf(symbol);
+        if ( slot >= 0 && m_slots[slot] ) {
+            return &m_slots[slot];
+        }
+    }
+
+    return lookupBound(symbol);
+}
+
+const AST* Env::findValue(const Name* symbol) const
+{
+    for ( const Env* env = this; env; env = env->m_outer_env.ptr() ) {
+        if ( const AST* value = env->lookup(symbol) ) {
+            return value;
+        }
+    }
+
+    return NULL;
+}
+
+bool Env::shadowsGlobal(const Name* symbol) const
+{
+    for ( const Env* env = this; env->m_outer_env; env = env->m_outer_env.ptr() ) {
+        if ( env->m_boundCount > 0 && env->lookupBound(symbol) ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+AST Env::get(const Name* symbol)
+{
+    if ( const AST* value = findValue(symbol) ) {
+        return *value;
+    }
+
+    throw LISP_ERROR("\'", symbol->text(), "\'", " not found");
+}
+
+AST Env::get(int depth, int slot, const Name* symbol)
+{
+    // only a def! in one of the frames in between can shadow the local
+    Env* env = this;
+    for ( ; depth > 0 && env; --depth ) {
+        if ( env->m_boundCount > 0 ) {
+            if ( const AST* value = env->lookupBound(symbol) ) {
+                return *value;
+            }
+        }
+        env = env->m_outer_env.ptr();
+    }
+
+    // A let* binding that refers to a name it is binding, or code moved
+    // out of the frames it was analyzed for, looks the name up instead.
+    if ( env && env->m_scope && slot < env->m_scope->size()
+        && env->m_slots[slot] && env->m_scope->name(slot) == symbol ) {
+        return env->m_slots[slot];
+    }
+
+    return get(symbol);
+}
+
+EnvPtr Env::find(const Name* symbol)
+{
+    for ( Env* env = this; env; env = env->m_outer_env.ptr() ) {
+        if ( env->lookup(symbol) ) {
             return env;
         }
     }
@@ -46,12 +175,62 @@ EnvPtr Env::find(const std::string& symbol)
     return NULL;
 }
 
-AST Env::set(const std::string& symbol, AST value)
+AST Env::set(const Name* symbol, AST value)
 {
-    m_map[symbol] = value;
+    ++s_version;
+
+    if ( m_scope ) {
+        int slot = m_scope->slotOf(symbol);
+        if ( slot >= 0 ) {
+            m_slots[slot] = value;
+            return value;
+        }
+    }
+
+    if ( m_map ) {
+        (*m_map)[symbol] = value;
+        return value;
+    }
+
+    for ( int i = 0; i < m_boundCount; ++i ) {
+        if ( m_boundNames[i] == symbol ) {
+            m_boundValues[i] = value;
+            return value;
+        }
+    }
+
+    if ( m_boundCount < INLINE_COUNT ) {
+        m_boundNames[m_boundCount] = symbol;
+        m_boundValues[m_boundCount] = value;
+        ++m_boundCount;
+        return value;
+    }
+
+    m_map.reset(new NameTable);
+    for ( int i = 0; i < m_boundCount; ++i ) {
+        (*m_map)[m_boundNames[i]] = m_boundValues[i];
+        m_boundValues[i] = AST();
+    }
+    ++m_boundCount;
+    (*m_map)[symbol] = value;
     return value;
 }
 
+AST Env::get(const std::string& symbol)
+{
+    return get(Name::intern(symbol));
+}
+
+EnvPtr Env::find(const std::string& symbol)
+{
+    return find(Name::intern(symbol));
+}
+
+AST Env::set(const std::string& symbol, AST value)
+{
+    return set(Name::intern(symbol), value);
+}
+
 EnvPtr Env::getRoot()
 {
     for ( EnvPtr env = this; env; env = env->m_outer_env ) {
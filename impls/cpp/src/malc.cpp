@@ -0,0 +1,716 @@
+#include "malc.h"
+#include "analyzer.h"
+#include "native.h"
+#include "parser.h"
+#include "types.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+
+namespace malc {
+
+namespace {
+
+// Thrown for a form the translation does not cover. The top-level form
+// it is part of is left to EVAL as a whole.
+struct Unsupported { };
+
+struct Local {
+    const Name* name;
+    std::string var;
+    int level;          // the function it belongs to, 0 outside any
+    bool isBound;       // false while the let* values before it run
+    bool isBoxed;       // see native::box
+};
+
+// a fn* being translated
+struct Function {
+    const Name* self;               // what it is being bound to, if anything
+    std::vector<std::string> params;
+    std::vector<std::string> captures;
+    bool loops;                     // has a call to itself in tail position
+};
+
+// What a form in tail position returns from. A let* or try* in an
+// expression is a lambda whose result is used on the spot, so calls in
+// it are made there; a fn* is a C++ function, whose calls in tail
+// position go through tailCall, and which goes round a loop for a call
+// to itself unless it has a rest parameter.
+enum Tail { IN_EXPRESSION, IN_FUNCTION, IN_LOOP };
+
+const char* const s_opNames[native::OP_COUNT] = {
+    "ADD", "SUB", "MUL", "LT", "LE", "GT", "GE", "EQ"
+};
+
+// a C++ string literal for text
+std::string quote(const std::string& text)
+{
+    std::string out = "\"";
+    for ( unsigned char c : text ) {
+        if ( c == '"' || c == '\\' ) {
+            out += '\\';
+            out += c;
+        }
+        else if ( c == '\n' ) {
+            out += "\\n";
+        }
+        else if ( c < ' ' || c > '~' ) {
+            char octal[8];
+            snprintf(octal, sizeof(octal), "\\%03o", c);
+            out += octal;
+        }
+        else {
+            out += c;
+        }
+    }
+    return out + '"';
+}
+
+const Symbol* headSymbol(const List* list)
+{
+    return list->isEmpty() ? NULL : DYNAMIC_CAST(Symbol, list->item(0));
+}
+
+class Translator {
+public:
+    Translator(EnvPtr env) : m_env(env), m_varCount(0) { }
+
+    void translateTopLevel(AST form);
+    std::string module(const std::string& path, size_t sourceHash) const;
+
+private:
+    std::string translate(AST form);
+    void translateTail(AST form, std::string& out, const std::string& indent, Tail tail);
+
+    std::string translateCall(const List* list, const char* call = "call");
+    std::string translateFn(const List* list, const Name* self);
+    void translateLet(const List* list, std::string& out, const std::string& indent, Tail tail);
+    void translateTry(const List* list, std::string& out, const std::string& indent, Tail tail);
+    void translateSelfCall(const List* list, std::string& out, const std::string& indent);
+    std::string statements(const List* list, void (Translator::*emit)(const List*, std::string&, const std::string&, Tail));
+
+    std::string symbol(const Symbol* symbol);
+    std::string constant(AST value);
+    std::string global(const Name* name);
+    std::string newVar(const char* prefix, const std::string& name);
+
+    bool isLocal(const Name* name) const;
+    AST expandMacro(const List* list);
+    bool isSelfCall(const List* list) const;
+
+    int level() const { return m_functions.size(); }
+
+    EnvPtr m_env;
+    std::vector<Local> m_locals;
+    std::vector<Function> m_functions;
+
+    std::vector<std::string> m_constants;
+    std::map<std::string, int> m_constantIndex;
+    std::vector<std::string> m_globals;
+    std::map<const Name*, int> m_globalIndex;
+
+    std::vector<std::string> m_definitions;
+    std::string m_load;
+    int m_varCount;
+};
+
+void Translator::translateTopLevel(AST form)
+{
+    const List* list = DYNAMIC_CAST(List, form);
+    if ( list && headSymbol(list) ) {
+        if ( AST expansion = expandMacro(list) ) {
+            translateTopLevel(expansion);
+            return;
+        }
+
+        // the forms of a top-level do run one by one, so each can use the
+        // macros the ones before it define
+        if ( headSymbol(list)->name()->special() == Name::DO && list->count() > 1 ) {
+            for ( auto it = list->begin() + 1; it != list->end(); ++it ) {
+                translateTopLevel(*it);
+            }
+            return;
+        }
+    }
+
+    const size_t definitionCount = m_definitions.size();
+    try {
+        m_load += "    (void)" + translate(form) + ";\n";
+    }
+    catch ( Unsupported& ) {
+        m_locals.clear();
+        m_functions.clear();
+        m_definitions.resize(definitionCount);
+        m_load += "    eval(" + constant(form) + ");\n";
+    }
+
+    EVAL(form, m_env);
+}
+
+std::string Translator::module(const std::string& path, size_t sourceHash) const
+{
+    std::ostringstream out;
+    out << "// Generated by malc from " << path << ", do not edit.\n"
+        << "#include \"native.h\"\n\n"
+        << "namespace {\n\n"
+        << "using namespace native;\n\n"
+        << "EnvPtr env;\n"
+        << "AST k[" << std::max<size_t>(m_constants.size(), 1) << "];\n"
+        << "AST g[" << std::max<size_t>(m_globals.size(), 1) << "];\n";
+
+    for ( const std::string& definition : m_definitions ) {
+        out << '\n' << definition;
+    }
+
+    out << "\nvoid load(EnvPtr rootEnv)\n{\n"
+        << "    env = rootEnv;\n";
+    for ( size_t i = 0; i < m_constants.size(); ++i ) {
+        out << "    k[" << i << "] = constant(" << quote(m_constants[i]) << ");\n";
+    }
+    for ( size_t i = 0; i < m_globals.size(); ++i ) {
+        out << "    g[" << i << "] = global(" << quote(m_globals[i]) << ");\n";
+    }
+    out << '\n' << m_load << "}\n\n"
+        << "Module module(" << quote(path) << ", " << sourceHash << "ULL, load);\n\n"
+        << "} // namespace\n";
+
+    return out.str();
+}
+
+std::string Translator::translate(AST form)
+{
+    // a macro may expand to a lazy sequence, which runs as a list
+    if ( const LazySeq* lazy = DYNAMIC_CAST(LazySeq, form) ) {
+        return translate(lazy->toList());
+    }
+
+    if ( const Symbol* sym = DYNAMIC_CAST(Symbol, form) ) {
+        return symbol(sym);
+    }
+
+    if ( const Vector* vector = DYNAMIC_CAST(Vector, form) ) {
+        std::string out = "vector({";
+        for ( auto it = vector->begin(); it != vector->end(); ++it ) {
+            out += (it == vector->begin() ? "" : ", ") + translate(*it);
+        }
+        return out + "})";
+    }
+
+    if ( const Hash* hash = DYNAMIC_CAST(Hash, form) ) {
+        AST keys = hash->keys();
+        AST values = hash->values();
+        const Sequence* keySeq = STATIC_CAST(Sequence, keys);
+        const Sequence* valueSeq = STATIC_CAST(Sequence, values);
+        std::string out = "hash({";
+        for ( size_t i = 0; i < keySeq->count(); ++i ) {
+            out += (i == 0 ? "" : ", ") + constant(keySeq->item(i))
+                 + ", " + translate(valueSeq->item(i));
+        }
+        return out + "})";
+    }
+
+    if ( DYNAMIC_CAST(Set, form) ) {
+        throw Unsupported();
+    }
+
+    const List* list = DYNAMIC_CAST(List, form);
+    if ( !list || list->isEmpty() ) {
+        return constant(form);
+    }
+
+    const int argCount = list->count() - 1;
+    const Symbol* head = headSymbol(list);
+    switch ( head ? head->name()->special() : Name::NOT_SPECIAL ) {
+        case Name::DEF: {
+            // def! binds in the root environment only outside any function
+            // or let*, which have no frame to bind in once compiled
+            const Symbol* id = argCount == 2 ? DYNAMIC_CAST(Symbol, list->item(1)) : NULL;
+            if ( !id || !m_locals.empty() || level() > 0 ) {
+                throw Unsupported();
+            }
+            const List* value = DYNAMIC_CAST(List, list->item(2));
+            const Symbol* valueHead = value ? headSymbol(value) : NULL;
+            const std::string code = valueHead && valueHead->name()->special() == Name::FN
+                ? translateFn(value, id->name())
+                : translate(list->item(2));
+            return "env->set(" + quote(id->value()) + ", " + code + ")";
+        }
+
+        case Name::DO: {
+            if ( argCount < 1 ) {
+                throw Unsupported();
+            }
+            std::string out = "(";
+            for ( int i = 1; i < argCount; ++i ) {
+                out += "(void)" + translate(list->item(i)) + ", ";
+            }
+            return out + translate(list->item(argCount)) + ")";
+        }
+
+        case Name::FN: {
+            return translateFn(list, NULL);
+        }
+
+        case Name::IF: {
+            if ( argCount < 2 || argCount > 3 ) {
+                throw Unsupported();
+            }
+            return "(" + translate(list->item(1)) + "->isTrue() ? "
+                + translate(list->item(2)) + " : "
+                + (argCount == 3 ? translate(list->item(3)) : "type::nilValue()") + ")";
+        }
+
+        case Name::LET: {
+            return statements(list, &Translator::translateLet);
+        }
+
+        case Name::QUASIQUOTE: {
+            if ( argCount != 1 ) {
+                throw Unsupported();
+            }
+            AST expanded = expandQuasiquote(list->item(1));
+            if ( !expanded ) {
+                throw Unsupported();
+            }
+            return translate(expanded);
+        }
+
+        case Name::QUOTE: {
+            if ( argCount != 1 ) {
+                throw Unsupported();
+            }
+            return constant(list->item(1));
+        }
+
+        case Name::TRY: {
+            return statements(list, &Translator::translateTry);
+        }
+
+        case Name::DEFMACRO:
+        case Name::MACROEXPAND:
+        case Name::QUASIQUOTEEXPAND:
+            throw Unsupported();
+
+        default: break;
+    }
+
+    if ( AST expansion = expandMacro(list) ) {
+        return translate(expansion);
+    }
+    return translateCall(list);
+}
+
+void Translator::translateTail(AST form, std::string& out, const std::string& indent, Tail tail)
+{
+    if ( const LazySeq* lazy = DYNAMIC_CAST(LazySeq, form) ) {
+        translateTail(lazy->toList(), out, indent, tail);
+        return;
+    }
+
+    const List* list = DYNAMIC_CAST(List, form);
+    const Symbol* head = list ? headSymbol(list) : NULL;
+    if ( !head ) {
+        const bool isCall = list && !list->isEmpty() && tail != IN_EXPRESSION;
+        out += indent + "return " + (isCall ? translateCall(list, "tailCall") : translate(form)) + ";\n";
+        return;
+    }
+
+    const int argCount = list->count() - 1;
+    switch ( head->name()->special() ) {
+        case Name::DO: {
+            if ( argCount < 1 ) {
+                throw Unsupported();
+            }
+            for ( int i = 1; i < argCount; ++i ) {
+                out += indent + "(void)" + translate(list->item(i)) + ";\n";
+            }
+            translateTail(list->item(argCount), out, indent, tail);
+            return;
+        }
+
+        case Name::IF: {
+            if ( argCount < 2 || argCount > 3 ) {
+                throw Unsupported();
+            }
+            out += indent + "if ( " + translate(list->item(1)) + "->isTrue() ) {\n";
+            translateTail(list->item(2), out, indent + "    ", tail);
+            out += indent + "}\n" + indent + "else {\n";
+            if ( argCount == 3 ) {
+                translateTail(list->item(3), out, indent + "    ", tail);
+            }
+            else {
+                out += indent + "    return type::nilValue();\n";
+            }
+            out += indent + "}\n";
+            return;
+        }
+
+        case Name::LET: {
+            translateLet(list, out, indent, tail);
+            return;
+        }
+
+        case Name::TRY: {
+            translateTry(list, out, indent, tail);
+            return;
+        }
+
+        // the other special forms are no calls, and translate knows
+        // which of them are left to EVAL
+        case Name::DEF:
+        case Name::DEFMACRO:
+        case Name::FN:
+        case Name::MACROEXPAND:
+        case Name::QUASIQUOTE:
+        case Name::QUASIQUOTEEXPAND:
+        case Name::QUOTE: {
+            out += indent + "return " + translate(form) + ";\n";
+            return;
+        }
+
+        default: break;
+    }
+
+    if ( AST expansion = expandMacro(list) ) {
+        translateTail(expansion, out, indent, tail);
+    }
+    else if ( tail == IN_LOOP && isSelfCall(list) ) {
+        translateSelfCall(list, out, indent);
+    }
+    else if ( tail != IN_EXPRESSION ) {
+        out += indent + "return " + translateCall(list, "tailCall") + ";\n";
+    }
+    else {
+        out += indent + "return " + translate(form) + ";\n";
+    }
+}
+
+std::string Translator::translateCall(const List* list, const char* call)
+{
+    const int argCount = list->count() - 1;
+    const Symbol* head = headSymbol(list);
+
+    std::string out = std::string(call) + "({";
+    if ( head && argCount == 2 && !isLocal(head->name()) ) {
+        static const char* const builtins[native::OP_COUNT] = {
+            "+", "-", "*", "<", "<=", ">", ">=", "="
+        };
+        for ( int op = 0; op < native::OP_COUNT; ++op ) {
+            if ( head->value() == builtins[op] ) {
+                out = "call(" + std::string(s_opNames[op]) + ", {";
+                break;
+            }
+        }
+    }
+
+    for ( auto it = list->begin(); it != list->end(); ++it ) {
+        out += (it == list->begin() ? "" : ", ") + translate(*it);
+    }
+    return out + "})";
+}
+
+// a let* or try* in an expression runs as a lambda called on the spot
+std::string Translator::statements(const List* list,
+    void (Translator::*emit)(const List*, std::string&, const std::string&, Tail))
+{
+    std::string out = "[&]() -> AST {\n";
+    (this->*emit)(list, out, "    ", IN_EXPRESSION);
+    return out + "}()";
+}
+
+std::string Translator::translateFn(const List* list, const Name* self)
+{
+    const Sequence* params = list->count() == 3 ? DYNAMIC_CAST(Sequence, list->item(1)) : NULL;
+    if ( !params ) {
+        throw Unsupported();
+    }
+
+    const size_t localCount = m_locals.size();
+    m_functions.push_back(Function{ self, { }, { }, false });
+
+    std::string rest;
+    for ( size_t i = 0; i < params->count(); ++i ) {
+        const Symbol* param = DYNAMIC_CAST(Symbol, params->item(i));
+        if ( !param || (param->value() == "&" && i != params->count() - 2) ) {
+            throw Unsupported();
+        }
+        if ( param->value() == "&" ) {
+            continue;
+        }
+
+        const std::string var = newVar("p", param->value());
+        m_locals.push_back(Local{ param->name(), var, level(), true, false });
+        if ( i > 0 && params->item(i - 1)->toString(false) == "&" ) {
+            rest = var;
+        }
+        else {
+            m_functions.back().params.push_back(var);
+        }
+    }
+
+    std::string body;
+    translateTail(list->item(2), body, "        ", rest.empty() ? IN_LOOP : IN_FUNCTION);
+
+    m_locals.resize(localCount);
+    const Function function = m_functions.back();
+    m_functions.pop_back();
+
+    // with no loop, the body loses the indent it would have inside one
+    if ( !function.loops ) {
+        std::string unindented;
+        std::istringstream lines(body);
+        for ( std::string line; std::getline(lines, line); ) {
+            unindented += line.substr(std::min({ size_t(4), line.size(), line.find_first_not_of(' ') })) + '\n';
+        }
+        body = unindented;
+    }
+
+    const std::string name = "fn_" + std::to_string(m_definitions.size());
+    const int paramCount = function.params.size();
+    std::string code = "AST " + name + "(const Function* self, AST_iter argsBegin, AST_iter argsEnd)\n{\n"
+        + "    checkArgs(argsBegin, argsEnd, " + std::to_string(paramCount) + ", "
+        + (rest.empty() ? "false" : "true") + ");\n";
+    for ( size_t i = 0; i < function.captures.size(); ++i ) {
+        code += "    AST " + function.captures[i] + " = self->captured(" + std::to_string(i) + ");\n";
+    }
+    for ( int i = 0; i < paramCount; ++i ) {
+        code += "    AST " + function.params[i] + " = argsBegin[" + std::to_string(i) + "];\n";
+    }
+    if ( !rest.empty() ) {
+        code += "    AST " + rest + " = type::list(argsBegin + " + std::to_string(paramCount) + ", argsEnd);\n";
+    }
+    code += function.loops ? "    while ( true ) {\n" + body + "    }\n}\n" : body + "}\n";
+    m_definitions.push_back(code);
+
+    std::string closure = "closure(&" + name + ", {";
+    for ( size_t i = 0; i < function.captures.size(); ++i ) {
+        closure += (i == 0 ? "" : ", ") + function.captures[i];
+    }
+    return closure + "})";
+}
+
+void Translator::translateLet(const List* list, std::string& out, const std::string& indent, Tail tail)
+{
+    const Sequence* bindings = list->count() == 3 ? DYNAMIC_CAST(Sequence, list->item(1)) : NULL;
+    if ( !bindings || bindings->count() % 2 != 0 ) {
+        throw Unsupported();
+    }
+
+    // every name is in scope from the start, as in LetForm, but is only
+    // found once it is bound unless a closure refers to it
+    const size_t first = m_locals.size();
+    const int count = bindings->count() / 2;
+    for ( int i = 0; i < count; ++i ) {
+        const Symbol* id = DYNAMIC_CAST(Symbol, bindings->item(2 * i));
+        if ( !id ) {
+            throw Unsupported();
+        }
+        m_locals.push_back(Local{ id->name(), newVar("l", id->value()), level(), false, false });
+    }
+
+    std::vector<std::string> values;
+    for ( int i = 0; i < count; ++i ) {
+        const List* value = DYNAMIC_CAST(List, bindings->item(2 * i + 1));
+        const Symbol* valueHead = value ? headSymbol(value) : NULL;
+        values.push_back(valueHead && valueHead->name()->special() == Name::FN
+            ? translateFn(value, m_locals[first + i].name)
+            : translate(bindings->item(2 * i + 1)));
+        m_locals[first + i].isBound = true;
+    }
+
+    for ( int i = 0; i < count; ++i ) {
+        if ( m_locals[first + i].isBoxed ) {
+            out += indent + "AST " + m_locals[first + i].var + " = box();\n";
+        }
+    }
+    for ( int i = 0; i < count; ++i ) {
+        const Local& local = m_locals[first + i];
+        out += local.isBoxed
+            ? indent + "setBox(" + local.var + ", " + values[i] + ");\n"
+            : indent + "AST " + local.var + " = " + values[i] + ";\n";
+    }
+
+    translateTail(list->item(2), out, indent, tail);
+    m_locals.resize(first);
+}
+
+void Translator::translateTry(const List* list, std::string& out, const std::string& indent, Tail tail)
+{
+    const int argCount = list->count() - 1;
+    if ( argCount == 1 ) {
+        translateTail(list->item(1), out, indent, tail);
+        return;
+    }
+
+    const List* handler = argCount == 2 ? DYNAMIC_CAST(List, list->item(2)) : NULL;
+    const Symbol* catchHead = handler && handler->count() == 3 ? headSymbol(handler) : NULL;
+    const Symbol* id = catchHead ? DYNAMIC_CAST(Symbol, handler->item(1)) : NULL;
+    if ( !id || catchHead->name()->special() != Name::CATCH ) {
+        throw Unsupported();
+    }
+
+    const std::string var = newVar("e", id->value());
+    out += indent + "AST " + var + ";\n"
+        + indent + "try {\n"
+        + indent + "    return " + translate(list->item(1)) + ";\n"
+        + indent + "}\n"
+        + indent + "catch ( std::string& message ) {\n"
+        + indent + "    " + var + " = type::string(message);\n"
+        + indent + "}\n"
+        + indent + "catch ( EmptyInputException& ) {\n"
+        + indent + "    return type::nilValue();\n"
+        + indent + "}\n"
+        + indent + "catch ( AST& value ) {\n"
+        + indent + "    " + var + " = value;\n"
+        + indent + "}\n";
+
+    m_locals.push_back(Local{ id->name(), var, level(), true, false });
+    translateTail(handler->item(2), out, indent, tail);
+    m_locals.pop_back();
+}
+
+// Evaluates the operator and arguments, then, if the operator is the
+// function itself, rebinds its parameters and goes round its loop.
+void Translator::translateSelfCall(const List* list, std::string& out, const std::string& indent)
+{
+    Function& function = m_functions.back();
+    function.loops = true;
+
+    std::vector<std::string> vars;
+    std::string code = indent + "{\n";
+    for ( auto it = list->begin(); it != list->end(); ++it ) {
+        vars.push_back(newVar("t", ""));
+        code += indent + "    AST " + vars.back() + " = " + translate(*it) + ";\n";
+    }
+
+    code += indent + "    if ( " + vars[0] + ".ptr() == self ) {\n";
+    for ( size_t i = 0; i < function.params.size(); ++i ) {
+        code += indent + "        " + function.params[i] + " = " + vars[i + 1] + ";\n";
+    }
+    code += indent + "        continue;\n" + indent + "    }\n"
+        + indent + "    return tailCall({";
+    for ( size_t i = 0; i < vars.size(); ++i ) {
+        code += (i == 0 ? "" : ", ") + vars[i];
+    }
+    out += code + "});\n" + indent + "}\n";
+}
+
+std::string Translator::symbol(const Symbol* symbol)
+{
+    const Name* name = symbol->name();
+    for ( auto it = m_locals.rbegin(); it != m_locals.rend(); ++it ) {
+        Local& local = *it;
+        if ( local.name != name ) {
+            continue;
+        }
+        if ( !local.isBound ) {
+            // evaluated before it is bound, it is not there yet; from a
+            // closure, it is by the time the closure runs
+            if ( local.level == level() ) {
+                continue;
+            }
+            local.isBoxed = true;
+        }
+
+        for ( int i = local.level; i < level(); ++i ) {
+            std::vector<std::string>& captures = m_functions[i].captures;
+            if ( std::find(captures.begin(), captures.end(), local.var) == captures.end() ) {
+                captures.push_back(local.var);
+            }
+        }
+        return local.isBoxed
+            ? "unbox(" + local.var + ", " + quote(name->text()) + ")"
+            : local.var;
+    }
+
+    return global(name);
+}
+
+std::string Translator::constant(AST value)
+{
+    const std::string text = value->toString(true);
+    auto it = m_constantIndex.find(text);
+    if ( it == m_constantIndex.end() ) {
+        it = m_constantIndex.emplace(text, m_constants.size()).first;
+        m_constants.push_back(text);
+    }
+    return "k[" + std::to_string(it->second) + "]";
+}
+
+std::string Translator::global(const Name* name)
+{
+    auto it = m_globalIndex.find(name);
+    if ( it == m_globalIndex.end() ) {
+        it = m_globalIndex.emplace(name, m_globals.size()).first;
+        m_globals.push_back(name->text());
+    }
+    return "g[" + std::to_string(it->second) + "]->eval(env)";
+}
+
+std::string Translator::newVar(const char* prefix, const std::string& name)
+{
+    std::string var = prefix + std::to_string(m_varCount++);
+    if ( !name.empty() ) {
+        var += '_';
+    }
+    for ( char c : name ) {
+        var += isalnum(static_cast<unsigned char>(c)) ? c : '_';
+    }
+    return var;
+}
+
+bool Translator::isLocal(const Name* name) const
+{
+    for ( const Local& local : m_locals ) {
+        if ( local.name == name ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the form a macro call expands to, NULL if list is no macro call
+AST Translator::expandMacro(const List* list)
+{
+    const Symbol* head = headSymbol(list);
+    if ( !head || isLocal(head->name()) ) {
+        return NULL;
+    }
+
+    EnvPtr frame = m_env->find(head->name());
+    const Lambda* macro = frame ? DYNAMIC_CAST(Lambda, frame->get(head->name())) : NULL;
+    if ( !macro || !macro->isMacro() ) {
+        return NULL;
+    }
+    return macro->apply(list->begin() + 1, list->end());
+}
+
+bool Translator::isSelfCall(const List* list) const
+{
+    const Function& function = m_functions.back();
+    const Symbol* head = headSymbol(list);
+    return function.self && head && head->name() == function.self
+        && list->count() - 1 == function.params.size();
+}
+
+} // namespace
+
+std::string translate(const std::string& path, EnvPtr env)
+{
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if ( file.fail() ) {
+        throw LISP_ERROR("Cannot open ", path);
+    }
+    const std::string text((std::istreambuf_iterator<char>(file.rdbuf())),
+                           std::istreambuf_iterator<char>());
+
+    // read the same way load-file reads it
+    Translator translator(env);
+    translator.translateTopLevel(tokenize_string("(do " + text + "\nnil)"));
+    return translator.module(native::canonicalPath(path), native::sourceHash(text));
+}
+
+} // namespace malc
@@ -0,0 +1,288 @@
+#include "native.h"
+#include "parser.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <typeinfo>
+
+namespace native {
+
+namespace {
+
+struct Registration {
+    size_t sourceHash;
+    LoadFunc* load;
+};
+
+// modules register from static initializers, so the table is made on
+// first use rather than being a static of its own
+std::map<std::string, Registration>& modules()
+{
+    static std::map<std::string, Registration> table;
+    return table;
+}
+
+EnvPtr s_rootEnv;
+
+// the core builtins each Op stands for, as installCore bound them
+AST s_builtins[OP_COUNT];
+const char* const s_opNames[OP_COUNT] = { "+", "-", "*", "<", "<=", ">", ">=", "=" };
+
+class Box : public Expression {
+public:
+    Box() { }
+    Box(const Box& that, AST meta) : Expression(meta), value(that.value) { }
+
+    virtual const std::string toString(bool readably) const { return "#box"; }
+    virtual bool operator==(const Expression* rhs) const { return this == rhs; }
+
+    WITH_META(Box);
+
+    AST value;
+};
+
+// what the code of a Function returns for tailCall, with the call left
+// in s_tailCallItems
+const AST s_tailCall(new Box);
+AST_vec s_tailCallItems;
+
+bool readFile(const std::string& path, std::string& text)
+{
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if ( file.fail() ) {
+        return false;
+    }
+    text.assign(std::istreambuf_iterator<char>(file.rdbuf()),
+                std::istreambuf_iterator<char>());
+    return true;
+}
+
+AST apply(AST op, std::initializer_list<AST>::iterator argsBegin,
+          std::initializer_list<AST>::iterator argsEnd)
+{
+    ArgBuffer buffer;
+    AST_vec& args = buffer.items();
+    args.assign(argsBegin, argsEnd);
+
+    if ( typeid(*op.ptr()) == typeid(BuiltIn) ) {
+        return STATIC_CAST(BuiltIn, op)->apply(args.begin(), args.end());
+    }
+    if ( typeid(*op.ptr()) == typeid(Function) ) {
+        return STATIC_CAST(Function, op)->apply(args.begin(), args.end());
+    }
+
+    // the module was compiled before the macro was defined, so the call
+    // was not expanded
+    const Lambda* lambda = DYNAMIC_CAST(Lambda, op);
+    if ( lambda && lambda->isMacro() ) {
+        throw LISP_ERROR("compiled code calls ", op->toString(true),
+                         ", which was not a macro when it was compiled");
+    }
+    return APPLY(op, args.begin(), args.end());
+}
+
+} // namespace
+
+Module::Module(const char* path, size_t sourceHash, LoadFunc* load)
+{
+    modules()[path] = Registration{ sourceHash, load };
+}
+
+void setRootEnv(EnvPtr env)
+{
+    s_rootEnv = env;
+    for ( int op = 0; op < OP_COUNT; ++op ) {
+        s_builtins[op] = env->get(s_opNames[op]);
+    }
+}
+
+bool load(const std::string& path)
+{
+    auto it = modules().find(canonicalPath(path));
+    if ( it == modules().end() ) {
+        return false;
+    }
+
+    std::string text;
+    if ( !readFile(path, text) || sourceHash(text) != it->second.sourceHash ) {
+        return false;
+    }
+
+    it->second.load(s_rootEnv);
+    return true;
+}
+
+std::string canonicalPath(const std::string& path)
+{
+    std::error_code error;
+    std::filesystem::path canonical = std::filesystem::weakly_canonical(path, error);
+    return error ? path : canonical.string();
+}
+
+size_t sourceHash(const std::string& text)
+{
+    return std::hash<std::string>()(text);
+}
+
+Function::Function(Code* code, std::initializer_list<AST> captured)
+    : m_code(code), m_captured(captured)
+{ }
+
+Function::Function(const Function& that, AST meta)
+    : Applicable(meta), m_code(that.m_code), m_captured(that.m_captured)
+{ }
+
+AST Function::apply(AST_iter argsBegin, AST_iter argsEnd) const
+{
+    AST result = m_code(this, argsBegin, argsEnd);
+    if ( result != s_tailCall ) {
+        return result;
+    }
+
+    // the code reads its arguments before it makes any call of its own,
+    // so the items of one call can be reused for the next
+    ArgBuffer buffer;
+    AST_vec& items = buffer.items();
+    do {
+        items.swap(s_tailCallItems);
+        s_tailCallItems.clear();
+        const Function* function = STATIC_CAST(Function, items[0]);
+        result = function->m_code(function, items.begin() + 1, items.end());
+    } while ( result == s_tailCall );
+    return result;
+}
+
+const std::string Function::toString(bool readably) const
+{
+    std::ostringstream oss;
+    oss << "#user-function(" << this << ")";
+    return oss.str();
+}
+
+AST closure(Function::Code* code, std::initializer_list<AST> captured)
+{
+    return AST(new Function(code, captured));
+}
+
+void checkArgs(AST_iter argsBegin, AST_iter argsEnd, int paramCount, bool isVariadic)
+{
+    const int argCount = std::distance(argsBegin, argsEnd);
+    if ( argCount < paramCount ) {
+        throw LISP_ERROR("Not enough parameters");
+    }
+    if ( argCount > paramCount && !isVariadic ) {
+        throw LISP_ERROR("Too many parameters");
+    }
+}
+
+AST constant(const char* text)
+{
+    return tokenize_string(text);
+}
+
+AST global(const char* name)
+{
+    return AST(new GlobalSymbol(Name::intern(name)));
+}
+
+AST eval(AST form)
+{
+    return EVAL(form, s_rootEnv);
+}
+
+AST call(std::initializer_list<AST> items)
+{
+    return apply(*items.begin(), items.begin() + 1, items.end());
+}
+
+AST tailCall(std::initializer_list<AST> items)
+{
+    const AST& op = *items.begin();
+    if ( typeid(*op.ptr()) != typeid(Function) ) {
+        return apply(op, items.begin() + 1, items.end());
+    }
+    s_tailCallItems.assign(items.begin(), items.end());
+    return s_tailCall;
+}
+
+AST call(Op op, std::initializer_list<AST> items)
+{
+    const AST* item = items.begin();
+    const Expression* lhs = item[1].ptr();
+    const Expression* rhs = item[2].ptr();
+    if ( item[0] != s_builtins[op]
+        || lhs->numberTag() != Expression::INTEGER
+        || rhs->numberTag() != Expression::INTEGER ) {
+        return apply(item[0], items.begin() + 1, items.end());
+    }
+
+    const int64_t a = static_cast<const Integer*>(lhs)->value();
+    const int64_t b = static_cast<const Integer*>(rhs)->value();
+    int64_t result;
+    switch ( op ) {
+        case ADD: {
+            if ( __builtin_add_overflow(a, b, &result) ) {
+                break;
+            }
+            return type::integer(result);
+        }
+
+        case SUB: {
+            if ( __builtin_sub_overflow(a, b, &result) ) {
+                break;
+            }
+            return type::integer(result);
+        }
+
+        case MUL: {
+            if ( __builtin_mul_overflow(a, b, &result) ) {
+                break;
+            }
+            return type::integer(result);
+        }
+
+        case LT: return type::boolean(a < b);
+        case LE: return type::boolean(a <= b);
+        case GT: return type::boolean(a > b);
+        case GE: return type::boolean(a >= b);
+        case EQ: return type::boolean(a == b);
+        default: break;
+    }
+
+    // overflowed, which the builtin reports
+    return apply(item[0], items.begin() + 1, items.end());
+}
+
+AST vector(std::initializer_list<AST> items)
+{
+    return type::vector(new AST_vec(items));
+}
+
+AST hash(std::initializer_list<AST> keysAndValues)
+{
+    return type::hash(new AST_vec(keysAndValues), true);
+}
+
+AST box()
+{
+    return AST(new Box);
+}
+
+void setBox(const AST& box, AST value)
+{
+    STATIC_CAST(Box, box)->value = value;
+}
+
+AST unbox(const AST& box, const char* name)
+{
+    const AST& value = STATIC_CAST(Box, box)->value;
+    if ( !value ) {
+        throw LISP_ERROR("\'", name, "\'", " not found");
+    }
+    return value;
+}
+
+} // namespace native
@@ -1,7 +1,9 @@
 #include "parser.h"
 #include "types.h"
 
+#include <cmath>
 #include <memory>
+#include <unordered_map>
 
 AST tokenize_string(const std::string& input)
 {
@@ -36,6 +38,12 @@ AST read_form(Tokeniser& tokenizer)
         case '{': {
             return type::hash(init_sequence('}'), false);
         }
+        case '#': {
+            if ( tokenizer.peek() == "#{" ) {
+                return type::set(init_sequence('}'), false);
+            }
+            return read_atom(tokenizer);
+        }
         default:
             return read_atom(tokenizer);
     }
@@ -46,7 +54,10 @@ AST read_atom(Tokeniser& tokenizer)
     static const std::unordered_map<std::string, AST> constantTable = {
         {"false", type::falseValue()},
         {"nil", type::nilValue()},
-        {"true", type::trueValue()}
+        {"true", type::trueValue()},
+        {"##Inf", type::floating(HUGE_VAL)},
+        {"##-Inf", type::floating(-HUGE_VAL)},
+        {"##NaN", type::floating(NAN)}
     };
 
     static const std::unordered_map<std::string, std::string> macroTable = {
@@ -83,6 +94,11 @@ AST read_atom(Tokeniser& tokenizer)
         return type::integer(token);
     }
 
+    static const std::regex float_regex("^[-+]?(\\d+\\.\\d*|\\.\\d+|\\d+)([eE][-+]?\\d+)?$");
+    if ( std::regex_match(token, float_regex) ) {
+        return type::floating(token);
+    }
+
     return type::symbol(token);
 }
 
@@ -0,0 +1,345 @@
+#include "simd.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace simd {
+
+// The vector loops handle whole blocks of four lanes, the scalar tail
+// loops after them finish the remaining items (and do all the work
+// when AVX2 is not available).
+
+#ifdef __AVX2__
+// the lanes of a sum x + y that overflowed, set in their sign bits: the
+// operands had the same sign and the sum has the other one
+static __m256i overflowed(__m256i x, __m256i y, __m256i sum)
+{
+    return _mm256_and_si256(_mm256_xor_si256(sum, x), _mm256_xor_si256(sum, y));
+}
+
+static bool anySignSet(__m256i v)
+{
+    return _mm256_movemask_pd(_mm256_castsi256_pd(v)) != 0;
+}
+#endif
+
+static bool fitsInt64(__int128 value)
+{
+    return value >= INT64_MIN && value <= INT64_MAX;
+}
+
+// The integer sums and products wrap in uint64 while they OR together
+// the magnitudes of the items, which bounds them, in a single pass the
+// compiler vectorizes. Only when that bound does not rule out overflow is
+// the result worked out again exactly, to tell whether it really does.
+
+// as unsigned, so that INT64_MIN's magnitude fits
+static uint64_t magnitude(int64_t value)
+{
+    return value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+}
+
+// whether a sum of terms items no larger than bound surely fits
+static bool boundFits(unsigned __int128 bound, size_t terms)
+{
+    return bound <= INT64_MAX / std::max<size_t>(terms, 1);
+}
+
+bool sum(const int64_t* a, size_t count, int64_t& result)
+{
+    uint64_t total = 0, bound = 0;
+    for ( size_t i = 0; i < count; ++i ) {
+        total += (uint64_t)a[i];
+        bound |= magnitude(a[i]);
+    }
+    result = (int64_t)total;
+    if ( boundFits(bound, count) ) {
+        return true;
+    }
+
+    __int128 exact = 0;
+    for ( size_t i = 0; i < count; ++i ) {
+        exact += a[i];
+    }
+    return fitsInt64(exact);
+}
+
+double sum(const double* a, size_t count)
+{
+    size_t i = 0;
+    double result = 0;
+#ifdef __AVX2__
+    __m256d acc = _mm256_setzero_pd();
+    for ( ; i + 4 <= count; i += 4 ) {
+        acc = _mm256_add_pd(acc, _mm256_loadu_pd(a + i));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    result = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+    for ( ; i < count; ++i ) {
+        result += a[i];
+    }
+    return result;
+}
+
+// AVX2 has no 64-bit integer min/max, so compare and blend instead
+#ifdef __AVX2__
+static int64_t reduceInt(const int64_t* a, size_t count, bool isMax)
+{
+    size_t i = 4;
+    __m256i acc = _mm256_loadu_si256((const __m256i*)a);
+    for ( ; i + 4 <= count; i += 4 ) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i greater = _mm256_cmpgt_epi64(v, acc);
+        acc = isMax ? _mm256_blendv_epi8(acc, v, greater)
+                    : _mm256_blendv_epi8(v, acc, greater);
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    int64_t result = lanes[0];
+    for ( int j = 1; j < 4; ++j ) {
+        result = isMax ? std::max(result, lanes[j]) : std::min(result, lanes[j]);
+    }
+    for ( ; i < count; ++i ) {
+        result = isMax ? std::max(result, a[i]) : std::min(result, a[i]);
+    }
+    return result;
+}
+#endif
+
+int64_t min(const int64_t* a, size_t count)
+{
+#ifdef __AVX2__
+    if ( count >= 4 ) {
+        return reduceInt(a, count, false);
+    }
+#endif
+    return *std::min_element(a, a + count);
+}
+
+int64_t max(const int64_t* a, size_t count)
+{
+#ifdef __AVX2__
+    if ( count >= 4 ) {
+        return reduceInt(a, count, true);
+    }
+#endif
+    return *std::max_element(a, a + count);
+}
+
+double min(const double* a, size_t count)
+{
+    size_t i = 0;
+    double result = a[0];
+#ifdef __AVX2__
+    if ( count >= 4 ) {
+        __m256d acc = _mm256_loadu_pd(a);
+        for ( i = 4; i + 4 <= count; i += 4 ) {
+            acc = _mm256_min_pd(acc, _mm256_loadu_pd(a + i));
+        }
+        double lanes[4];
+        _mm256_storeu_pd(lanes, acc);
+        result = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+    }
+#endif
+    for ( ; i < count; ++i ) {
+        result = std::min(result, a[i]);
+    }
+    return result;
+}
+
+double max(const double* a, size_t count)
+{
+    size_t i = 0;
+    double result = a[0];
+#ifdef __AVX2__
+    if ( count >= 4 ) {
+        __m256d acc = _mm256_loadu_pd(a);
+        for ( i = 4; i + 4 <= count; i += 4 ) {
+            acc = _mm256_max_pd(acc, _mm256_loadu_pd(a + i));
+        }
+        double lanes[4];
+        _mm256_storeu_pd(lanes, acc);
+        result = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    }
+#endif
+    for ( ; i < count; ++i ) {
+        result = std::max(result, a[i]);
+    }
+    return result;
+}
+
+// AVX2 has no 64-bit integer multiply either, so the integer dot product
+// and elementwise product are left to the compiler's auto-vectorizer.
+bool dot(const int64_t* a, const int64_t* b, size_t count, int64_t& result)
+{
+    uint64_t total = 0, boundA = 0, boundB = 0;
+    for ( size_t i = 0; i < count; ++i ) {
+        total += (uint64_t)a[i] * (uint64_t)b[i];
+        boundA |= magnitude(a[i]);
+        boundB |= magnitude(b[i]);
+    }
+    result = (int64_t)total;
+    if ( boundFits((unsigned __int128)boundA * boundB, count) ) {
+        return true;
+    }
+
+    __int128 exact = 0;
+    for ( size_t i = 0; i < count; ++i ) {
+        int64_t product;
+        if ( __builtin_mul_overflow(a[i], b[i], &product) ) {
+            return false;
+        }
+        exact += product;
+    }
+    return fitsInt64(exact);
+}
+
+double dot(const double* a, const double* b, size_t count)
+{
+    size_t i = 0;
+    double result = 0;
+#ifdef __AVX2__
+    __m256d acc = _mm256_setzero_pd();
+    for ( ; i + 4 <= count; i += 4 ) {
+#ifdef __FMA__
+        acc = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), acc);
+#else
+        acc = _mm256_add_pd(acc,
+            _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+#endif
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    result = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+    for ( ; i < count; ++i ) {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+
+bool add(const int64_t* a, const int64_t* b, int64_t* out, size_t count)
+{
+    size_t i = 0;
+#ifdef __AVX2__
+    __m256i overflow = _mm256_setzero_si256();
+    for ( ; i + 4 <= count; i += 4 ) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+        __m256i sum = _mm256_add_epi64(x, y);
+        overflow = _mm256_or_si256(overflow, overflowed(x, y, sum));
+        _mm256_storeu_si256((__m256i*)(out + i), sum);
+    }
+    if ( anySignSet(overflow) ) {
+        return false;
+    }
+#endif
+    for ( ; i < count; ++i ) {
+        if ( __builtin_add_overflow(a[i], b[i], &out[i]) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void add(const double* a, const double* b, double* out, size_t count)
+{
+    size_t i = 0;
+#ifdef __AVX2__
+    for ( ; i + 4 <= count; i += 4 ) {
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+#endif
+    for ( ; i < count; ++i ) {
+        out[i] = a[i] + b[i];
+    }
+}
+
+bool mul(const int64_t* a, const int64_t* b, int64_t* out, size_t count)
+{
+    uint64_t boundA = 0, boundB = 0;
+    for ( size_t i = 0; i < count; ++i ) {
+        out[i] = (int64_t)((uint64_t)a[i] * (uint64_t)b[i]);
+        boundA |= magnitude(a[i]);
+        boundB |= magnitude(b[i]);
+    }
+    if ( boundFits((unsigned __int128)boundA * boundB, 1) ) {
+        return true;
+    }
+
+    for ( size_t i = 0; i < count; ++i ) {
+        if ( __builtin_mul_overflow(a[i], b[i], &out[i]) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void mul(const double* a, const double* b, double* out, size_t count)
+{
+    size_t i = 0;
+#ifdef __AVX2__
+    for ( ; i + 4 <= count; i += 4 ) {
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+#endif
+    for ( ; i < count; ++i ) {
+        out[i] = a[i] * b[i];
+    }
+}
+
+// Blocks with no match are skipped on the compare mask alone, the rest
+// are compacted without branching on each item.
+size_t filterGreater(const int64_t* a, size_t count, int64_t limit, int64_t* out)
+{
+    size_t i = 0, n = 0;
+#ifdef __AVX2__
+    const __m256i bound = _mm256_set1_epi64x(limit);
+    for ( ; i + 4 <= count; i += 4 ) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(a + i));
+        if ( _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, bound))) == 0 ) {
+            continue;
+        }
+        for ( size_t j = i; j < i + 4; ++j ) {
+            out[n] = a[j];
+            n += a[j] > limit;
+        }
+    }
+#endif
+    for ( ; i < count; ++i ) {
+        out[n] = a[i];
+        n += a[i] > limit;
+    }
+    return n;
+}
+
+size_t filterGreater(const double* a, size_t count, double limit, double* out)
+{
+    size_t i = 0, n = 0;
+#ifdef __AVX2__
+    const __m256d bound = _mm256_set1_pd(limit);
+    for ( ; i + 4 <= count; i += 4 ) {
+        __m256d v = _mm256_loadu_pd(a + i);
+        if ( _mm256_movemask_pd(_mm256_cmp_pd(v, bound, _CMP_GT_OQ)) == 0 ) {
+            continue;
+        }
+        for ( size_t j = i; j < i + 4; ++j ) {
+            out[n] = a[j];
+            n += a[j] > limit;
+        }
+    }
+#endif
+    for ( ; i < count; ++i ) {
+        out[n] = a[i];
+        n += a[i] > limit;
+    }
+    return n;
+}
+
+} // namespace simd
@@ -12,6 +12,7 @@ void Tokeniser::popToken()
 
     static const std::regex TOKEN_REGEXES[] = {
         std::regex("~@"),
+        std::regex("#\\{"),
         std::regex("[\\[\\]{}()'`~^@]"),
         std::regex("\"(?:\\\\.|[^\\\\\"])*\""),
         std::regex("[^\\s\\[\\]{}('\"`,;)]+"),
@@ -1,5 +1,14 @@
+#include "analyzer.h"
 #include "types.h"
-
+#include "vm.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+#include <unordered_map>
 #include <cassert>
 
 namespace type {
@@ -13,6 +22,11 @@ namespace type {
         return AST(new Lambda(bindings, body, env));
     }
 
+    AST lambda(ScopePtr scope, bool isVariadic, AST body, EnvPtr env)
+    {
+        return AST(new Lambda(scope, isVariadic, body, env));
+    }
+
     AST builtin(const std::string& name, BuiltIn::ApplyFunc handler)
     {
         return AST(new BuiltIn(name, handler));
@@ -25,22 +39,69 @@ namespace type {
 
     AST integer(int64_t value)
     {
+        // small integers are shared instead of allocated per result
+        static const int64_t cacheMin = -128, cacheMax = 1024;
+        static AST* cache = [] {
+            AST* cache = new AST[cacheMax - cacheMin];
+            for ( int64_t i = cacheMin; i < cacheMax; ++i ) {
+                cache[i - cacheMin] = AST(new Integer(i));
+            }
+            return cache;
+        }();
+
+        if ( value >= cacheMin && value < cacheMax ) {
+            return cache[value - cacheMin];
+        }
+
         return AST(new Integer(value));
     }
 
     AST integer(const std::string& token)
     {
-        return integer(std::stoi(token));
+        errno = 0;
+        const int64_t value = std::strtoll(token.c_str(), NULL, 10);
+        if ( errno == ERANGE ) {
+            throw LISP_ERROR("Integer literal out of range: ", token);
+        }
+        return integer(value);
+    }
+
+    AST floating(double value)
+    {
+        // integral results such as 0.0 or 1.0 are shared like small integers
+        static const int64_t cacheMin = -128, cacheMax = 1024;
+        static AST* cache = [] {
+            AST* cache = new AST[cacheMax - cacheMin];
+            for ( int64_t i = cacheMin; i < cacheMax; ++i ) {
+                cache[i - cacheMin] = AST(new Float(i));
+            }
+            return cache;
+        }();
+
+        // -0.0 compares equal to 0.0 but must keep its sign
+        if ( value >= cacheMin && value < cacheMax && value == (int64_t)value
+            && !(value == 0 && std::signbit(value)) ) {
+            return cache[(int64_t)value - cacheMin];
+        }
+
+        return AST(new Float(value));
+    }
+
+    AST floating(const std::string& token)
+    {
+        // out of range, strtod gives the infinity or zero the literal
+        // rounds to, as float arithmetic would, where stod throws
+        return floating(std::strtod(token.c_str(), NULL));
     }
 
-    AST keyword(const std::string& token)
+    AST keyword(std::string token)
     {
-        return AST(new Keyword(token));
+        return AST(new Keyword(std::move(token)));
     }
 
-    AST symbol(const std::string& token)
+    AST symbol(std::string token)
     {
-        return AST(new Symbol(token));
+        return AST(new Symbol(std::move(token)));
     }
 
     AST falseValue()
@@ -73,7 +134,8 @@ namespace type {
 
     AST hash(AST_vec* items, bool isEvaluated)
     {
-        return hash(items->begin(), items->end(), isEvaluated);
+        std::unique_ptr<AST_vec> owned(items);
+        return hash(owned->begin(), owned->end(), isEvaluated);
     }
 
     AST vector(AST_vec* items)
@@ -86,6 +148,54 @@ namespace type {
         return AST(new Vector(begin, end));
     }
 
+    AST set(AST_iter begin, AST_iter end, bool isEvaluated)
+    {
+        return AST(new Set(begin, end, isEvaluated));
+    }
+
+    AST set(AST_vec* items, bool isEvaluated)
+    {
+        std::unique_ptr<AST_vec> owned(items);
+        return set(owned->begin(), owned->end(), isEvaluated);
+    }
+
+    AST sorted(AST comparator, bool isMap, AST_iter begin, AST_iter end)
+    {
+        Sorted empty(comparator, isMap);
+        return empty.assoc(begin, end);
+    }
+
+    AST queue(AST_iter begin, AST_iter end)
+    {
+        AST empty(new Queue);
+        return STATIC_CAST(Queue, empty)->conj(begin, end);
+    }
+
+    AST lazySeq(LazySeq::Thunk thunk)
+    {
+        return AST(new LazySeq(thunk));
+    }
+
+    AST lazySeq(AST first, AST rest)
+    {
+        return AST(new LazySeq(first, rest));
+    }
+
+    AST range(int64_t start, int64_t end, int64_t step)
+    {
+        return AST(new Range(start, end, step));
+    }
+
+    AST numArray(NumArray::Kind kind, size_t count)
+    {
+        return AST(new NumArray(kind, count));
+    }
+
+    AST transient(AST coll)
+    {
+        return AST(new Transient(coll));
+    }
+
     AST atom(AST value)
     {
         return AST(new Atom(value));
@@ -125,9 +235,28 @@ namespace type {
         return AST(new List(items));
     }
 
-    AST string(const std::string& token)
+    AST string(std::string token)
+    {
+        return AST(new String(std::move(token)));
+    }
+
+    AST character(unsigned char c)
+    {
+        // seq on a string shares one single-byte String per byte value
+        static AST* cache = [] {
+            AST* cache = new AST[256];
+            for ( int i = 0; i < 256; ++i ) {
+                cache[i] = AST(new String(std::string(1, (char)i)));
+            }
+            return cache;
+        }();
+
+        return cache[c];
+    }
+
+    AST rope(AST left, AST right)
     {
-        return AST(new String(token));
+        return AST(new String(left, right));
     }
 } // namespace type
 
@@ -136,8 +265,25 @@ namespace type {
 // EXPRESSION
 bool Expression::isEqualTo(const Expression* rhs) const
 {
+    if ( const LazySeq* lazy = dynamic_cast<const LazySeq*>(this) ) {
+        return lazy->toList()->isEqualTo(rhs);
+    }
+
+    if ( const LazySeq* lazy = dynamic_cast<const LazySeq*>(rhs) ) {
+        return isEqualTo(lazy->toList().ptr());
+    }
+
+    if ( const Range* range = dynamic_cast<const Range*>(this) ) {
+        return range->toList()->isEqualTo(rhs);
+    }
+
+    if ( const Range* range = dynamic_cast<const Range*>(rhs) ) {
+        return isEqualTo(range->toList().ptr());
+    }
+
     bool types_match = (typeid(*this) == typeid(*rhs))
-        || (dynamic_cast<const Sequence*>(this) && dynamic_cast<const Sequence*>(rhs));
+        || (dynamic_cast<const Sequence*>(this) && dynamic_cast<const Sequence*>(rhs))
+        || (dynamic_cast<const Symbol*>(this) && dynamic_cast<const Symbol*>(rhs));
 
     return types_match && ((*this) == rhs);
 }
@@ -201,9 +347,132 @@ const std::string Integer::toString(bool readably) const
     return std::to_string(m_val);
 }
 
+bool Float::operator==(const Expression* rhs) const
+{
+    return m_val == static_cast<const Float*>(rhs)->m_val;
+}
+
+std::string Float::format(double value)
+{
+    if ( std::isnan(value) ) {
+        return "##NaN";
+    }
+    if ( std::isinf(value) ) {
+        return value > 0 ? "##Inf" : "##-Inf";
+    }
+
+    // shortest text that reads back to the same value, always with a
+    // '.' or exponent so it does not print like an integer
+    const double magnitude = std::fabs(value);
+    const bool isFixed = magnitude == 0 || (magnitude >= 1e-4 && magnitude < 1e16);
+    char buffer[64];
+    char* end = std::to_chars(buffer, buffer + sizeof(buffer), value,
+        isFixed ? std::chars_format::fixed : std::chars_format::scientific).ptr;
+
+    std::string text(buffer, end);
+    if ( isFixed && text.find('.') == std::string::npos ) {
+        text += ".0";
+    }
+    return text;
+}
+
+const std::string Float::toString(bool readably) const
+{
+    return format(m_val);
+}
+
 
 // ================================
 // STRING
+StringBase::~StringBase()
+{
+    release(m_rope);
+}
+
+// A (str acc piece) loop builds ropes as deep as it has iterations, so
+// they are freed with a work list instead of one destructor per level.
+void StringBase::release(Rope* rope)
+{
+    std::vector<Rope*> pending;
+    while ( rope ) {
+        for ( AST* half : { &rope->left, &rope->right } ) {
+            StringBase* node = STATIC_CAST(StringBase, *half);
+            if ( node->count() == 1 && node->m_rope ) {
+                pending.push_back(node->m_rope);
+                node->m_rope = NULL;
+            }
+        }
+        delete rope;
+
+        rope = pending.empty() ? NULL : pending.back();
+        if ( rope ) {
+            pending.pop_back();
+        }
+    }
+}
+
+void StringBase::flatten() const
+{
+    std::string text;
+    text.reserve(m_rope->length);
+
+    std::vector<const StringBase*> stack = { this };
+    while ( !stack.empty() ) {
+        const StringBase* node = stack.back();
+        stack.pop_back();
+        if ( node->m_rope ) {
+            stack.push_back(STATIC_CAST(StringBase, node->m_rope->right));
+            stack.push_back(STATIC_CAST(StringBase, node->m_rope->left));
+        }
+        else {
+            text += node->m_string;
+        }
+    }
+
+    m_string = std::move(text);
+    Rope* rope = m_rope;
+    m_rope = NULL;
+    release(rope);
+}
+
+String::String(AST left, AST right)
+    : StringBase(join(left, right))
+{ }
+
+StringBase::Rope* String::join(AST left, AST right)
+{
+    const String* lhs = STATIC_CAST(String, left);
+    const String* rhs = STATIC_CAST(String, right);
+    const size_t length = lhs->length() + rhs->length();
+
+    // appending short pieces one by one would leave a node per piece, so
+    // a short piece is merged into the short flat tail of the rope instead
+    if ( lhs->m_rope && rhs->length() < ROPE_THRESHOLD ) {
+        const String* tail = STATIC_CAST(String, lhs->m_rope->right);
+        if ( !tail->m_rope && tail->length() + rhs->length() <= ROPE_THRESHOLD ) {
+            return new Rope{ lhs->m_rope->left, type::string(tail->m_string + rhs->value()), length };
+        }
+    }
+
+    return new Rope{ left, right, length };
+}
+
+void String::write(std::ostream& out) const
+{
+    std::vector<const String*> stack = { this };
+    while ( !stack.empty() ) {
+        const String* node = stack.back();
+        stack.pop_back();
+        if ( node->m_rope ) {
+            stack.push_back(STATIC_CAST(String, node->m_rope->right));
+            stack.push_back(STATIC_CAST(String, node->m_rope->left));
+        }
+        else {
+            out << node->m_string;
+        }
+    }
+}
+
 const std::string String::toString(bool readably) const
 {
     return readably ? escape(value()) : value();
@@ -296,17 +565,116 @@ bool Keyword::operator==(const Expression* rhs) const
     return value() == static_cast<const Keyword*>(rhs)->value();
 }
 
+AST Keyword::lookup(AST coll, AST notFound) const
+{
+    AST key(const_cast<Keyword*>(this));
+
+    if ( const Record* record = DYNAMIC_CAST(Record, coll) ) {
+        if ( record->recordType() != m_cachedType ) {
+            const int slot = STATIC_CAST(RecordType, record->recordType())->slotOf(key);
+            if ( slot < 0 ) {
+                return record->contains(key) ? record->get(key) : notFound;
+            }
+            m_cachedType = record->recordType();
+            m_cachedSlot = slot;
+        }
+        return record->slot(m_cachedSlot);
+    }
+
+    if ( const Hash* hash = DYNAMIC_CAST(Hash, coll) ) {
+        return hash->contains(key) ? hash->get(key) : notFound;
+    }
+
+    if ( const Sorted* sorted = DYNAMIC_CAST(Sorted, coll) ) {
+        if ( sorted->contains(key) ) {
+            return sorted->isMap() ? sorted->get(key) : key;
+        }
+        return notFound;
+    }
+
+    if ( const Set* set = DYNAMIC_CAST(Set, coll) ) {
+        return set->contains(key) ? key : notFound;
+    }
+
+    return notFound;
+}
+
 
 // ================================
 // SYMBOL
+static Name::Special specialFormOf(const std::string& text)
+{
+    static const std::unordered_map<std::string, Name::Special> forms = {
+        { "def!",             Name::DEF },
+        { "defmacro!",        Name::DEFMACRO },
+        { "do",               Name::DO },
+        { "fn*",              Name::FN },
+        { "if",               Name::IF },
+        { "let*",             Name::LET },
+        { "macroexpand",      Name::MACROEXPAND },
+        { "quasiquote",       Name::QUASIQUOTE },
+        { "quasiquoteexpand", Name::QUASIQUOTEEXPAND },
+        { "quote",            Name::QUOTE },
+        { "try*",             Name::TRY },
+        { "catch*",           Name::CATCH },
+    };
+
+    auto it = forms.find(text);
+    return it == forms.end() ? Name::NOT_SPECIAL : it->second;
+}
+
+Name::Name(const std::string& text)
+    : m_text(text), m_hash(std::hash<std::string>()(text)),
+      m_special(specialFormOf(text))
+{ }
+
+const Name* Name::intern(const std::string& text)
+{
+    // names are never freed, the reader only creates so many
+    static std::unordered_map<std::string, const Name*> names;
+
+    auto it = names.find(text);
+    if ( it == names.end() ) {
+        it = names.emplace(text, new Name(text)).first;
+    }
+    return it->second;
+}
+
 bool Symbol::operator==(const Expression* rhs) const
 {
-    return value() == static_cast<const Symbol*>(rhs)->value();
+    return m_name == static_cast<const Symbol*>(rhs)->m_name;
 }
 
 AST Symbol::eval(EnvPtr env)
 {
-    return env->get(value());
+    return env->get(m_name);
+}
+
+AST LocalSymbol::eval(EnvPtr env)
+{
+    return env->get(m_depth, m_slot, name());
+}
+
+AST GlobalSymbol::eval(EnvPtr env)
+{
+    // the node is shared by every closure made from the same fn*, and
+    // one of them may have def!ed the name in a frame of its own
+    if ( m_cell && m_version == Env::version() && !env->shadowsGlobal(name()) ) {
+        return *m_cell;
+    }
+
+    EnvPtr frame = env->find(name());
+    if ( !frame ) {
+        return env->get(name()); // reports it as not found
+    }
+
+    // a def! inside a function binds the name in that call's frame only
+    const AST* cell = frame->lookup(name());
+    if ( !frame->outer() ) {
+        m_cell = cell;
+        m_version = Env::version();
+    }
+    return *cell;
 }
 
 
@@ -369,13 +737,45 @@ AST Vector::conj(AST_iter begin_iter, AST_iter end_iter) const
 
 // ================================
 // HASH
+static bool isHashKey(AST key)
+{
+    return dynamic_cast<String*>(key.ptr()) || dynamic_cast<Keyword*>(key.ptr());
+}
+
+static bool isSameKey(AST lhs, AST rhs)
+{
+    return lhs == rhs || lhs->isEqualTo(rhs.ptr());
+}
+
+Hash::Hash(AST_iter begin, AST_iter end, bool isEvaluated)
+    : m_count(0), m_isEval(isEvaluated)
+{
+    assert(std::distance(begin, end) % 2 == 0 && "hash map must be even sized!\n");
+    for ( AST_iter it = begin; it != end; it += 2 ) {
+        insert(*it, *(it + 1));
+    }
+}
+
+Hash::Hash(const Hash& that, AST meta)
+    : Expression(meta), m_map(that.m_map),
+    m_count(that.m_count), m_isEval(that.m_isEval)
+{
+    std::copy(that.m_slots, that.m_slots + 2 * that.m_count, m_slots);
+}
+
+Hash::Hash(const Hash& that, bool isEvaluated)
+    : m_map(that.m_map), m_count(that.m_count), m_isEval(isEvaluated)
+{
+    std::copy(that.m_slots, that.m_slots + 2 * that.m_count, m_slots);
+}
+
 std::string Hash::makeHashKey(AST key)
 {
-    if ( const String* skey = dynamic_cast<String*>(key.ptr()) ) {
-        return skey->toString(true);
+    if ( const Keyword* kkey = dynamic_cast<Keyword*>(key.ptr()) ) {
+        return kkey->value();
     }
-    else if ( const Keyword* kkey = dynamic_cast<Keyword*>(key.ptr()) ) {
-        return kkey->toString(true);
+    else if ( const String* skey = dynamic_cast<String*>(key.ptr()) ) {
+        return skey->toString(true);
     }
 
     throw std::string("not a string or keyword");
@@ -398,9 +798,97 @@ Hash::Map Hash::createMap(AST_iter begin, AST_iter end)
     return addToMap(map, begin, end);
 }
 
+const AST* Hash::lookup(AST key) const
+{
+    if ( isSmall() ) {
+        for ( int i = 0; i < m_count; ++i ) {
+            if ( isSameKey(m_slots[2 * i], key) ) {
+                return &m_slots[2 * i + 1];
+            }
+        }
+
+        return NULL;
+    }
+
+    // a keyword's map key is its own text, so it needs no key string built
+    const Keyword* keyword = DYNAMIC_CAST(Keyword, key);
+    auto it = keyword ? m_map.find(keyword->value()) : m_map.find(makeHashKey(key));
+    return it == m_map.end() ? NULL : &it->second;
+}
+
+void Hash::insert(AST key, AST value)
+{
+    if ( isSmall() ) {
+        if ( !isHashKey(key) ) {
+            throw std::string("not a string or keyword");
+        }
+
+        for ( int i = 0; i < m_count; ++i ) {
+            if ( isSameKey(m_slots[2 * i], key) ) {
+                m_slots[2 * i + 1] = value;
+                return;
+            }
+        }
+
+        if ( m_count < SMALL_LIMIT ) {
+            m_slots[2 * m_count] = key;
+            m_slots[2 * m_count + 1] = value;
+            ++m_count;
+            return;
+        }
+
+        promote();
+    }
+
+    m_map[makeHashKey(key)] = value;
+}
+
+void Hash::erase(AST key)
+{
+    if ( !isSmall() ) {
+        m_map.erase(makeHashKey(key));
+        return;
+    }
+
+    for ( int i = 0; i < m_count; ++i ) {
+        if ( isSameKey(m_slots[2 * i], key) ) {
+            --m_count;
+            m_slots[2 * i] = m_slots[2 * m_count];
+            m_slots[2 * i + 1] = m_slots[2 * m_count + 1];
+            m_slots[2 * m_count] = AST();
+            m_slots[2 * m_count + 1] = AST();
+            return;
+        }
+    }
+}
+
+void Hash::promote()
+{
+    for ( int i = 0; i < m_count; ++i ) {
+        m_map[makeHashKey(m_slots[2 * i])] = m_slots[2 * i + 1];
+        m_slots[2 * i] = AST();
+        m_slots[2 * i + 1] = AST();
+    }
+
+    m_count = 0;
+}
+
 const std::string Hash::toString(bool readably) const
 {
     std::string res = "{";
+
+    if ( isSmall() ) {
+        for ( int i = 0; i < m_count; ++i ) {
+            if ( i > 0 ) {
+                res += " ";
+            }
+            res += m_slots[2 * i]->toString(true) + " "
+                + m_slots[2 * i + 1]->toString(readably);
+        }
+
+        return res + "}";
+    }
+
     auto it = m_map.begin(),
         end = m_map.end();
 
@@ -418,12 +906,28 @@ const std::string Hash::toString(bool readably) const
 
 bool Hash::operator==(const Expression* rhs) const
 {
-    const Hash::Map& rhs_map = static_cast<const Hash*>(rhs)->m_map;
+    const Hash* rhs_hash = static_cast<const Hash*>(rhs);
 
-    if ( m_map.size() != rhs_map.size() ) {
+    if ( size() != rhs_hash->size() ) {
         return false;
     }
 
+    if ( isSmall() ) {
+        for ( int i = 0; i < m_count; ++i ) {
+            const AST* value = rhs_hash->lookup(m_slots[2 * i]);
+            if ( !value || !m_slots[2 * i + 1]->isEqualTo(value->ptr()) ) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    if ( rhs_hash->isSmall() ) {
+        return (*rhs_hash) == this;
+    }
+
+    const Hash::Map& rhs_map = rhs_hash->m_map;
     auto this_it = m_map.begin(),
         rhs_it = rhs_map.begin(),
         end = m_map.end();
@@ -449,24 +953,30 @@ AST Hash::assoc(AST_iter begin, AST_iter end) const
     if ( std::distance(begin, end) % 2 != 0 ) {
         throw "assoc requires even-sized lists";
     }
-    Hash::Map map(m_map);
-    return type::hash(addToMap(map, begin, end));
+
+    Hash* hash = new Hash(*this, true);
+    AST result(hash);
+    for ( AST_iter it = begin; it != end; it += 2 ) {
+        hash->insert(*it, *(it + 1));
+    }
+
+    return result;
 }
 
 AST Hash::dissoc(AST_iter begin, AST_iter end) const
 {
-    Hash::Map map(m_map);
+    Hash* hash = new Hash(*this, true);
+    AST result(hash);
     for ( auto it = begin; it != end; ++it ) {
-        std::string key = makeHashKey(*it);
-        map.erase(key);
+        hash->erase(*it);
     }
 
-    return type::hash(map);
+    return result;
 }
 
 bool Hash::contains(AST key) const
 {
-    return m_map.find(makeHashKey(key)) != m_map.end();
+    return lookup(key) != NULL;
 }
 
 AST Hash::eval(EnvPtr env)
@@ -475,24 +985,34 @@ AST Hash::eval(EnvPtr env)
         return AST(this);
     }
 
-    Hash::Map map;
+    Hash* hash = new Hash(*this, true);
+    AST result(hash);
 
-    for ( auto it = m_map.begin(); it != m_map.end(); ++it ) {
-        map[it->first] = EVAL(it->second, env);
+    for ( int i = 0; i < hash->m_count; ++i ) {
+        hash->m_slots[2 * i + 1] = EVAL(hash->m_slots[2 * i + 1], env);
     }
-    return type::hash(map);
+
+    for ( auto it = hash->m_map.begin(); it != hash->m_map.end(); ++it ) {
+        it->second = EVAL(it->second, env);
+    }
+
+    return result;
 }
 
 AST Hash::get(AST key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it == m_map.end() ? type::nilValue() : it->second;
+    const AST* value = lookup(key);
+    return value ? *value : type::nilValue();
 }
 
 AST Hash::keys() const
 {
     AST_vec* keys = new AST_vec();
-    keys->reserve(m_map.size());
+    keys->reserve(size());
+    for ( int i = 0; i < m_count; ++i ) {
+        keys->push_back(m_slots[2 * i]);
+    }
+
     for ( auto it = m_map.begin(), end = m_map.end(); it != end; ++it ) {
         if ( it->first[0] == '"' ) {
             keys->push_back(type::string(unescape(it->first)));
@@ -507,7 +1027,11 @@ AST Hash::keys() const
 AST Hash::values() const
 {
     AST_vec* keys = new AST_vec();
-    keys->reserve(m_map.size());
+    keys->reserve(size());
+    for ( int i = 0; i < m_count; ++i ) {
+        keys->push_back(m_slots[2 * i + 1]);
+    }
+
     for ( auto it = m_map.begin(), end = m_map.end(); it != end; ++it ) {
         keys->push_back(it->second);
     }
@@ -516,60 +1040,1914 @@ AST Hash::values() const
 
 
 // ================================
-// BUILTIN
-AST BuiltIn::apply(AST_iter argsBegin, AST_iter argsEnd) const
+// SET
+Set::Set(AST_iter begin, AST_iter end, bool isEvaluated)
+    : m_count(0), m_isEval(isEvaluated)
 {
-    return m_handler(m_name, argsBegin, argsEnd);
+    for ( AST_iter it = begin; it != end; ++it ) {
+        insert(*it);
+    }
 }
 
-// ================================
-// LAMBDA
-Lambda::Lambda(const std::vector<std::string>& bindings, AST body, EnvPtr env)
-    : m_bindings(bindings), m_body(body),
-    m_env(env), m_isMacro(false)
-{ }
-
-Lambda::Lambda(const Lambda& that, AST meta)
-    : Applicable(meta),
-    m_bindings(that.m_bindings), m_body(that.m_body),
-    m_env(that.m_env), m_isMacro(that.m_isMacro)
-{ }
-
-Lambda::Lambda(const Lambda& that, bool isMacro)
-    : Applicable(that.m_meta),
-    m_bindings(that.m_bindings), m_body(that.m_body),
-    m_env(that.m_env), m_isMacro(isMacro)
-{ }
-
-AST Lambda::doWithMeta(AST meta) const
+Set::Set(const Set& that, AST meta)
+    : Expression(meta), m_map(that.m_map),
+    m_count(that.m_count), m_isEval(that.m_isEval)
 {
-    return new Lambda(*this, meta);
+    std::copy(that.m_slots, that.m_slots + that.m_count, m_slots);
 }
 
-AST Lambda::apply(AST_iter argsBegin, AST_iter argsEnd) const
+Set::Set(const Set& that, bool isEvaluated)
+    : m_map(that.m_map), m_count(that.m_count), m_isEval(isEvaluated)
 {
-    return EVAL(m_body, makeEnv(argsBegin, argsEnd));
+    std::copy(that.m_slots, that.m_slots + that.m_count, m_slots);
 }
 
-EnvPtr Lambda::makeEnv(AST_iter argsBegin, AST_iter argsEnd) const
+static size_t combineHash(size_t seed, size_t hash)
 {
-    return EnvPtr(new Env(m_env, m_bindings, argsBegin, argsEnd));
+    return seed ^ (hash + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
 }
 
-bool Lambda::operator==(const Expression* rhs) const
+size_t Set::hashItem(AST item)
 {
-    return this == rhs;
-}
+    if ( const LazySeq* lazy = DYNAMIC_CAST(LazySeq, item) ) {
+        return hashItem(lazy->toList());
+    }
+    if ( const Range* range = DYNAMIC_CAST(Range, item) ) {
+        return hashItem(range->toList());
+    }
 
-const std::string Lambda::toString(bool readably) const
-{
-    std::ostringstream oss;
-    if ( m_isMacro ) {
-        oss << "#user-macro(" << this << ")";
+    // lists and vectors with equal items are equal, so they hash alike
+    if ( const Sequence* seq = DYNAMIC_CAST(Sequence, item) ) {
+        size_t hash = typeid(Sequence).hash_code();
+        for ( auto it = seq->begin(), end = seq->end(); it != end; ++it ) {
+            hash = combineHash(hash, hashItem(*it));
+        }
+        return hash;
     }
-    else {
-        oss << "#user-function(" << this << ")";
+
+    // the entries of maps and sets are summed, whatever order they are in
+    if ( const Hash* map = DYNAMIC_CAST(Hash, item) ) {
+        size_t hash = typeid(Hash).hash_code();
+        AST keys = map->keys();
+        const List* list = STATIC_CAST(List, keys);
+        for ( auto it = list->begin(), end = list->end(); it != end; ++it ) {
+            hash += combineHash(hashItem(*it), hashItem(map->get(*it)));
+        }
+        return hash;
+    }
+    if ( const Set* set = DYNAMIC_CAST(Set, item) ) {
+        size_t hash = typeid(Set).hash_code();
+        set->forEach([&hash](AST item) { hash += hashItem(item); });
+        return hash;
     }
 
-    return oss.str();
+    if ( const Symbol* symbol = DYNAMIC_CAST(Symbol, item) ) {
+        return symbol->name()->hash();
+    }
+
+    const size_t type = typeid(*item.ptr()).hash_code();
+    switch ( item->numberTag() ) {
+        case INTEGER:
+            return combineHash(type, std::hash<int64_t>()(STATIC_CAST(Integer, item)->value()));
+        case FLOAT:
+            return combineHash(type, std::hash<double>()(STATIC_CAST(Float, item)->value()));
+        default:
+            break;
+    }
+    if ( const StringBase* string = DYNAMIC_CAST(StringBase, item) ) {
+        return combineHash(type, std::hash<std::string>()(string->value()));
+    }
+
+    // anything else only hashes its type, and is told apart by isEqualTo
+    return type;
+}
+
+const AST* Set::lookup(AST item) const
+{
+    if ( isSmall() ) {
+        for ( int i = 0; i < m_count; ++i ) {
+            if ( isSameKey(m_slots[i], item) ) {
+                return &m_slots[i];
+            }
+        }
+
+        return NULL;
+    }
+
+    auto range = m_map.equal_range(hashItem(item));
+    for ( auto it = range.first; it != range.second; ++it ) {
+        if ( isSameKey(it->second, item) ) {
+            return &it->second;
+        }
+    }
+    return NULL;
+}
+
+void Set::insert(AST item)
+{
+    if ( isSmall() ) {
+        for ( int i = 0; i < m_count; ++i ) {
+            if ( isSameKey(m_slots[i], item) ) {
+                return;
+            }
+        }
+
+        if ( m_count < Hash::SMALL_LIMIT ) {
+            m_slots[m_count++] = item;
+            return;
+        }
+
+        promote();
+    }
+
+    const size_t hash = hashItem(item);
+    auto range = m_map.equal_range(hash);
+    for ( auto it = range.first; it != range.second; ++it ) {
+        if ( isSameKey(it->second, item) ) {
+            return;
+        }
+    }
+    m_map.emplace(hash, item);
+}
+
+void Set::erase(AST item)
+{
+    if ( !isSmall() ) {
+        auto range = m_map.equal_range(hashItem(item));
+        for ( auto it = range.first; it != range.second; ++it ) {
+            if ( isSameKey(it->second, item) ) {
+                m_map.erase(it);
+                return;
+            }
+        }
+        return;
+    }
+
+    for ( int i = 0; i < m_count; ++i ) {
+        if ( isSameKey(m_slots[i], item) ) {
+            m_slots[i] = m_slots[--m_count];
+            m_slots[m_count] = AST();
+            return;
+        }
+    }
+}
+
+void Set::promote()
+{
+    for ( int i = 0; i < m_count; ++i ) {
+        m_map.emplace(hashItem(m_slots[i]), m_slots[i]);
+        m_slots[i] = AST();
+    }
+
+    m_count = 0;
+}
+
+AST Set::conj(AST_iter argsBegin, AST_iter argsEnd) const
+{
+    Set* set = new Set(*this, true);
+    AST result(set);
+    for ( auto it = argsBegin; it != argsEnd; ++it ) {
+        set->insert(*it);
+    }
+
+    return result;
+}
+
+AST Set::disj(AST_iter argsBegin, AST_iter argsEnd) const
+{
+    Set* set = new Set(*this, true);
+    AST result(set);
+    for ( auto it = argsBegin; it != argsEnd; ++it ) {
+        set->erase(*it);
+    }
+
+    return result;
+}
+
+bool Set::contains(AST item) const
+{
+    return lookup(item) != NULL;
+}
+
+AST Set::get(AST item) const
+{
+    const AST* found = lookup(item);
+    return found ? *found : type::nilValue();
+}
+
+// the item items() lists first, without listing the others
+AST Set::first() const
+{
+    if ( m_count > 0 ) {
+        return m_slots[0];
+    }
+    return m_map.empty() ? type::nilValue() : m_map.begin()->second;
+}
+
+AST Set::items() const
+{
+    AST_vec* items = new AST_vec();
+    items->reserve(count());
+    forEach([items](AST item) { items->push_back(item); });
+    return type::list(items);
+}
+
+AST Set::unite(const Set* rhs) const
+{
+    // copy the larger set and add the smaller one to it
+    const Set* large = count() >= rhs->count() ? this : rhs;
+    const Set* small = large == this ? rhs : this;
+
+    Set* set = new Set(*large, true);
+    AST result(set);
+    small->forEach([set](AST item) { set->insert(item); });
+    return result;
+}
+
+AST Set::intersect(const Set* rhs) const
+{
+    // probe the larger set with each item of the smaller one
+    const Set* large = count() >= rhs->count() ? this : rhs;
+    const Set* small = large == this ? rhs : this;
+
+    AST_vec items;
+    small->forEach([&items, large](AST item) {
+        if ( large->contains(item) ) {
+            items.push_back(item);
+        }
+    });
+
+    return type::set(items.begin(), items.end(), true);
+}
+
+AST Set::subtract(const Set* rhs) const
+{
+    if ( rhs->count() < count() ) {
+        Set* set = new Set(*this, true);
+        AST result(set);
+        rhs->forEach([set](AST item) { set->erase(item); });
+        return result;
+    }
+
+    AST_vec items;
+    forEach([&items, rhs](AST item) {
+        if ( !rhs->contains(item) ) {
+            items.push_back(item);
+        }
+    });
+
+    return type::set(items.begin(), items.end(), true);
+}
+
+AST Set::eval(EnvPtr env)
+{
+    if ( m_isEval ) {
+        return AST(this);
+    }
+
+    AST_vec items;
+    items.reserve(count());
+    forEach([&items, env](AST item) { items.push_back(EVAL(item, env)); });
+    return type::set(items.begin(), items.end(), true);
+}
+
+const std::string Set::toString(bool readably) const
+{
+    std::string res = "#{";
+    bool first = true;
+    forEach([&res, &first, readably](AST item) {
+        if ( !first ) {
+            res += " ";
+        }
+        res += item->toString(readably);
+        first = false;
+    });
+
+    return res + "}";
+}
+
+bool Set::operator==(const Expression* rhs) const
+{
+    const Set* rhs_set = static_cast<const Set*>(rhs);
+    if ( count() != rhs_set->count() ) {
+        return false;
+    }
+
+    bool equal = true;
+    forEach([&equal, rhs_set](AST item) {
+        equal = equal && rhs_set->contains(item);
+    });
+
+    return equal;
+}
+
+
+// ================================
+// SORTED
+static int height(const SortedNodePtr& node)
+{
+    return node ? node->height : 0;
+}
+
+SortedNode::SortedNode(AST key, AST value, SortedNodePtr left, SortedNodePtr right)
+    : key(key), value(value), left(left), right(right),
+    height(1 + std::max(::height(left), ::height(right)))
+{ }
+
+static SortedNodePtr balance(AST key, AST value, SortedNodePtr left, SortedNodePtr right)
+{
+    const int hl = height(left), hr = height(right);
+
+    if ( hl > hr + 1 ) {
+        if ( height(left->left) >= height(left->right) ) {
+            return new SortedNode(left->key, left->value, left->left,
+                new SortedNode(key, value, left->right, right));
+        }
+
+        const SortedNode* lr = left->right.ptr();
+        return new SortedNode(lr->key, lr->value,
+            new SortedNode(left->key, left->value, left->left, lr->left),
+            new SortedNode(key, value, lr->right, right));
+    }
+
+    if ( hr > hl + 1 ) {
+        if ( height(right->right) >= height(right->left) ) {
+            return new SortedNode(right->key, right->value,
+                new SortedNode(key, value, left, right->left), right->right);
+        }
+
+        const SortedNode* rl = right->left.ptr();
+        return new SortedNode(rl->key, rl->value,
+            new SortedNode(key, value, left, rl->left),
+            new SortedNode(right->key, right->value, rl->right, right->right));
+    }
+
+    return new SortedNode(key, value, left, right);
+}
+
+static SortedNodePtr removeMin(SortedNodePtr node, SortedNodePtr& min)
+{
+    if ( !node->left ) {
+        min = node;
+        return node->right;
+    }
+
+    return balance(node->key, node->value, removeMin(node->left, min), node->right);
+}
+
+Sorted::Sorted(AST comparator, bool isMap)
+    : m_comparator(comparator), m_count(0), m_isMap(isMap)
+{ }
+
+Sorted::Sorted(const Sorted& that, AST meta)
+    : Expression(meta), m_comparator(that.m_comparator),
+    m_root(that.m_root), m_count(that.m_count), m_isMap(that.m_isMap)
+{ }
+
+Sorted::Sorted(const Sorted& that, SortedNodePtr root, int count)
+    : m_comparator(that.m_comparator), m_root(root),
+    m_count(count), m_isMap(that.m_isMap)
+{ }
+
+int Sorted::defaultCompare(AST lhs, AST rhs)
+{
+    if ( lhs == rhs ) {
+        return 0;
+    }
+
+    if ( lhs == type::nilValue() || rhs == type::nilValue() ) {
+        return lhs == type::nilValue() ? -1 : 1;
+    }
+
+    if ( lhs->numberTag() != Expression::NOT_NUMBER ) {
+        if ( rhs->numberTag() == Expression::NOT_NUMBER ) {
+            throw LISP_ERROR("Cannot compare ", lhs->toString(true),
+                " with ", rhs->toString(true));
+        }
+
+        if ( lhs->numberTag() == Expression::INTEGER && rhs->numberTag() == Expression::INTEGER ) {
+            const int64_t l = STATIC_CAST(Integer, lhs)->value(), r = STATIC_CAST(Integer, rhs)->value();
+            return (l > r) - (l < r);
+        }
+
+        const double l = lhs->numberTag() == Expression::INTEGER
+            ? STATIC_CAST(Integer, lhs)->value() : STATIC_CAST(Float, lhs)->value();
+        const double r = rhs->numberTag() == Expression::INTEGER
+            ? STATIC_CAST(Integer, rhs)->value() : STATIC_CAST(Float, rhs)->value();
+        return (l > r) - (l < r);
+    }
+
+    if ( const StringBase* lstr = DYNAMIC_CAST(StringBase, lhs) ) {
+        if ( typeid(*lhs.ptr()) != typeid(*rhs.ptr()) ) {
+            throw LISP_ERROR("Cannot compare ", lhs->toString(true),
+                " with ", rhs->toString(true));
+        }
+        return lstr->value().compare(STATIC_CAST(StringBase, rhs)->value());
+    }
+
+    if ( lhs == type::falseValue() || lhs == type::trueValue() ) {
+        if ( rhs != type::falseValue() && rhs != type::trueValue() ) {
+            throw LISP_ERROR("Cannot compare ", lhs->toString(true),
+                " with ", rhs->toString(true));
+        }
+        return lhs == type::trueValue() ? 1 : -1;
+    }
+
+    if ( const Sequence* lseq = DYNAMIC_CAST(Sequence, lhs) ) {
+        const Sequence* rseq = VALUE_CAST(Sequence, rhs);
+        for ( size_t i = 0; i < lseq->count() && i < rseq->count(); ++i ) {
+            if ( int c = defaultCompare(lseq->item(i), rseq->item(i)) ) {
+                return c;
+            }
+        }
+        return (lseq->count() > rseq->count()) - (lseq->count() < rseq->count());
+    }
+
+    throw LISP_ERROR("Cannot compare ", lhs->toString(true),
+        " with ", rhs->toString(true));
+}
+
+int Sorted::compare(AST lhs, AST rhs) const
+{
+    if ( !m_comparator ) {
+        return defaultCompare(lhs, rhs);
+    }
+
+    // comparators may return an integer, or act as a "less than" predicate
+    AST_vec args = { lhs, rhs };
+    AST result = APPLY(m_comparator, args.begin(), args.end());
+    if ( const Integer* order = DYNAMIC_CAST(Integer, result) ) {
+        return (order->value() > 0) - (order->value() < 0);
+    }
+
+    if ( result->isTrue() ) {
+        return -1;
+    }
+
+    std::swap(args[0], args[1]);
+    return APPLY(m_comparator, args.begin(), args.end())->isTrue() ? 1 : 0;
+}
+
+SortedNodePtr Sorted::insert(SortedNodePtr node, AST key, AST value, bool& added) const
+{
+    if ( !node ) {
+        added = true;
+        return new SortedNode(key, value, NULL, NULL);
+    }
+
+    const int order = compare(key, node->key);
+    if ( order < 0 ) {
+        return balance(node->key, node->value,
+            insert(node->left, key, value, added), node->right);
+    }
+
+    if ( order > 0 ) {
+        return balance(node->key, node->value,
+            node->left, insert(node->right, key, value, added));
+    }
+
+    return new SortedNode(node->key, value, node->left, node->right);
+}
+
+SortedNodePtr Sorted::remove(SortedNodePtr node, AST key, bool& removed) const
+{
+    if ( !node ) {
+        return node;
+    }
+
+    const int order = compare(key, node->key);
+    if ( order < 0 ) {
+        SortedNodePtr left = remove(node->left, key, removed);
+        return removed ? balance(node->key, node->value, left, node->right) : node;
+    }
+
+    if ( order > 0 ) {
+        SortedNodePtr right = remove(node->right, key, removed);
+        return removed ? balance(node->key, node->value, node->left, right) : node;
+    }
+
+    removed = true;
+    if ( !node->left ) {
+        return node->right;
+    }
+
+    if ( !node->right ) {
+        return node->left;
+    }
+
+    SortedNodePtr min;
+    SortedNodePtr right = removeMin(node->right, min);
+    return balance(min->key, min->value, node->left, right);
+}
+
+AST Sorted::assoc(AST_iter argsBegin, AST_iter argsEnd) const
+{
+    const int step = m_isMap ? 2 : 1;
+    if ( std::distance(argsBegin, argsEnd) % step != 0 ) {
+        throw LISP_ERROR("sorted-map expects an even number of args");
+    }
+
+    SortedNodePtr root = m_root;
+    int count = m_count;
+    for ( auto it = argsBegin; it != argsEnd; it += step ) {
+        bool added = false;
+        root = insert(root, *it, m_isMap ? *(it + 1) : *it, added);
+        count += added;
+    }
+
+    return new Sorted(*this, root, count);
+}
+
+AST Sorted::dissoc(AST_iter argsBegin, AST_iter argsEnd) const
+{
+    SortedNodePtr root = m_root;
+    int count = m_count;
+    for ( auto it = argsBegin; it != argsEnd; ++it ) {
+        bool removed = false;
+        root = remove(root, *it, removed);
+        count -= removed;
+    }
+
+    return new Sorted(*this, root, count);
+}
+
+bool Sorted::contains(AST key) const
+{
+    for ( const SortedNode* node = m_root.ptr(); node; ) {
+        const int order = compare(key, node->key);
+        if ( order == 0 ) {
+            return true;
+        }
+        node = (order < 0 ? node->left : node->right).ptr();
+    }
+
+    return false;
+}
+
+AST Sorted::get(AST key) const
+{
+    for ( const SortedNode* node = m_root.ptr(); node; ) {
+        const int order = compare(key, node->key);
+        if ( order == 0 ) {
+            return node->value;
+        }
+        node = (order < 0 ? node->left : node->right).ptr();
+    }
+
+    return type::nilValue();
+}
+
+AST Sorted::entry(const SortedNode* node) const
+{
+    if ( !m_isMap ) {
+        return node->key;
+    }
+
+    AST_vec* pair = new AST_vec(2);
+    (*pair)[0] = node->key;
+    (*pair)[1] = node->value;
+    return type::vector(pair);
+}
+
+AST Sorted::first() const
+{
+    const SortedNode* node = m_root.ptr();
+    if ( !node ) {
+        return type::nilValue();
+    }
+
+    while ( node->left ) {
+        node = node->left.ptr();
+    }
+    return entry(node);
+}
+
+AST Sorted::last() const
+{
+    const SortedNode* node = m_root.ptr();
+    if ( !node ) {
+        return type::nilValue();
+    }
+
+    while ( node->right ) {
+        node = node->right.ptr();
+    }
+    return entry(node);
+}
+
+AST Sorted::range(AST low, bool lowInclusive, AST high, bool highInclusive,
+                  bool reverse) const
+{
+    // Walk down to the first node inside the start bound, keeping the
+    // path on a stack, then do an in-order walk until the end bound.
+    AST start = reverse ? high : low;
+    AST stop = reverse ? low : high;
+    const bool startInclusive = reverse ? highInclusive : lowInclusive;
+    const bool stopInclusive = reverse ? lowInclusive : highInclusive;
+    const int dir = reverse ? -1 : 1;
+
+    std::vector<const SortedNode*> stack;
+    for ( const SortedNode* node = m_root.ptr(); node; ) {
+        const int order = start ? dir * compare(node->key, start) : 1;
+        if ( order > 0 || (order == 0 && startInclusive) ) {
+            stack.push_back(node);
+            node = (reverse ? node->right : node->left).ptr();
+        }
+        else {
+            node = (reverse ? node->left : node->right).ptr();
+        }
+    }
+
+    AST_vec* items = new AST_vec();
+    while ( !stack.empty() ) {
+        const SortedNode* node = stack.back();
+        stack.pop_back();
+
+        if ( stop ) {
+            const int order = dir * compare(node->key, stop);
+            if ( order > 0 || (order == 0 && !stopInclusive) ) {
+                break;
+            }
+        }
+        items->push_back(entry(node));
+
+        for ( node = (reverse ? node->left : node->right).ptr(); node;
+              node = (reverse ? node->right : node->left).ptr() ) {
+            stack.push_back(node);
+        }
+    }
+
+    if ( items->empty() ) {
+        delete items;
+        return type::nilValue();
+    }
+    return type::list(items);
+}
+
+AST Sorted::items() const
+{
+    return range(NULL, true, NULL, true, false);
+}
+
+AST Sorted::keys() const
+{
+    AST_vec* keys = new AST_vec();
+    keys->reserve(m_count);
+
+    std::vector<const SortedNode*> stack;
+    for ( const SortedNode* node = m_root.ptr(); node || !stack.empty(); ) {
+        if ( node ) {
+            stack.push_back(node);
+            node = node->left.ptr();
+            continue;
+        }
+
+        node = stack.back();
+        stack.pop_back();
+        keys->push_back(node->key);
+        node = node->right.ptr();
+    }
+
+    return type::list(keys);
+}
+
+AST Sorted::values() const
+{
+    AST_vec* values = new AST_vec();
+    values->reserve(m_count);
+
+    std::vector<const SortedNode*> stack;
+    for ( const SortedNode* node = m_root.ptr(); node || !stack.empty(); ) {
+        if ( node ) {
+            stack.push_back(node);
+            node = node->left.ptr();
+            continue;
+        }
+
+        node = stack.back();
+        stack.pop_back();
+        values->push_back(node->value);
+        node = node->right.ptr();
+    }
+
+    return type::list(values);
+}
+
+const std::string Sorted::toString(bool readably) const
+{
+    std::string res = m_isMap ? "{" : "#{";
+    AST all = items();
+    if ( const Sequence* seq = DYNAMIC_CAST(Sequence, all) ) {
+        for ( auto it = seq->begin(), end = seq->end(); it != end; ++it ) {
+            if ( it != seq->begin() ) {
+                res += " ";
+            }
+
+            if ( m_isMap ) {
+                const Sequence* pair = STATIC_CAST(Sequence, *it);
+                res += pair->item(0)->toString(readably) + " "
+                    + pair->item(1)->toString(readably);
+            }
+            else {
+                res += (*it)->toString(readably);
+            }
+        }
+    }
+
+    return res + "}";
+}
+
+bool Sorted::operator==(const Expression* rhs) const
+{
+    const Sorted* rhs_sorted = static_cast<const Sorted*>(rhs);
+    if ( m_isMap != rhs_sorted->m_isMap || m_count != rhs_sorted->m_count ) {
+        return false;
+    }
+
+    return m_count == 0 || items()->isEqualTo(rhs_sorted->items().ptr());
+}
+
+
+// ================================
+// QUEUE
+Queue::Queue(const Queue& that, AST meta)
+    : Expression(meta),
+    m_front(that.m_front), m_frontBegin(that.m_frontBegin), m_frontEnd(that.m_frontEnd),
+    m_rear(that.m_rear), m_rearEnd(that.m_rearEnd)
+{ }
+
+AST Queue::conj(AST_iter argsBegin, AST_iter argsEnd) const
+{
+    if ( argsBegin == argsEnd ) {
+        return AST(const_cast<Queue*>(this));
+    }
+
+    Queue* queue = new Queue;
+    AST result(queue);
+    queue->m_front = m_front;
+    queue->m_frontBegin = m_frontBegin;
+    queue->m_frontEnd = m_frontEnd;
+
+    // only the queue that last appended to a rear buffer may extend it
+    if ( m_rear && m_rear->items.size() == m_rearEnd ) {
+        queue->m_rear = m_rear;
+    }
+    else {
+        queue->m_rear = new ItemBuffer;
+        if ( m_rear ) {
+            queue->m_rear->items.assign(m_rear->items.begin(),
+                m_rear->items.begin() + m_rearEnd);
+        }
+    }
+
+    queue->m_rear->items.insert(queue->m_rear->items.end(), argsBegin, argsEnd);
+    queue->m_rearEnd = queue->m_rear->items.size();
+
+    if ( m_frontBegin == m_frontEnd ) {
+        queue->m_front = queue->m_rear;
+        queue->m_frontBegin = 0;
+        queue->m_frontEnd = queue->m_rearEnd;
+        queue->m_rear = ItemBufferPtr();
+        queue->m_rearEnd = 0;
+    }
+
+    return result;
+}
+
+AST Queue::peek() const
+{
+    return count() == 0 ? type::nilValue() : m_front->items[m_frontBegin];
+}
+
+AST Queue::pop() const
+{
+    if ( count() == 0 ) {
+        return AST(const_cast<Queue*>(this));
+    }
+
+    Queue* queue = new Queue(*this, m_meta);
+    AST result(queue);
+    if ( ++queue->m_frontBegin == queue->m_frontEnd ) {
+        queue->m_front = m_rear;
+        queue->m_frontBegin = 0;
+        queue->m_frontEnd = m_rearEnd;
+        queue->m_rear = ItemBufferPtr();
+        queue->m_rearEnd = 0;
+    }
+
+    return result;
+}
+
+AST Queue::items() const
+{
+    AST_vec* items = new AST_vec();
+    items->reserve(count());
+    forEach([items](AST item) { items->push_back(item); });
+    return type::list(items);
+}
+
+const std::string Queue::toString(bool readably) const
+{
+    return "#queue " + items()->toString(readably);
+}
+
+bool Queue::operator==(const Expression* rhs) const
+{
+    const Queue* rhs_queue = static_cast<const Queue*>(rhs);
+    return count() == rhs_queue->count()
+        && items()->isEqualTo(rhs_queue->items().ptr());
+}
+
+
+// ================================
+// LAZY SEQUENCE
+LazySeq::LazySeq(Thunk thunk)
+    : m_thunk(thunk), m_offset(0), m_isRealized(false), m_isEmpty(false)
+{ }
+
+LazySeq::LazySeq(AST first, AST rest)
+    : m_offset(0), m_isRealized(true), m_isEmpty(false),
+    m_first(first), m_rest(rest)
+{ }
+
+LazySeq::LazySeq(AST source, int offset)
+    : m_source(source), m_offset(offset), m_isRealized(false), m_isEmpty(false)
+{ }
+
+LazySeq::LazySeq(ItemBufferPtr chunk, int offset, AST rest)
+    : m_offset(offset), m_isRealized(true), m_isEmpty(false),
+    m_first(chunk->items[offset]), m_chunk(chunk), m_chunkRest(rest)
+{ }
+
+LazySeq::LazySeq(const LazySeq& that, AST meta)
+    : Expression(meta), m_thunk(that.m_thunk), m_source(that.m_source),
+    m_offset(that.m_offset), m_isRealized(that.m_isRealized),
+    m_isEmpty(that.m_isEmpty), m_first(that.m_first), m_rest(that.m_rest),
+    m_chunk(that.m_chunk), m_chunkRest(that.m_chunkRest)
+{ }
+
+LazySeq::~LazySeq()
+{
+    // Unlink realized chains iteratively, so that dropping a long
+    // sequence does not recurse once per cell.
+    AST_vec pending = { m_rest, m_chunkRest };
+    m_rest = AST();
+    m_chunkRest = AST();
+
+    while ( !pending.empty() ) {
+        AST cell = pending.back();
+        pending.pop_back();
+
+        LazySeq* next = DYNAMIC_CAST(LazySeq, cell);
+        if ( next && cell->count() == 1 ) {
+            pending.push_back(next->m_rest);
+            pending.push_back(next->m_chunkRest);
+            next->m_rest = AST();
+            next->m_chunkRest = AST();
+        }
+    }
+}
+
+void LazySeq::assign(const LazySeq* that) const
+{
+    m_isEmpty = that->m_isEmpty;
+    m_first = that->m_first;
+    m_rest = that->m_rest;
+    m_chunk = that->m_chunk;
+    m_offset = that->m_offset;
+    m_chunkRest = that->m_chunkRest;
+    m_isRealized = true;
+}
+
+void LazySeq::realize() const
+{
+    while ( !m_isRealized ) {
+        if ( m_source ) {
+            const Sequence* seq = STATIC_CAST(Sequence, m_source);
+            if ( (size_t)m_offset >= seq->count() ) {
+                m_isEmpty = true;
+            }
+            else {
+                m_first = seq->item(m_offset);
+                m_rest = new LazySeq(m_source, m_offset + 1);
+            }
+            m_source = AST();
+            m_isRealized = true;
+            continue;
+        }
+
+        AST value = m_thunk();
+        m_thunk = nullptr;
+
+        if ( value == type::nilValue() ) {
+            m_isEmpty = true;
+            m_isRealized = true;
+        }
+        else if ( const LazySeq* lazy = DYNAMIC_CAST(LazySeq, value) ) {
+            if ( !lazy->m_isRealized && value->count() == 1 ) {
+                // nobody else can see the inner cell, take over its work
+                // instead of recursing into it
+                m_thunk = lazy->m_thunk;
+                m_source = lazy->m_source;
+                m_offset = lazy->m_offset;
+                continue;
+            }
+
+            lazy->realize();
+            assign(lazy);
+        }
+        else if ( DYNAMIC_CAST(Sequence, value) ) {
+            m_source = value;
+            m_offset = 0;
+        }
+        else if ( const Range* range = DYNAMIC_CAST(Range, value) ) {
+            m_isEmpty = range->isEmpty();
+            if ( !m_isEmpty ) {
+                m_first = range->first();
+                m_rest = range->rest();
+            }
+            m_isRealized = true;
+        }
+        else {
+            throw LISP_ERROR(value->toString(true), " is not a sequence");
+        }
+    }
+}
+
+AST LazySeq::restCell() const
+{
+    if ( m_chunk && !m_rest ) {
+        const int next = m_offset + 1;
+        m_rest = next < (int)m_chunk->items.size()
+            ? AST(new LazySeq(m_chunk, next, m_chunkRest))
+            : m_chunkRest;
+    }
+
+    return m_rest;
+}
+
+bool LazySeq::isEmpty() const
+{
+    realize();
+    return m_isEmpty;
+}
+
+AST LazySeq::first() const
+{
+    realize();
+    return m_isEmpty ? type::nilValue() : m_first;
+}
+
+AST LazySeq::rest() const
+{
+    realize();
+    if ( m_isEmpty || !restCell() || m_rest == type::nilValue() ) {
+        return type::list(new AST_vec(0));
+    }
+    return m_rest;
+}
+
+bool LazySeq::nextChunk(AST coll, AST_vec& items, AST& rest)
+{
+    items.clear();
+    rest = type::nilValue();
+
+    if ( const Sequence* seq = DYNAMIC_CAST(Sequence, coll) ) {
+        const int end = std::min(seq->count(), (size_t)CHUNK_SIZE);
+        items.assign(seq->begin(), seq->begin() + end);
+        if ( end < (int)seq->count() ) {
+            rest = new LazySeq(coll, end);
+        }
+        return !items.empty();
+    }
+
+    if ( const Range* range = DYNAMIC_CAST(Range, coll) ) {
+        int64_t end = CHUNK_SIZE;
+        if ( !range->isInfinite() ) {
+            end = std::min(end, range->count());
+        }
+
+        for ( int64_t i = 0; i < end; ++i ) {
+            items.push_back(type::integer(range->at(i)));
+        }
+        rest = range->drop(end);
+        return !items.empty();
+    }
+
+    const LazySeq* lazy = DYNAMIC_CAST(LazySeq, coll);
+    if ( !lazy ) {
+        if ( coll != type::nilValue() ) {
+            throw LISP_ERROR(coll->toString(true), " is not a sequence");
+        }
+        return false;
+    }
+
+    // a pending slice can hand out a whole block of its source at once
+    if ( !lazy->m_isRealized && lazy->m_source ) {
+        const Sequence* seq = STATIC_CAST(Sequence, lazy->m_source);
+        const int begin = std::min((size_t)lazy->m_offset, seq->count());
+        const int end = std::min(seq->count(), (size_t)(begin + CHUNK_SIZE));
+        items.assign(seq->begin() + begin, seq->begin() + end);
+        if ( end < (int)seq->count() ) {
+            rest = new LazySeq(lazy->m_source, end);
+        }
+        return !items.empty();
+    }
+
+    if ( lazy->isEmpty() ) {
+        return false;
+    }
+
+    if ( lazy->m_chunk ) {
+        const AST_vec& chunk = lazy->m_chunk->items;
+        items.assign(chunk.begin() + lazy->m_offset, chunk.end());
+        rest = lazy->m_chunkRest;
+        return true;
+    }
+
+    items.push_back(lazy->m_first);
+    rest = lazy->m_rest;
+    return true;
+}
+
+bool LazySeq::nextChunk(AST coll, AST_iter& begin, AST_iter& end,
+                        AST_vec& buffer, AST& rest)
+{
+    // a list or vector, or a pending slice of one
+    AST source = coll;
+    size_t offset = 0;
+    const LazySeq* lazy = DYNAMIC_CAST(LazySeq, coll);
+    if ( lazy && !lazy->m_isRealized && lazy->m_source ) {
+        source = lazy->m_source;
+        offset = lazy->m_offset;
+    }
+    if ( const Sequence* seq = DYNAMIC_CAST(Sequence, source) ) {
+        const size_t first = std::min(offset, seq->count());
+        const size_t last = std::min(seq->count(), first + CHUNK_SIZE);
+        begin = seq->begin() + first;
+        end = seq->begin() + last;
+        rest = last < seq->count() ? AST(new LazySeq(source, last)) : type::nilValue();
+        return begin != end;
+    }
+
+    if ( lazy && !lazy->isEmpty() && lazy->m_chunk ) {
+        AST_vec& chunk = lazy->m_chunk->items;
+        begin = chunk.begin() + lazy->m_offset;
+        end = chunk.end();
+        rest = lazy->m_chunkRest;
+        return true;
+    }
+
+    const bool found = nextChunk(coll, buffer, rest);
+    begin = buffer.begin();
+    end = buffer.end();
+    return found;
+}
+
+AST LazySeq::toList() const
+{
+    AST_vec* items = new AST_vec();
+    AST_vec chunk;
+    AST cell(const_cast<LazySeq*>(this));
+
+    while ( nextChunk(cell, chunk, cell) ) {
+        items->insert(items->end(), chunk.begin(), chunk.end());
+    }
+
+    return type::list(items);
+}
+
+const std::string LazySeq::toString(bool readably) const
+{
+    return toList()->toString(readably);
+}
+
+bool LazySeq::operator==(const Expression* rhs) const
+{
+    return toList()->isEqualTo(rhs);
+}
+
+
+// ================================
+// RANGE
+Range::Range(int64_t start, __int128 end, int64_t step, bool isInfinite)
+    : m_start(start), m_end(end), m_step(step), m_isInfinite(isInfinite)
+{ }
+
+Range::Range(const Range& that, AST meta)
+    : Expression(meta), m_start(that.m_start), m_end(that.m_end),
+    m_step(that.m_step), m_isInfinite(that.m_isInfinite)
+{ }
+
+__int128 Range::length() const
+{
+    // widen so that ranges close to the int64 limits do not overflow
+    const __int128 span = m_end - m_start;
+    if ( m_step == 0 || (span > 0) != (m_step > 0) || span == 0 ) {
+        return 0;
+    }
+
+    return (span + m_step + (m_step > 0 ? -1 : 1)) / m_step;
+}
+
+int64_t Range::count() const
+{
+    if ( m_isInfinite ) {
+        throw LISP_ERROR("count not supported on infinite range");
+    }
+
+    const __int128 n = length();
+    if ( n > INT64_MAX ) {
+        throw LISP_ERROR("Integer overflow");
+    }
+    return (int64_t)n;
+}
+
+bool Range::isEmpty() const
+{
+    return !m_isInfinite && length() == 0;
+}
+
+AST Range::first() const
+{
+    return isEmpty() ? type::nilValue() : type::integer(m_start);
+}
+
+AST Range::rest() const
+{
+    return drop(1);
+}
+
+AST Range::nth(int64_t index) const
+{
+    if ( index < 0 || (!m_isInfinite && index >= length()) ) {
+        throw LISP_ERROR("Index out of range");
+    }
+
+    return type::integer(at(index));
+}
+
+AST Range::take(int64_t n) const
+{
+    n = std::max<int64_t>(n, 0);
+    if ( !m_isInfinite && n >= length() ) {
+        return AST(new Range(m_start, m_end, m_step));
+    }
+
+    // the items taken may reach the int64 limits, so the end after them
+    // is computed in 128 bits rather than with at
+    return AST(new Range(m_start, m_start + (__int128)n * m_step, m_step));
+}
+
+AST Range::drop(int64_t n) const
+{
+    n = std::max<int64_t>(n, 0);
+    if ( !m_isInfinite && n >= length() ) {
+        return type::range(m_start, m_start, m_step);
+    }
+
+    return AST(new Range(at(n), m_end, m_step, m_isInfinite));
+}
+
+AST Range::toList() const
+{
+    const int64_t length = count();
+    AST_vec* items = new AST_vec(length);
+    for ( int64_t i = 0; i < length; ++i ) {
+        (*items)[i] = type::integer(at(i));
+    }
+
+    return type::list(items);
+}
+
+const std::string Range::toString(bool readably) const
+{
+    return toList()->toString(readably);
+}
+
+bool Range::operator==(const Expression* rhs) const
+{
+    return toList()->isEqualTo(rhs);
+}
+
+
+// ================================
+// NUMERIC ARRAY
+NumArray::NumArray(Kind kind, size_t count)
+    : m_kind(kind)
+{
+    resize(count);
+}
+
+NumArray::NumArray(const NumArray& that, AST meta)
+    : Expression(meta), m_kind(that.m_kind), m_ints(that.m_ints),
+    m_doubles(that.m_doubles)
+{ }
+
+void NumArray::resize(size_t count)
+{
+    if ( m_kind == INT ) {
+        m_ints.resize(count);
+    }
+    else {
+        m_doubles.resize(count);
+    }
+}
+
+AST NumArray::item(size_t index) const
+{
+    if ( index >= count() ) {
+        throw LISP_ERROR("Index out of range");
+    }
+
+    return m_kind == INT ? type::integer(m_ints[index]) : type::floating(m_doubles[index]);
+}
+
+void NumArray::setItem(size_t index, AST value)
+{
+    if ( index >= count() ) {
+        throw LISP_ERROR("Index out of range");
+    }
+
+    if ( m_kind == INT ) {
+        m_ints[index] = VALUE_CAST(Integer, value)->value();
+    }
+    else if ( value->numberTag() == INTEGER ) {
+        m_doubles[index] = STATIC_CAST(Integer, value)->value();
+    }
+    else {
+        m_doubles[index] = VALUE_CAST(Float, value)->value();
+    }
+}
+
+AST NumArray::toList() const
+{
+    const size_t length = count();
+    AST_vec* items = new AST_vec(length);
+    for ( size_t i = 0; i < length; ++i ) {
+        (*items)[i] = item(i);
+    }
+
+    return type::list(items);
+}
+
+const std::string NumArray::toString(bool readably) const
+{
+    std::ostringstream out;
+    out << (m_kind == INT ? "#int-array [" : "#double-array [");
+    for ( size_t i = 0; i < count(); ++i ) {
+        if ( i > 0 ) {
+            out << ' ';
+        }
+        if ( m_kind == INT ) {
+            out << m_ints[i];
+        }
+        else {
+            out << Float::format(m_doubles[i]);
+        }
+    }
+    out << ']';
+
+    return out.str();
+}
+
+bool NumArray::operator==(const Expression* rhs) const
+{
+    const NumArray* other = static_cast<const NumArray*>(rhs);
+    return m_kind == other->m_kind && m_ints == other->m_ints
+        && m_doubles == other->m_doubles;
+}
+
+
+// ================================
+// TRANSIENT
+Transient::Transient(AST coll)
+    : m_items(NULL), m_owner(std::this_thread::get_id())
+{
+    if ( const Vector* vec = DYNAMIC_CAST(Vector, coll) ) {
+        m_items = new AST_vec(vec->begin(), vec->end());
+    }
+    else if ( const Hash* hash = DYNAMIC_CAST(Hash, coll) ) {
+        m_hash = new Hash(*hash, true);
+    }
+    else {
+        throw LISP_ERROR(coll->toString(true), " can not be made transient");
+    }
+}
+
+void Transient::ensureEditable() const
+{
+    if ( !m_items && !m_hash ) {
+        throw LISP_ERROR("Transient used after persistent! call");
+    }
+
+    if ( m_owner != std::this_thread::get_id() ) {
+        throw LISP_ERROR("Transient used by non-owner thread");
+    }
+}
+
+void Transient::conj(AST item)
+{
+    ensureEditable();
+    if ( m_items ) {
+        m_items->push_back(item);
+        return;
+    }
+
+    Hash* hash = STATIC_CAST(Hash, m_hash);
+    if ( const Hash* other = DYNAMIC_CAST(Hash, item) ) {
+        for ( int i = 0; i < other->m_count; ++i ) {
+            hash->insert(other->m_slots[2 * i], other->m_slots[2 * i + 1]);
+        }
+        if ( other->isSmall() ) {
+            return;
+        }
+
+        // the other map's keys are already made into m_map keys, which
+        // this one can take as they are once it has moved to m_map too
+        hash->promote();
+        for ( auto it = other->m_map.begin(); it != other->m_map.end(); ++it ) {
+            hash->m_map[it->first] = it->second;
+        }
+        return;
+    }
+
+    const Sequence* entry = VALUE_CAST(Sequence, item);
+    if ( entry->count() != 2 ) {
+        throw LISP_ERROR("conj! on a map expects [key value] entries");
+    }
+    hash->insert(entry->item(0), entry->item(1));
+}
+
+void Transient::assoc(AST key, AST value)
+{
+    ensureEditable();
+    if ( m_items ) {
+        int64_t index = VALUE_CAST(Integer, key)->value();
+        if ( index < 0 || index > (int64_t)m_items->size() ) {
+            throw LISP_ERROR("Index out of range");
+        }
+
+        if ( index == (int64_t)m_items->size() ) {
+            m_items->push_back(value);
+        }
+        else {
+            (*m_items)[index] = value;
+        }
+        return;
+    }
+
+    STATIC_CAST(Hash, m_hash)->insert(key, value);
+}
+
+void Transient::dissoc(AST key)
+{
+    ensureEditable();
+    if ( m_items ) {
+        throw LISP_ERROR("dissoc! expects a transient map");
+    }
+
+    STATIC_CAST(Hash, m_hash)->erase(key);
+}
+
+AST Transient::persistent()
+{
+    ensureEditable();
+    if ( m_items ) {
+        AST_vec* items = m_items;
+        m_items = NULL;
+        return type::vector(items);
+    }
+
+    AST hash = m_hash;
+    m_hash = AST();
+    return hash;
+}
+
+int Transient::count() const
+{
+    ensureEditable();
+    return m_items ? m_items->size() : STATIC_CAST(Hash, m_hash)->size();
+}
+
+AST Transient::doWithMeta(AST meta) const
+{
+    throw LISP_ERROR("transients do not support metadata");
+}
+
+const std::string Transient::toString(bool readably) const
+{
+    std::ostringstream oss;
+    oss << "#transient(" << this << ")";
+    return oss.str();
+}
+
+
+// ================================
+// BUILTIN
+AST BuiltIn::apply(AST_iter argsBegin, AST_iter argsEnd) const
+{
+    return m_handler(m_name, argsBegin, argsEnd);
+}
+
+// ================================
+// LAMBDA
+static std::vector<const Name*> internAll(const std::vector<std::string>& names)
+{
+    std::vector<const Name*> interned;
+    interned.reserve(names.size());
+    for ( const std::string& name : names ) {
+        interned.push_back(Name::intern(name));
+    }
+    return interned;
+}
+
+Lambda::Lambda(const std::vector<std::string>& bindings, AST body, EnvPtr env)
+    : m_bindings(internAll(bindings)), m_body(body),
+    m_env(env), m_isMacro(false), m_isVariadic(false)
+{ }
+
+Lambda::Lambda(ScopePtr scope, bool isVariadic, AST body, EnvPtr env)
+    : m_body(body), m_env(env), m_isMacro(false),
+    m_scope(scope), m_isVariadic(isVariadic)
+{ }
+
+Lambda::Lambda(const Lambda& that, AST meta)
+    : Applicable(meta),
+    m_bindings(that.m_bindings), m_body(that.m_body),
+    m_env(that.m_env), m_isMacro(that.m_isMacro),
+    m_scope(that.m_scope), m_isVariadic(that.m_isVariadic)
+{ }
+
+Lambda::Lambda(const Lambda& that, bool isMacro)
+    : Applicable(that.m_meta),
+    m_bindings(that.m_bindings), m_body(that.m_body),
+    m_env(that.m_env), m_isMacro(isMacro),
+    m_scope(that.m_scope), m_isVariadic(that.m_isVariadic)
+{ }
+
+AST Lambda::doWithMeta(AST meta) const
+{
+    return new Lambda(*this, meta);
+}
+
+AST Lambda::apply(AST_iter argsBegin, AST_iter argsEnd) const
+{
+    return EVAL(m_body, makeEnv(argsBegin, argsEnd));
+}
+
+EnvPtr Lambda::makeEnv(AST_iter argsBegin, AST_iter argsEnd) const
+{
+    if ( !m_scope ) {
+        return EnvPtr(new Env(m_env, m_bindings, argsBegin, argsEnd));
+    }
+
+    const int paramCount = m_scope->size() - m_isVariadic;
+    const int argCount = std::distance(argsBegin, argsEnd);
+    if ( argCount < paramCount ) {
+        throw LISP_ERROR("Not enough parameters");
+    }
+    if ( argCount > paramCount && !m_isVariadic ) {
+        throw LISP_ERROR("Too many parameters");
+    }
+
+    EnvPtr env(new Env(m_env, m_scope));
+    for ( int slot = 0; slot < paramCount; ++slot ) {
+        env->bind(slot, *argsBegin++);
+    }
+    if ( m_isVariadic ) {
+        env->bind(paramCount, type::list(argsBegin, argsEnd));
+    }
+
+    return env;
+}
+
+bool Lambda::operator==(const Expression* rhs) const
+{
+    return this == rhs;
+}
+
+const std::string Lambda::toString(bool readably) const
+{
+    std::ostringstream oss;
+    if ( m_isMacro ) {
+        oss << "#user-macro(" << this << ")";
+    }
+    else {
+        oss << "#user-function(" << this << ")";
+    }
+
+    return oss.str();
+}
+
+
+// ================================
+// ANALYZED FORMS
+AST CompiledForm::eval(EnvPtr env)
+{
+    AST tail;
+    AST value = run(env, tail);
+    return value ? value : EVAL(tail, env);
+}
+
+FnForm::FnForm(const List& source, ScopePtr scope, bool isVariadic, AST body)
+    : CompiledForm(source),
+    m_scope(scope), m_isVariadic(isVariadic), m_body(body)
+{ }
+
+AST FnForm::run(EnvPtr& env, AST& tail) const
+{
+    return makeClosure(env);
+}
+
+AST FnForm::makeClosure(EnvPtr env) const
+{
+    if ( !vm::isEnabled() ) {
+        return type::lambda(m_scope, m_isVariadic, m_body, env);
+    }
+
+    if ( !m_code ) {
+        m_code = vm::compile(m_body);
+    }
+    return type::lambda(m_scope, m_isVariadic, m_code, env);
+}
+
+LetForm::LetForm(const List& source, ScopePtr scope,
+                 std::vector<Binding>&& bindings, AST body)
+    : CompiledForm(source),
+    m_scope(scope), m_bindings(std::move(bindings)), m_body(body)
+{ }
+
+AST LetForm::run(EnvPtr& env, AST& tail) const
+{
+    EnvPtr inner(new Env(env, m_scope));
+    for ( const Binding& binding : m_bindings ) {
+        inner->bind(binding.slot, binding.value->eval(inner));
+    }
+    env = inner;
+    tail = m_body;
+    return NULL;
+}
+
+IfForm::IfForm(const List& source, AST test, AST then, AST otherwise)
+    : CompiledForm(source),
+    m_test(test), m_then(then), m_otherwise(otherwise)
+{ }
+
+AST IfForm::run(EnvPtr& env, AST& tail) const
+{
+    const AST& branch = m_test->eval(env)->isTrue() ? m_then : m_otherwise;
+    if ( !branch ) {
+        return type::nilValue();
+    }
+    tail = branch;
+    return NULL;
+}
+
+DoForm::DoForm(const List& source, AST_vec&& body)
+    : CompiledForm(source), m_body(std::move(body))
+{ }
+
+AST DoForm::run(EnvPtr& env, AST& tail) const
+{
+    const int last = m_body.size() - 1;
+    for ( int i = 0; i < last; ++i ) {
+        m_body[i]->eval(env);
+    }
+    tail = m_body[last];
+    return NULL;
+}
+
+DefForm::DefForm(const List& source, const Name* name, AST value)
+    : CompiledForm(source), m_name(name), m_value(value)
+{ }
+
+AST DefForm::run(EnvPtr& env, AST& tail) const
+{
+    return env->set(m_name, m_value->eval(env));
+}
+
+AST QuoteForm::run(EnvPtr& env, AST& tail) const
+{
+    return item(1);
+}
+
+TryForm::TryForm(const List& source, AST body, ScopePtr scope, AST handler)
+    : CompiledForm(source), m_body(body), m_scope(scope), m_handler(handler)
+{ }
+
+AST TryForm::run(EnvPtr& env, AST& tail) const
+{
+    if ( !m_handler ) {
+        tail = m_body;
+        return NULL;
+    }
+
+    AST exception;
+    try {
+        return m_body->eval(env);
+    }
+    catch ( std::string& s ) {
+        exception = type::string(s);
+    }
+    catch ( EmptyInputException& ) {
+        return type::nilValue();
+    }
+    catch ( AST& o ) {
+        exception = o;
+    }
+
+    env = EnvPtr(new Env(env, m_scope));
+    env->bind(0, exception);
+    tail = m_handler;
+    return NULL;
+}
+
+std::vector<AST_vec*> ArgBuffer::s_spare;
+
+CallForm::CallForm(const List& source, AST op, AST_vec&& args)
+    : CompiledForm(source), m_op(op), m_args(std::move(args))
+{ }
+
+AST CallForm::run(EnvPtr& env, AST& tail) const
+{
+    AST op = m_op->eval(env);
+    const Lambda* lambda = DYNAMIC_CAST(Lambda, op);
+    if ( lambda && lambda->isMacro() ) {
+        tail = m_expansion.expand(*this, op, env);
+        return NULL;
+    }
+
+    ArgBuffer buffer;
+    AST_vec& args = buffer.items();
+    for ( const AST& arg : m_args ) {
+        args.push_back(arg->eval(env));
+    }
+
+    if ( lambda ) {
+        env = lambda->makeEnv(args.begin(), args.end());
+        tail = lambda->getBody();
+        return NULL;
+    }
+    return APPLY(op, args.begin(), args.end());
+}
+
+EvalForm::EvalForm(const List& source, AST form)
+    : CompiledForm(source), m_form(form)
+{
+    // anything else headed by a symbol is a special form
+    const Symbol* head = source.isEmpty() ? NULL : DYNAMIC_CAST(Symbol, source.item(0));
+    if ( head && head->name()->special() == Name::NOT_SPECIAL ) {
+        m_head = new GlobalSymbol(head->name());
+    }
+}
+
+AST EvalForm::run(EnvPtr& env, AST& tail) const
+{
+    if ( m_head ) {
+        AST op = m_head->eval(env);
+        const Lambda* lambda = DYNAMIC_CAST(Lambda, op);
+        if ( lambda && lambda->isMacro() ) {
+            tail = m_expansion.expand(*this, op, env);
+            return NULL;
+        }
+    }
+
+    tail = m_form;
+    return NULL;
+}
+
+AST MacroExpansion::expand(const List& call, AST macro, EnvPtr env)
+{
+    if ( macro != m_macro ) {
+        const Lambda* lambda = STATIC_CAST(Lambda, macro);
+        m_expansion = analyzeTopLevel(lambda->apply(call.begin() + 1, call.end()), env);
+        m_macro = macro;
+    }
+    return m_expansion;
+}
+
+
+// ================================
+// RECORD TYPE
+RecordType::RecordType(const std::string& name, AST_iter fieldsBegin, AST_iter fieldsEnd)
+    : m_name(name), m_fields(fieldsBegin, fieldsEnd)
+{
+    for ( auto it = fieldsBegin; it != fieldsEnd; ++it ) {
+        VALUE_CAST(Keyword, *it);
+    }
+}
+
+RecordType::RecordType(const RecordType& that, AST meta)
+    : Applicable(meta), m_name(that.m_name), m_fields(that.m_fields)
+{ }
+
+int RecordType::slotOf(AST key) const
+{
+    const Keyword* keyword = DYNAMIC_CAST(Keyword, key);
+    if ( !keyword ) {
+        return -1;
+    }
+
+    for ( int i = 0; i < fieldCount(); ++i ) {
+        if ( m_fields[i]->isEqualTo(keyword) ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+AST RecordType::apply(AST_iter argsBegin, AST_iter argsEnd) const
+{
+    checkArgsIs("->" + m_name, fieldCount(), std::distance(argsBegin, argsEnd));
+    return AST(new Record(AST(const_cast<RecordType*>(this)),
+        AST_vec(argsBegin, argsEnd), AST()));
+}
+
+AST RecordType::fromMap(AST map) const
+{
+    const Hash* hash = VALUE_CAST(Hash, map);
+    AST_vec slots(fieldCount(), type::nilValue());
+    AST_vec extra;
+
+    AST keyList = hash->keys();
+    const Sequence* keys = STATIC_CAST(Sequence, keyList);
+    for ( auto it = keys->begin(), end = keys->end(); it != end; ++it ) {
+        const int slot = slotOf(*it);
+        if ( slot >= 0 ) {
+            slots[slot] = hash->get(*it);
+        }
+        else {
+            extra.push_back(*it);
+            extra.push_back(hash->get(*it));
+        }
+    }
+
+    return AST(new Record(AST(const_cast<RecordType*>(this)), std::move(slots),
+        extra.empty() ? AST() : type::hash(extra.begin(), extra.end(), true)));
+}
+
+const std::string RecordType::toString(bool readably) const
+{
+    return "#record-type(" + m_name + ")";
+}
+
+
+// ================================
+// RECORD
+Record::Record(AST recordType, AST_vec&& slots, AST extra)
+    : m_type(recordType), m_slots(std::move(slots)), m_extra(extra)
+{ }
+
+Record::Record(const Record& that, AST meta)
+    : Expression(meta), m_type(that.m_type), m_slots(that.m_slots),
+    m_extra(that.m_extra)
+{ }
+
+const RecordType* Record::layout() const
+{
+    return STATIC_CAST(RecordType, m_type);
+}
+
+AST Record::get(AST key) const
+{
+    const int slot = layout()->slotOf(key);
+    if ( slot >= 0 ) {
+        return m_slots[slot];
+    }
+
+    return m_extra ? STATIC_CAST(Hash, m_extra)->get(key) : type::nilValue();
+}
+
+bool Record::contains(AST key) const
+{
+    return layout()->slotOf(key) >= 0
+        || (m_extra && STATIC_CAST(Hash, m_extra)->contains(key));
+}
+
+AST Record::assoc(AST_iter argsBegin, AST_iter argsEnd) const
+{
+    checkArgsEven("assoc", std::distance(argsBegin, argsEnd));
+
+    AST_vec slots(m_slots);
+    AST_vec extra;
+    for ( auto it = argsBegin; it != argsEnd; it += 2 ) {
+        const int slot = layout()->slotOf(*it);
+        if ( slot >= 0 ) {
+            slots[slot] = *(it + 1);
+        }
+        else {
+            extra.push_back(*it);
+            extra.push_back(*(it + 1));
+        }
+    }
+
+    AST newExtra = m_extra;
+    if ( !extra.empty() ) {
+        newExtra = m_extra ? STATIC_CAST(Hash, m_extra)->assoc(extra.begin(), extra.end())
+                           : type::hash(extra.begin(), extra.end(), true);
+    }
+
+    return AST(new Record(m_type, std::move(slots), newExtra));
+}
+
+AST Record::dissoc(AST_iter argsBegin, AST_iter argsEnd) const
+{
+    // without one of its fields it is no longer a record, just a map
+    for ( auto it = argsBegin; it != argsEnd; ++it ) {
+        if ( layout()->slotOf(*it) >= 0 ) {
+            AST_vec entries;
+            AST keyList = keys();
+            const Sequence* keySeq = STATIC_CAST(Sequence, keyList);
+            for ( auto key = keySeq->begin(), end = keySeq->end(); key != end; ++key ) {
+                entries.push_back(*key);
+                entries.push_back(get(*key));
+            }
+
+            AST hash = type::hash(entries.begin(), entries.end(), true);
+            return STATIC_CAST(Hash, hash)->dissoc(argsBegin, argsEnd);
+        }
+    }
+
+    if ( !m_extra ) {
+        return AST(const_cast<Record*>(this));
+    }
+
+    AST extra = STATIC_CAST(Hash, m_extra)->dissoc(argsBegin, argsEnd);
+    AST extraKeys = STATIC_CAST(Hash, extra)->keys();
+    const bool isEmpty = STATIC_CAST(Sequence, extraKeys)->isEmpty();
+    return AST(new Record(m_type, AST_vec(m_slots), isEmpty ? AST() : extra));
+}
+
+AST Record::keys() const
+{
+    AST_vec* keys = new AST_vec();
+    for ( int i = 0; i < layout()->fieldCount(); ++i ) {
+        keys->push_back(layout()->field(i));
+    }
+
+    if ( m_extra ) {
+        AST extra = STATIC_CAST(Hash, m_extra)->keys();
+        const Sequence* extraKeys = STATIC_CAST(Sequence, extra);
+        keys->insert(keys->end(), extraKeys->begin(), extraKeys->end());
+    }
+    return type::list(keys);
+}
+
+AST Record::values() const
+{
+    AST_vec* values = new AST_vec(m_slots);
+    if ( m_extra ) {
+        AST extra = STATIC_CAST(Hash, m_extra)->values();
+        const Sequence* extraValues = STATIC_CAST(Sequence, extra);
+        values->insert(values->end(), extraValues->begin(), extraValues->end());
+    }
+    return type::list(values);
+}
+
+int Record::count() const
+{
+    int count = m_slots.size();
+    if ( m_extra ) {
+        AST extraKeys = STATIC_CAST(Hash, m_extra)->keys();
+        count += STATIC_CAST(Sequence, extraKeys)->count();
+    }
+    return count;
+}
+
+const std::string Record::toString(bool readably) const
+{
+    std::string res = "#" + layout()->name() + "{";
+    for ( size_t i = 0; i < m_slots.size(); ++i ) {
+        if ( i > 0 ) {
+            res += " ";
+        }
+        res += layout()->field(i)->toString(true) + " " + m_slots[i]->toString(readably);
+    }
+
+    if ( m_extra ) {
+        const std::string extra = m_extra->toString(readably);
+        if ( extra.size() > 2 ) {
+            if ( !m_slots.empty() ) {
+                res += " ";
+            }
+            res.append(extra, 1, extra.size() - 2);
+        }
+    }
+    return res + "}";
+}
+
+bool Record::operator==(const Expression* rhs) const
+{
+    const Record* other = static_cast<const Record*>(rhs);
+    if ( m_type != other->m_type || !m_extra != !other->m_extra ) {
+        return false;
+    }
+
+    for ( size_t i = 0; i < m_slots.size(); ++i ) {
+        if ( !m_slots[i]->isEqualTo(other->m_slots[i].ptr()) ) {
+            return false;
+        }
+    }
+    return !m_extra || m_extra->isEqualTo(other->m_extra.ptr());
 }
\ No newline at end of file
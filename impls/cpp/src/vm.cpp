@@ -0,0 +1,600 @@
+#include "vm.h"
+#include "analyzer.h"
+#include "environment.h"
+#include "lisp_error.h"
+
+#include <iomanip>
+#include <sstream>
+#include <typeinfo>
+
+// Dispatch jumps from the end of one instruction straight to the code for
+// the next through a table of label addresses, where the compiler
+// supports that (GCC and Clang); elsewhere it goes round a switch.
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO
+#endif
+
+namespace vm {
+
+static bool s_isEnabled = false;
+
+bool isEnabled()
+{
+    return s_isEnabled;
+}
+
+void setEnabled(bool isEnabled)
+{
+    s_isEnabled = isEnabled;
+}
+
+static const struct {
+    const char* name;
+    int operandCount;
+} opInfo[OP_COUNT] = {
+    { "CONST",         1 },
+    { "LOCAL",         3 },
+    { "GLOBAL",        1 },
+    { "DEF",           1 },
+    { "POP",           0 },
+    { "JUMP",          1 },
+    { "JUMP_IF_FALSE", 1 },
+    { "CHECK_MACRO",   2 },
+    { "CALL",          2 },
+    { "TAIL_CALL",     2 },
+    { "RETURN",        0 },
+    { "CLOSURE",       1 },
+    { "ENTER",         1 },
+    { "BIND",          1 },
+    { "LEAVE",         0 },
+    { "TRY",           3 },
+    { "EVAL_FORM",     1 },
+};
+
+
+// ================================
+// COMPILER
+
+class Compiler {
+public:
+    Compiler(Chunk* chunk) : m_chunk(chunk) { }
+
+    // Emits code that leaves the value of form on the stack, or, in tail
+    // position, returns it.
+    void compile(AST form, bool isTail);
+
+private:
+    bool compileForm(AST form, bool isTail);
+
+    void emit(int word) { m_chunk->m_code.push_back(word); }
+    int here() const { return m_chunk->m_code.size(); }
+
+    // emits a jump target to fill in later with patch
+    int emitTarget() { emit(0); return here() - 1; }
+    void patch(int target) { m_chunk->m_code[target] = here(); }
+
+    int constant(AST value);
+    int name(const Name* name);
+    int scope(ScopePtr scope);
+
+    Chunk* m_chunk;
+};
+
+void Compiler::compile(AST form, bool isTail)
+{
+    if ( compileForm(form, isTail) ) {
+        return;
+    }
+
+    if ( const LocalSymbol* local = DYNAMIC_CAST(LocalSymbol, form) ) {
+        emit(LOCAL);
+        emit(local->depth());
+        emit(local->slot());
+        emit(name(local->name()));
+    }
+    else if ( DYNAMIC_CAST(GlobalSymbol, form) ) {
+        emit(GLOBAL);
+        emit(constant(form));
+    }
+    else if ( DYNAMIC_CAST(Symbol, form) || DYNAMIC_CAST(Hash, form) || DYNAMIC_CAST(Set, form)
+              || (DYNAMIC_CAST(Sequence, form) && !STATIC_CAST(Sequence, form)->isEmpty()) ) {
+        emit(EVAL_FORM);
+        emit(constant(form));
+    }
+    else {
+        emit(CONST);
+        emit(constant(form));
+    }
+
+    if ( isTail ) {
+        emit(RETURN);
+    }
+}
+
+// Compiles the forms that run code of their own, returns false for the
+// rest, which just produce a value.
+bool Compiler::compileForm(AST form, bool isTail)
+{
+    if ( !DYNAMIC_CAST(CompiledForm, form) ) {
+        return false;
+    }
+
+    if ( const CallForm* call = DYNAMIC_CAST(CallForm, form) ) {
+        // the op may have been made a macro since this was analyzed, in
+        // which case the arguments are not evaluated but expanded
+        const int source = constant(form);
+        compile(call->op(), false);
+        emit(CHECK_MACRO);
+        emit(source);
+        int toEnd = emitTarget();
+        for ( const AST& arg : call->args() ) {
+            compile(arg, false);
+        }
+        emit(isTail ? TAIL_CALL : CALL);
+        emit(call->args().size());
+        emit(source);
+        patch(toEnd);
+        if ( isTail ) {
+            emit(RETURN);
+        }
+        return true;
+    }
+
+    if ( const IfForm* ifForm = DYNAMIC_CAST(IfForm, form) ) {
+        compile(ifForm->test(), false);
+        emit(JUMP_IF_FALSE);
+        int toOtherwise = emitTarget();
+        compile(ifForm->then(), isTail);
+
+        int toEnd = -1;
+        if ( !isTail ) {
+            emit(JUMP);
+            toEnd = emitTarget();
+        }
+
+        patch(toOtherwise);
+        AST otherwise = ifForm->otherwise();
+        compile(otherwise ? otherwise : type::nilValue(), isTail);
+        if ( !isTail ) {
+            patch(toEnd);
+        }
+        return true;
+    }
+
+    if ( const DoForm* doForm = DYNAMIC_CAST(DoForm, form) ) {
+        const AST_vec& body = doForm->body();
+        for ( size_t i = 0; i + 1 < body.size(); ++i ) {
+            compile(body[i], false);
+            emit(POP);
+        }
+        compile(body.back(), isTail);
+        return true;
+    }
+
+    if ( const LetForm* let = DYNAMIC_CAST(LetForm, form) ) {
+        emit(ENTER);
+        emit(scope(let->scope()));
+        for ( const LetForm::Binding& binding : let->bindings() ) {
+            compile(binding.value, false);
+            emit(BIND);
+            emit(binding.slot);
+        }
+        compile(let->body(), isTail);
+        if ( !isTail ) {
+            emit(LEAVE);
+        }
+        return true;
+    }
+
+    if ( const TryForm* tryForm = DYNAMIC_CAST(TryForm, form) ) {
+        if ( !tryForm->handler() ) {
+            compile(tryForm->body(), isTail);
+            return true;
+        }
+
+        // the body runs as a chunk of its own, so that the VM can run it
+        // inside a C++ try block
+        emit(TRY);
+        emit(constant(vm::compile(tryForm->body())));
+        emit(scope(tryForm->scope()));
+        int toEnd = emitTarget();
+        compile(tryForm->handler(), isTail);
+        if ( !isTail ) {
+            emit(LEAVE);
+        }
+        patch(toEnd);
+        if ( isTail ) {
+            emit(RETURN);
+        }
+        return true;
+    }
+
+    if ( const DefForm* def = DYNAMIC_CAST(DefForm, form) ) {
+        compile(def->value(), false);
+        emit(DEF);
+        emit(name(def->name()));
+    }
+    else if ( DYNAMIC_CAST(FnForm, form) ) {
+        emit(CLOSURE);
+        emit(constant(form));
+    }
+    else if ( const QuoteForm* quote = DYNAMIC_CAST(QuoteForm, form) ) {
+        emit(CONST);
+        emit(constant(quote->item(1)));
+    }
+    else {
+        // the EvalForm itself, which expands a macro call just once
+        emit(EVAL_FORM);
+        emit(constant(form));
+    }
+
+    if ( isTail ) {
+        emit(RETURN);
+    }
+    return true;
+}
+
+int Compiler::constant(AST value)
+{
+    m_chunk->m_constants.push_back(value);
+    return m_chunk->m_constants.size() - 1;
+}
+
+int Compiler::name(const Name* name)
+{
+    std::vector<const Name*>& names = m_chunk->m_names;
+    for ( size_t i = 0; i < names.size(); ++i ) {
+        if ( names[i] == name ) {
+            return i;
+        }
+    }
+
+    names.push_back(name);
+    return names.size() - 1;
+}
+
+int Compiler::scope(ScopePtr scope)
+{
+    m_chunk->m_scopes.push_back(scope);
+    return m_chunk->m_scopes.size() - 1;
+}
+
+AST compile(AST form)
+{
+    Chunk* chunk = new Chunk;
+    AST result(chunk);
+    Compiler(chunk).compile(form, true);
+    return result;
+}
+
+AST run(AST form, EnvPtr env)
+{
+    AST code = compile(analyzeTopLevel(form, env));
+    return execute(STATIC_CAST(Chunk, code), env);
+}
+
+
+// ================================
+// EXECUTION
+
+namespace {
+
+// a call to a compiled function that the VM is running
+struct Frame {
+    AST code;       // the Chunk, held in case nothing else holds it
+    int pc;
+    EnvPtr env;
+    size_t base;    // where the values of this call start on the stack
+};
+
+} // namespace
+
+AST execute(const Chunk* chunk, EnvPtr env)
+{
+    AST_vec stack;
+    stack.reserve(32);
+    std::vector<Frame> frames;
+    frames.push_back({ AST(const_cast<Chunk*>(chunk)), 0, env, 0 });
+
+    const Chunk* current = chunk;
+    const int* code = current->m_code.data();
+    int pc = 0;
+    bool isTail = false;
+
+#ifdef VM_COMPUTED_GOTO
+    static void* const labels[OP_COUNT] = {
+        &&op_CONST, &&op_LOCAL, &&op_GLOBAL, &&op_DEF, &&op_POP, &&op_JUMP,
+        &&op_JUMP_IF_FALSE, &&op_CHECK_MACRO, &&op_CALL, &&op_TAIL_CALL, &&op_RETURN,
+        &&op_CLOSURE, &&op_ENTER, &&op_BIND, &&op_LEAVE, &&op_TRY,
+        &&op_EVAL_FORM,
+    };
+#define VM_NEXT()   goto *labels[code[pc++]]
+#define VM_OP(op)   op_##op
+
+    VM_NEXT();
+#else
+#define VM_NEXT()   goto dispatch
+#define VM_OP(op)   case op
+
+dispatch:
+    switch ( code[pc++] ) {
+#endif
+
+    VM_OP(CONST): {
+        stack.push_back(current->m_constants[code[pc++]]);
+        VM_NEXT();
+    }
+
+    VM_OP(LOCAL): {
+        const Name* name = current->m_names[code[pc + 2]];
+        stack.push_back(env->get(code[pc], code[pc + 1], name));
+        pc += 3;
+        VM_NEXT();
+    }
+
+    VM_OP(GLOBAL): {
+        stack.push_back(current->m_constants[code[pc++]]->eval(env));
+        VM_NEXT();
+    }
+
+    VM_OP(DEF): {
+        AST value = stack.back();
+        stack.back() = env->set(current->m_names[code[pc++]], value);
+        VM_NEXT();
+    }
+
+    VM_OP(POP): {
+        stack.pop_back();
+        VM_NEXT();
+    }
+
+    VM_OP(JUMP): {
+        pc = code[pc];
+        VM_NEXT();
+    }
+
+    VM_OP(JUMP_IF_FALSE): {
+        const int target = code[pc++];
+        const bool isTrue = stack.back()->isTrue();
+        stack.pop_back();
+        if ( !isTrue ) {
+            pc = target;
+        }
+        VM_NEXT();
+    }
+
+    VM_OP(CHECK_MACRO): {
+        const AST& op = stack.back();
+        if ( typeid(*op.ptr()) == typeid(Lambda) && STATIC_CAST(Lambda, op)->isMacro() ) {
+            // the CallForm expands it
+            stack.back() = EVAL(current->m_constants[code[pc]], env);
+            pc = code[pc + 1];
+        }
+        else {
+            pc += 2;
+        }
+        VM_NEXT();
+    }
+
+    VM_OP(CALL): {
+        isTail = false;
+        goto call;
+    }
+
+    VM_OP(TAIL_CALL): {
+        isTail = true;
+        goto call;
+    }
+
+    call: {
+        const int argCount = code[pc];
+        pc += 2;
+
+        const size_t opIndex = stack.size() - argCount - 1;
+        AST op = stack[opIndex];
+        AST value;
+
+        // exact type checks, cheaper than dynamic_cast on every call
+        const std::type_info& opType = typeid(*op.ptr());
+        const Lambda* lambda = opType == typeid(Lambda) ? STATIC_CAST(Lambda, op) : NULL;
+        AST body = lambda ? lambda->getBody() : AST();
+
+        if ( lambda && typeid(*body.ptr()) == typeid(Chunk) ) {
+            EnvPtr calleeEnv = lambda->makeEnv(stack.begin() + opIndex + 1, stack.end());
+            if ( isTail ) {
+                stack.resize(frames.back().base);
+                frames.back().code = body;
+            }
+            else {
+                stack.resize(opIndex);
+                frames.back().pc = pc;
+                frames.back().env = env;
+                frames.push_back({ body, 0, calleeEnv, opIndex });
+            }
+
+            current = STATIC_CAST(Chunk, body);
+            code = current->m_code.data();
+            pc = 0;
+            env = calleeEnv;
+            VM_NEXT();
+        }
+        else if ( opType == typeid(BuiltIn) ) {
+            value = STATIC_CAST(BuiltIn, op)->apply(stack.begin() + opIndex + 1, stack.end());
+        }
+        else {
+            value = APPLY(op, stack.begin() + opIndex + 1, stack.end());
+        }
+
+        stack.resize(opIndex);
+        stack.push_back(value);
+        if ( isTail ) {
+            goto doReturn;
+        }
+        VM_NEXT();
+    }
+
+    VM_OP(RETURN):
+    doReturn: {
+        AST value = stack.back();
+        stack.resize(frames.back().base);
+        frames.pop_back();
+        if ( frames.empty() ) {
+            return value;
+        }
+
+        const Frame& caller = frames.back();
+        current = STATIC_CAST(Chunk, caller.code);
+        code = current->m_code.data();
+        pc = caller.pc;
+        env = caller.env;
+        stack.push_back(value);
+        VM_NEXT();
+    }
+
+    VM_OP(CLOSURE): {
+        const FnForm* form = STATIC_CAST(FnForm, current->m_constants[code[pc++]]);
+        stack.push_back(form->makeClosure(env));
+        VM_NEXT();
+    }
+
+    VM_OP(ENTER): {
+        env = EnvPtr(new Env(env, current->m_scopes[code[pc++]]));
+        VM_NEXT();
+    }
+
+    VM_OP(BIND): {
+        env->bind(code[pc++], stack.back());
+        stack.pop_back();
+        VM_NEXT();
+    }
+
+    VM_OP(LEAVE): {
+        env = env->outer();
+        VM_NEXT();
+    }
+
+    VM_OP(TRY): {
+        const Chunk* body = STATIC_CAST(Chunk, current->m_constants[code[pc]]);
+        const ScopePtr scope = current->m_scopes[code[pc + 1]];
+        const int end = code[pc + 2];
+        pc += 3;
+
+        AST exception;
+        try {
+            stack.push_back(execute(body, env));
+            pc = end;
+        }
+        catch ( std::string& s ) {
+            exception = type::string(s);
+        }
+        catch ( EmptyInputException& ) {
+            stack.push_back(type::nilValue());
+            pc = end;
+        }
+        catch ( AST& o ) {
+            exception = o;
+        }
+
+        // the handler follows, in a frame holding the exception
+        if ( exception ) {
+            env = EnvPtr(new Env(env, scope));
+            env->bind(0, exception);
+        }
+        VM_NEXT();
+    }
+
+    VM_OP(EVAL_FORM): {
+        stack.push_back(EVAL(current->m_constants[code[pc++]], env));
+        VM_NEXT();
+    }
+
+#ifndef VM_COMPUTED_GOTO
+    default:
+        throw LISP_ERROR("Bad bytecode");
+    }
+#endif
+
+#undef VM_NEXT
+#undef VM_OP
+}
+
+
+// ================================
+// CHUNK
+
+Chunk::Chunk(const Chunk& that, AST meta)
+    : Expression(meta), m_code(that.m_code), m_constants(that.m_constants),
+      m_names(that.m_names), m_scopes(that.m_scopes)
+{ }
+
+AST Chunk::eval(EnvPtr env)
+{
+    return execute(this, env);
+}
+
+std::string Chunk::disassemble() const
+{
+    std::ostringstream out;
+    std::vector<const Chunk*> nested;
+
+    for ( size_t pc = 0; pc < m_code.size(); ) {
+        const int op = m_code[pc];
+        const int* operands = &m_code[pc + 1];
+
+        out << std::setw(4) << std::setfill('0') << pc << "  ";
+        if ( opInfo[op].operandCount == 0 ) {
+            out << opInfo[op].name;
+        }
+        else {
+            out << std::left << std::setw(14) << std::setfill(' ') << opInfo[op].name
+                << std::right;
+        }
+        for ( int i = 0; i < opInfo[op].operandCount; ++i ) {
+            out << ' ' << operands[i];
+        }
+
+        switch ( op ) {
+            case CONST:
+            case GLOBAL:
+            case CLOSURE:
+            case EVAL_FORM:
+                out << "  ; " << m_constants[operands[0]]->toString(true);
+                break;
+            case CHECK_MACRO:
+                out << "  ; " << m_constants[operands[0]]->toString(true);
+                break;
+            case CALL:
+            case TAIL_CALL:
+                out << "  ; " << m_constants[operands[1]]->toString(true);
+                break;
+            case LOCAL:
+                out << "  ; " << m_names[operands[2]]->text();
+                break;
+            case DEF:
+                out << "  ; " << m_names[operands[0]]->text();
+                break;
+            case TRY:
+                out << "  ; body " << nested.size();
+                nested.push_back(STATIC_CAST(Chunk, m_constants[operands[0]]));
+                break;
+        }
+        out << '\n';
+
+        pc += 1 + opInfo[op].operandCount;
+    }
+
+    for ( size_t i = 0; i < nested.size(); ++i ) {
+        out << "body " << i << ":\n" << nested[i]->disassemble();
+    }
+
+    return out.str();
+}
+
+const std::string Chunk::toString(bool readably) const
+{
+    std::ostringstream oss;
+    oss << "#bytecode(" << this << ")";
+    return oss.str();
+}
+
+} // namespace vm
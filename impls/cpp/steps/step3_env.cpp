@@ -85,37 +85,41 @@ AST EVAL(AST ast, EnvPtr env)
     }
 
     if ( const Symbol* symbol = dynamic_cast<Symbol*>(list->item(0).ptr()) ) {
-        std::string special = symbol->value();
         int argCount = list->count() - 1;
 
-        if ( special == "def!" ) {
-            if ( argCount != 2 ) {
-                throw LISP_ERROR("\"def!\" expects 2 args, got" + std::to_string(argCount));
+        switch ( symbol->name()->special() ) {
+            case Name::DEF: {
+                if ( argCount != 2 ) {
+                    throw LISP_ERROR("\"def!\" expects 2 args, got" + std::to_string(argCount));
+                }
+
+                const Symbol* id = VALUE_CAST(Symbol, list->item(1));
+                return env->set(id->value(), EVAL(list->item(2), env));
             }
 
-            const Symbol* id = VALUE_CAST(Symbol, list->item(1));
-            return env->set(id->value(), EVAL(list->item(2), env));
-        }
+            case Name::LET: {
+                if ( argCount != 2 ) {
+                    throw LISP_ERROR("\"let*\" expects 2 args, got" + std::to_string(argCount));
+                }
 
-        if ( special == "let*" ) {
-            if ( argCount != 2 ) {
-                throw LISP_ERROR("\"let*\" expects 2 args, got" + std::to_string(argCount));
-            }
+                const Sequence* bindings = VALUE_CAST(Sequence, list->item(1));
 
-            const Sequence* bindings = VALUE_CAST(Sequence, list->item(1));
+                int count = bindings->count();
+                if ( count % 2 != 0 ) {
+                    throw LISP_ERROR("\"let*\" expects an even number of args");
+                }
 
-            int count = bindings->count();
-            if ( count % 2 != 0 ) {
-                throw LISP_ERROR("\"let*\" expects an even number of args");
-            }
+                EnvPtr inner(new Env(env));
+                for ( int i = 0; i < count; i += 2 ) {
+                    const Symbol* var = VALUE_CAST(Symbol, bindings->item(i));
+                    inner->set(var->value(), EVAL(bindings->item(i + 1), inner));
+                }
 
-            EnvPtr inner(new Env(env));
-            for ( int i = 0; i < count; i += 2 ) {
-                const Symbol* var = VALUE_CAST(Symbol, bindings->item(i));
-                inner->set(var->value(), EVAL(bindings->item(i + 1), inner));
+                return EVAL(list->item(2), inner);
             }
 
-            return EVAL(list->item(2), inner);
+            default:
+                break;
         }
     }
 
@@ -77,77 +77,81 @@ AST EVAL(AST ast, EnvPtr env)
 
     if ( const Symbol* symbol = DYNAMIC_CAST(Symbol, list->item(0)) ) {
 
-        std::string special = symbol->value();
         int argCount = list->count() - 1;
 
-        if ( special == "def!" ) {
-            if ( argCount != 2 ) {
-                throw LISP_ERROR("\"def!\" expects 2 args, got" + std::to_string(argCount));
+        switch ( symbol->name()->special() ) {
+            case Name::DEF: {
+                if ( argCount != 2 ) {
+                    throw LISP_ERROR("\"def!\" expects 2 args, got" + std::to_string(argCount));
+                }
+
+                const Symbol* id = VALUE_CAST(Symbol, list->item(1));
+                return env->set(id->value(), EVAL(list->item(2), env));
             }
 
-            const Symbol* id = VALUE_CAST(Symbol, list->item(1));
-            return env->set(id->value(), EVAL(list->item(2), env));
-        }
+            case Name::LET: {
+                if ( argCount != 2 ) {
+                    throw LISP_ERROR("\"let*\" expects 2 args, got" + std::to_string(argCount));
+                }
 
-        if ( special == "let*" ) {
-            if ( argCount != 2 ) {
-                throw LISP_ERROR("\"let*\" expects 2 args, got" + std::to_string(argCount));
-            }
+                const Sequence* bindings = VALUE_CAST(Sequence, list->item(1));
 
-            const Sequence* bindings = VALUE_CAST(Sequence, list->item(1));
+                int count = bindings->count();
+                if ( count % 2 != 0 ) {
+                    throw LISP_ERROR("\"let*\" expects an even number of args");
+                }
 
-            int count = bindings->count();
-            if ( count % 2 != 0 ) {
-                throw LISP_ERROR("\"let*\" expects an even number of args");
-            }
+                EnvPtr inner(new Env(env));
+                for ( int i = 0; i < count; i += 2 ) {
+                    const Symbol* var = VALUE_CAST(Symbol, bindings->item(i));
+                    inner->set(var->value(), EVAL(bindings->item(i + 1), inner));
+                }
 
-            EnvPtr inner(new Env(env));
-            for ( int i = 0; i < count; i += 2 ) {
-                const Symbol* var = VALUE_CAST(Symbol, bindings->item(i));
-                inner->set(var->value(), EVAL(bindings->item(i + 1), inner));
+                return EVAL(list->item(2), inner);
             }
 
-            return EVAL(list->item(2), inner);
-        }
+            case Name::DO: {
+                if ( argCount < 1 ) {
+                    throw LISP_ERROR("\"do\" expects at least 1 arg, got" + std::to_string(argCount));
+                }
 
-        if ( special == "do" ) {
-            if ( argCount < 1 ) {
-                throw LISP_ERROR("\"do\" expects at least 1 arg, got" + std::to_string(argCount));
-            }
+                for ( int i = 1; i < argCount; i++ ) {
+                    EVAL(list->item(i), env);
+                }
 
-            for ( int i = 1; i < argCount; i++ ) {
-                EVAL(list->item(i), env);
+                return EVAL(list->item(argCount), env);
             }
 
-            return EVAL(list->item(argCount), env);
-        }
+            case Name::FN: {
+                if ( argCount != 2 ) {
+                    throw LISP_ERROR("\"fn*\" expects 2 args, got" + std::to_string(argCount));
+                }
 
-        if ( special == "fn*" ) {
-            if ( argCount != 2 ) {
-                throw LISP_ERROR("\"fn*\" expects 2 args, got" + std::to_string(argCount));
-            }
+                const Sequence* bindings = VALUE_CAST(Sequence, list->item(1));
+                std::vector<std::string> params;
+                for ( size_t i = 0; i < bindings->count(); i++ ) {
+                    const Symbol* sym = VALUE_CAST(Symbol, bindings->item(i));
+                    params.push_back(sym->value());
+                }
 
-            const Sequence* bindings = VALUE_CAST(Sequence, list->item(1));
-            std::vector<std::string> params;
-            for ( int i = 0; i < bindings->count(); i++ ) {
-                const Symbol* sym = VALUE_CAST(Symbol, bindings->item(i));
-                params.push_back(sym->value());
+                return type::lambda(params, list->item(2), env);
             }
 
-            return type::lambda(params, list->item(2), env);
-        }
+            case Name::IF: {
+                if ( argCount < 2 || argCount > 3 ) {
+                    throw LISP_ERROR("\"if\" expects 2-3 args, got" + std::to_string(argCount));
+                }
 
-        if ( special == "if" ) {
-            if ( argCount < 2 || argCount > 3 ) {
-                throw LISP_ERROR("\"if\" expects 2-3 args, got" + std::to_string(argCount));
-            }
+                bool isTrue = EVAL(list->item(1), env)->isTrue();
+                if ( !isTrue && argCount == 2 ) {
+                    return type::nilValue();
+                }
 
-            bool isTrue = EVAL(list->item(1), env)->isTrue();
-            if ( !isTrue && argCount == 2 ) {
-                return type::nilValue();
+                return EVAL(list->item(isTrue ? 2 : 3), env);
             }
 
-            return EVAL(list->item(isTrue ? 2 : 3), env);
+            default:
+                break;
         }
     }
 
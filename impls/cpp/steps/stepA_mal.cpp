@@ -1,12 +1,17 @@
 #include <iostream>
+#include <cstring>
+#include <fstream>
 #include <string>
 
+#include "analyzer.h"
 #include "def.h"
 #include "parser.h"
 #include "types.h"
 #include "environment.h"
 #include "lisp_error.h"
 #include "core.h"
+#include "malc.h"
+#include "vm.h"
 
 static EnvPtr rootEnv(new Env);
 
@@ -22,8 +27,15 @@ static const char* malFunctionTable[] = {
     "(defmacro! cond (fn* (& xs) (if (> (count xs) 0) (list 'if (first xs) (if (> (count xs) 1) (nth xs 1) (throw \"odd number of forms to cond\")) (cons 'cond (rest (rest xs)))))))",
     "(def! not (fn* (cond) (if cond false true)))",
     "(def! load-file (fn* (filename) \
-        (eval (read-string (str \"(do \" (slurp filename) \"\nnil)\")))))",
+        (if (load-native filename) nil \
+          (eval (read-string (str \"(do \" (slurp filename) \"\nnil)\"))))))",
     "(def! *host-language* \"C++\")",
+    "(defmacro! lazy-seq (fn* (& body) (list 'lazy-seq* (list 'fn* [] (cons 'do body)))))",
+    "(defmacro! defrecord (fn* [name fields] \
+        (let* [ctor (symbol (str \"->\" name))] \
+          `(do (def! ~ctor (record-type* ~(str name) ~(vec (map (fn* [f] (keyword (str f))) fields)))) \
+               (def! ~(symbol (str \"map->\" name)) (fn* [m] (map->record* ~ctor m))) \
+               ~ctor))))",
     "(def! fib (fn* [n] (if (= n 0) 1 (if (= n 1) 1 (+ (fib (-n 1)) (fib(-n 2)))))))"
 };
 
@@ -39,11 +51,52 @@ bool read_line(const std::string& prompt, std::string& line)
     return true;
 }
 
+// what the malc script runs: writes the C++ module for a .mal file,
+// see malc.h
+static int compile(int argc, char* argv[])
+{
+    if ( argc != 2 ) {
+        std::cerr << "usage: malc file.mal module.cpp\n";
+        return 1;
+    }
+
+    rootEnv->set("*ARGV*", type::list(new AST_vec));
+    try {
+        const std::string code = malc::translate(argv[0], rootEnv);
+        std::ofstream out(argv[1]);
+        out << code;
+        if ( !out ) {
+            std::cerr << "cannot write " << argv[1] << "\n";
+            return 1;
+        }
+        return 0;
+    }
+    catch ( AST& mv ) {
+        std::cerr << "Error: " << mv->toString(true) << "\n";
+    }
+    catch ( std::string& s ) {
+        std::cerr << "Error: " << s << "\n";
+    }
+    return 1;
+}
+
 int main(int argc, char* argv[])
 {
     const std::string prompt = "user> ";
     std::string line;
 
+    // --engine=vm|tree picks how function bodies and top-level forms run
+    int firstArg = 1;
+    if ( argc > 1 && std::string(argv[1]).rfind("--engine=", 0) == 0 ) {
+        const std::string engine = argv[1] + std::strlen("--engine=");
+        if ( engine != "vm" && engine != "tree" ) {
+            std::cerr << "unknown engine " << engine << ", expected vm or tree\n";
+            return 1;
+        }
+        vm::setEnabled(engine == "vm");
+        firstArg = 2;
+    }
+
     installCore(rootEnv);
 
     // TODO move to core.h
@@ -52,15 +105,19 @@ int main(int argc, char* argv[])
         rep(function, rootEnv);
     }
 
+    if ( argc > firstArg && std::strcmp(argv[firstArg], "--compile") == 0 ) {
+        return compile(argc - firstArg - 1, argv + firstArg + 1);
+    }
+
     // make argv
     AST_vec* args = new AST_vec();
-    for ( int i = 2; i < argc; ++i ) {
+    for ( int i = firstArg + 1; i < argc; ++i ) {
         args->push_back(type::string(argv[i]));
     }
     rootEnv->set("*ARGV*", type::list(args));
 
-    if ( argc > 1 ) {
-        const std::string input = "(load-file " + escape(argv[1]) + ")";
+    if ( argc > firstArg ) {
+        const std::string input = "(load-file " + escape(argv[firstArg]) + ")";
         safe_rep(input, rootEnv);
         return 0;
     }
@@ -83,163 +140,187 @@ AST EVAL(AST ast, EnvPtr env)
     }
 
     while ( true ) {
+        if ( const CompiledForm* form = DYNAMIC_CAST(CompiledForm, ast) ) {
+            AST tail;
+            AST value = form->run(env, tail);
+            if ( value ) {
+                return value;
+            }
+            ast = tail;
+            continue;
+        }
+
         const List* list = DYNAMIC_CAST(List, ast);
         if ( !list  || list->count() == 0 ) {
+            // a form built with cons or concat may be a lazy sequence,
+            // which runs as the list it realizes to
+            if ( const LazySeq* lazy = DYNAMIC_CAST(LazySeq, ast) ) {
+                ast = lazy->toList();
+                continue;
+            }
             return ast->eval(env);
         }
 
         ast = macroExpand(ast, env);
         list = DYNAMIC_CAST(List, ast);
         if ( !list || (list->count() == 0) ) {
+            if ( DYNAMIC_CAST(LazySeq, ast) ) {
+                continue;
+            }
             return ast->eval(env);
         }
 
         if ( const Symbol* symbol = DYNAMIC_CAST(Symbol, list->item(0)) ) {
-            std::string special = symbol->value();
             int argCount = list->count() - 1;
 
-            if ( special == "def!" ) {
-                if ( argCount != 2 ) {
-                    throw LISP_ERROR("\"def!\" expects 2 args, got" + std::to_string(argCount));
+            switch ( symbol->name()->special() ) {
+                case Name::DEF: {
+                    if ( argCount != 2 ) {
+                        throw LISP_ERROR("\"def!\" expects 2 args, got" + std::to_string(argCount));
+                    }
+
+                    const Symbol* id = VALUE_CAST(Symbol, list->item(1));
+                    return env->set(id->name(), EVAL(list->item(2), env));
                 }
 
-                const Symbol* id = VALUE_CAST(Symbol, list->item(1));
-                return env->set(id->value(), EVAL(list->item(2), env));
-            }
+                case Name::DEFMACRO: {
+                    checkArgsIs("defmacro!", 2, argCount);
 
-            if ( special == "defmacro!" ) {
-                checkArgsIs("defmacro!", 2, argCount);
+                    const Symbol* id = VALUE_CAST(Symbol, list->item(1));
+                    AST body = EVAL(list->item(2), env);
+                    const Lambda* lambda = VALUE_CAST(Lambda, body);
+                    return env->set(id->name(), type::macro(*lambda));
+                }
 
-                const Symbol* id = VALUE_CAST(Symbol, list->item(1));
-                AST body = EVAL(list->item(2), env);
-                const Lambda* lambda = VALUE_CAST(Lambda, body);
-                return env->set(id->value(), type::macro(*lambda));
-            }
+                case Name::DO: {
+                    if ( argCount < 1 ) {
+                        throw LISP_ERROR("\"do\" expects at least 1 arg, got" + std::to_string(argCount));
+                    }
 
-            if ( special == "do" ) {
-                if ( argCount < 1 ) {
-                    throw LISP_ERROR("\"do\" expects at least 1 arg, got" + std::to_string(argCount));
+                    for ( int i = 1; i < argCount; i++ ) {
+                        EVAL(list->item(i), env);
+                    }
+                    ast = list->item(argCount);
+                    continue;
                 }
 
-                for ( int i = 1; i < argCount; i++ ) {
-                    EVAL(list->item(i), env);
-                }
-                ast = list->item(argCount);
-                continue;
-            }
+                case Name::FN: {
+                    if ( argCount != 2 ) {
+                        throw LISP_ERROR("\"fn*\" expects 2 args, got" + std::to_string(argCount));
+                    }
 
-            if ( special == "fn*" ) {
-                if ( argCount != 2 ) {
-                    throw LISP_ERROR("\"fn*\" expects 2 args, got" + std::to_string(argCount));
-                }
+                    AST analyzed = analyzeForm(ast, env);
+                    if ( const FnForm* form = DYNAMIC_CAST(FnForm, analyzed) ) {
+                        return form->makeClosure(env);
+                    }
 
-                const Sequence* bindings = VALUE_CAST(Sequence, list->item(1));
-                std::vector<std::string> params;
-                for ( int i = 0; i < bindings->count(); i++ ) {
-                    const Symbol* sym = VALUE_CAST(Symbol, bindings->item(i));
-                    params.push_back(sym->value());
+                    const Sequence* bindings = VALUE_CAST(Sequence, list->item(1));
+                    std::vector<std::string> params;
+                    for ( size_t i = 0; i < bindings->count(); i++ ) {
+                        const Symbol* sym = VALUE_CAST(Symbol, bindings->item(i));
+                        params.push_back(sym->value());
+                    }
+
+                    return type::lambda(params, list->item(2), env);
                 }
 
-                return type::lambda(params, list->item(2), env);
-            }
+                case Name::IF: {
+                    if ( argCount < 2 || argCount > 3 ) {
+                        throw LISP_ERROR("\"if\" expects 2-3 args, got" + std::to_string(argCount));
+                    }
 
-            if ( special == "if" ) {
-                if ( argCount < 2 || argCount > 3 ) {
-                    throw LISP_ERROR("\"if\" expects 2-3 args, got" + std::to_string(argCount));
+                    bool isTrue = EVAL(list->item(1), env)->isTrue();
+                    if ( !isTrue && argCount == 2 ) {
+                        return type::nilValue();
+                    }
+                    ast = list->item(isTrue ? 2 : 3);
+                    continue;
                 }
 
-                bool isTrue = EVAL(list->item(1), env)->isTrue();
-                if ( !isTrue && argCount == 2 ) {
-                    return type::nilValue();
+                case Name::LET: {
+                    if ( argCount != 2 ) {
+                        throw LISP_ERROR("\"let*\" expects 2 args, got" + std::to_string(argCount));
+                    }
+
+                    const Sequence* bindings = VALUE_CAST(Sequence, list->item(1));
+                    int count = bindings->count();
+                    if ( count % 2 != 0 ) {
+                        throw LISP_ERROR("\"let*\" expects an even number of args");
+                    }
+                    for ( int i = 0; i < count; i += 2 ) {
+                        VALUE_CAST(Symbol, bindings->item(i));
+                    }
+
+                    // runs as a LetForm from the top of the loop
+                    ast = analyzeForm(ast, env);
+                    continue;
                 }
-                ast = list->item(isTrue ? 2 : 3);
-                continue;
-            }
 
-            if ( special == "let*" ) {
-                if ( argCount != 2 ) {
-                    throw LISP_ERROR("\"let*\" expects 2 args, got" + std::to_string(argCount));
+                case Name::MACROEXPAND: {
+                    checkArgsIs("macroexpand", 1, argCount);
+                    return macroExpand(list->item(1), env);
                 }
 
-                const Sequence* bindings = VALUE_CAST(Sequence, list->item(1));
-                int count = bindings->count();
-                if ( count % 2 != 0 ) {
-                    throw LISP_ERROR("\"let*\" expects an even number of args");
+                case Name::QUASIQUOTEEXPAND: {
+                    checkArgsIs("quasiquote", 1, argCount);
+                    return quasiquote(list->item(1));
                 }
 
-                EnvPtr inner(new Env(env));
-                for ( int i = 0; i < count; i += 2 ) {
-                    const Symbol* var = VALUE_CAST(Symbol, bindings->item(i));
-                    inner->set(var->value(), EVAL(bindings->item(i + 1), inner));
+                case Name::QUASIQUOTE: {
+                    checkArgsIs("quasiquote", 1, argCount);
+                    ast = quasiquote(list->item(1));
+                    continue;
                 }
-                ast = list->item(2);
-                env = inner;
-                continue;
-            }
-
-            if ( special == "macroexpand" ) {
-                checkArgsIs("macroexpand", 1, argCount);
-                return macroExpand(list->item(1), env);
-            }
-
-            if ( special == "quasiquoteexpand" ) {
-                checkArgsIs("quasiquote", 1, argCount);
-                return quasiquote(list->item(1));
-            }
-
-            if ( special == "quasiquote" ) {
-                checkArgsIs("quasiquote", 1, argCount);
-                ast = quasiquote(list->item(1));
-                continue;
-            }
 
-            if ( special == "quote" ) {
-                checkArgsIs("quote", 1, argCount);
-                return list->item(1);
-            }
+                case Name::QUOTE: {
+                    checkArgsIs("quote", 1, argCount);
+                    return list->item(1);
+                }
 
-            if ( special == "try*" ) {
-                AST tryBody = list->item(1);
+                case Name::TRY: {
+                    AST tryBody = list->item(1);
 
-                if ( argCount == 1 ) {
-                    ast = EVAL(tryBody, env);
-                    continue;
-                }
+                    if ( argCount == 1 ) {
+                        ast = tryBody;
+                        continue;
+                    }
 
-                checkArgsIs("try*", 2, argCount);
-                const List* catchBlock = VALUE_CAST(List, list->item(2));
+                    checkArgsIs("try*", 2, argCount);
+                    const List* catchBlock = VALUE_CAST(List, list->item(2));
 
-                checkArgsIs("catch*", 2, catchBlock->count() - 1);
+                    checkArgsIs("catch*", 2, catchBlock->count() - 1);
 
-                if ( "catch*" != VALUE_CAST(Symbol, catchBlock->item(0))->value() ) {
-                    throw "catch block must begin with catch*";
-                }
+                    if ( VALUE_CAST(Symbol, catchBlock->item(0))->name()->special() != Name::CATCH ) {
+                        throw "catch block must begin with catch*";
+                    }
 
-                const Symbol* excSym = VALUE_CAST(Symbol, catchBlock->item(1));
+                    const Symbol* excSym = VALUE_CAST(Symbol, catchBlock->item(1));
 
-                AST excVal;
+                    AST excVal;
 
-                try {
-                    ast = EVAL(tryBody, env);
-                }
-                catch ( std::string& s ) {
-                    excVal = type::string(s);
-                }
-                catch ( EmptyInputException& ) {
-                    ast = type::nilValue();
-                }
-                catch ( AST& o ) {
-                    excVal = o;
-                }
+                    try {
+                        return EVAL(tryBody, env);
+                    }
+                    catch ( std::string& s ) {
+                        excVal = type::string(s);
+                    }
+                    catch ( EmptyInputException& ) {
+                        return type::nilValue();
+                    }
+                    catch ( AST& o ) {
+                        excVal = o;
+                    }
 
-                // got an exception
-                if ( excVal ) {
-                    env = EnvPtr(new Env(env));
-                    env->set(excSym->value(), excVal);
+                    // got an exception
+                    env = EnvPtr(new Env(env, ScopePtr(new Scope({ excSym->name() }))));
+                    env->bind(0, excVal);
                     ast = catchBlock->item(2);
+
+                    continue;
                 }
 
-                continue;
+                default:
+                    break;
             }
         }
 
@@ -309,9 +390,8 @@ static const Lambda* isMacroApplication(AST obj, EnvPtr env)
     }
 
     if ( Symbol* sym = DYNAMIC_CAST(Symbol, seq->item(0)) ) {
-        if ( EnvPtr symEnv = env->find(sym->value()) ) {
-            AST value = sym->eval(symEnv);
-            if ( Lambda* lambda = DYNAMIC_CAST(Lambda, value) ) {
+        if ( const AST* value = env->findValue(sym->name()) ) {
+            if ( Lambda* lambda = DYNAMIC_CAST(Lambda, *value) ) {
                 return lambda->isMacro() ? lambda : NULL;
             }
         }
@@ -345,6 +425,10 @@ AST APPLY(AST op, AST_iter argsBegin, AST_iter argsEnd)
     const Applicable* handler = DYNAMIC_CAST(Applicable, op);
 
     if ( handler == NULL ) {
+        if ( const Keyword* keyword = DYNAMIC_CAST(Keyword, op) ) {
+            int argCount = checkArgsBetween(keyword->value(), 1, 2, std::distance(argsBegin, argsEnd));
+            return keyword->lookup(*argsBegin, argCount == 2 ? *(argsBegin + 1) : type::nilValue());
+        }
         throw LISP_ERROR(op->toString(true), " not applicable");
     }
 
@@ -369,5 +453,8 @@ std::string safe_rep(const std::string& input, EnvPtr env)
 
 std::string rep(const std::string& input, EnvPtr env)
 {
+    if ( vm::isEnabled() ) {
+        return PRINT(vm::run(READ(input), env));
+    }
     return PRINT(EVAL(READ(input), env));
 }
\ No newline at end of file